@@ -28,22 +28,13 @@
 #include <avr/interrupt.h>
 
 #include "adb.h"
+#include "clock.h"
+#include "event.h"
+#include "stats.h"
 
 /// Address of last polled device
 uint8_t last_device;
 
-/// State values
-enum adb_states {
-  ADB_STATE_IDLE = 0,
-  ADB_STATE_TX_ATTN,
-  ADB_STATE_TX_SYNC,
-  ADB_STATE_TX_BIT_LOW,
-  ADB_STATE_TX_BIT_HIGH,
-  ADB_STATE_RX_WAIT,
-  ADB_STATE_RX_LOW,
-  ADB_STATE_RX_HIGH,
-  ADB_STATE_HOLD
-};
 /**
  * Current state. This ADB driver is interrupt-based and requires a
  * state machine to keep track of what's going on. A description of
@@ -51,27 +42,52 @@ enum adb_states {
  */
 uint8_t adb_state;
 
-// State information for transmitting a byte
-/**
- * Byte to transmit. An ADB command is 8b sent MSB first (followed by
- * a stop bit). This value will remain unchanged during the transmit
- * code and adb_tx_index will be used to reference the bit that is
- * currently being sent.
- */
-uint8_t adb_tx_data;
+// State information for transmitting
+/// Step flag: drive the line high. Without it the step drives it low.
+#define ADB_STEP_HIGH 0x8000
+/// Longest waveform: attention, sync, command, stop, then the start
+/// bit, ADB_LISTEN_MAX bytes and stop bit of a Listen data packet.
+#define ADB_WAVE_MAX (2 + 2 * 9 + 2 * (1 + 8 * ADB_LISTEN_MAX + 1))
 
 /**
- * Index of bit to transmit. References the bit position in adb_tx_data
- * that is currently being sent. This starts at 7 and decrements to 0.
- * Because ADB requires a stop bit, this variable is decremented past 0
- * to -1 and -2. The meanings of each of the possible values are:
- *
- * - 7-0: normal.
- * - -1: Sending the stop bit (same as 0).
- * - -2: Stop before sending anything, will transition to RX code
- *       when this value is hit.
+ * Transmit waveform. Built by adb_command() before the attention
+ * signal starts, so the compare interrupt only has to set the line and
+ * schedule the next step. Each step is the line level (ADB_STEP_HIGH)
+ * and how long to hold it, in timer1 counts.
  */
-int8_t adb_tx_index;
+uint16_t adb_tx_wave[ADB_WAVE_MAX];
+/// Index of the next step of adb_tx_wave.
+uint8_t adb_tx_step;
+/// Number of steps in adb_tx_wave.
+uint8_t adb_tx_steps;
+/// Non-zero if the waveform ends with a Listen data packet, so nothing
+/// is received afterwards.
+uint8_t adb_tx_listen;
+
+#if ADB_TX_SPI
+/// Samples of a Listen waveform after the attention signal, rounded up.
+#define ADB_SPI_BYTES 96
+/// Convert timer1 counts to SPI samples, rounded to the nearest.
+#define ADB_SPI_SAMPLES(ticks) \
+  (((ticks) + CLOCK_US(ADB_SPI_US) / 2) / CLOCK_US(ADB_SPI_US))
+/// Length of a step after rounding to SPI samples, in us.
+#define ADB_SPI_ACTUAL_US(us) (ADB_SPI_SAMPLES(CLOCK_US(us)) * ADB_SPI_US)
+
+// The rounded waveform has to stay within the spec: bit cells 100us
+// +/-3%, low times 35us or 65us +/-5%. The sync signal is 70us here.
+_Static_assert((ADB_SPI_ACTUAL_US(35) >= 33) && (ADB_SPI_ACTUAL_US(35) <= 37),
+               "ADB 1 low time out of tolerance");
+_Static_assert((ADB_SPI_ACTUAL_US(65) >= 62) && (ADB_SPI_ACTUAL_US(65) <= 68),
+               "ADB 0 low time out of tolerance");
+_Static_assert((ADB_SPI_ACTUAL_US(35) + ADB_SPI_ACTUAL_US(65) >= 97) &&
+               (ADB_SPI_ACTUAL_US(35) + ADB_SPI_ACTUAL_US(65) <= 103),
+               "ADB bit cell out of tolerance");
+_Static_assert((ADB_SPI_ACTUAL_US(70) >= 66) && (ADB_SPI_ACTUAL_US(70) <= 74),
+               "ADB sync time out of tolerance");
+
+/// Transmit waveform as SPI samples, see adb_spi_encode().
+uint8_t adb_spi_buf[ADB_SPI_BYTES];
+#endif
 
 // State information for receiving data
 /// Received data
@@ -79,94 +95,288 @@ uint8_t adb_rx_data[9];
 /// Number of bits received
 uint8_t adb_rx_count;
 
+#if ADB_RX_SAMPLED
+/// Line samples from the first low one on, MSB first, 1 for high.
+uint8_t adb_rx_samples[ADB_RX_SAMPLES / 8];
+/// Number of samples in adb_rx_samples.
+uint16_t adb_rx_nsamp;
+/// Samples not yet stored in adb_rx_samples.
+uint8_t adb_rx_acc;
+/// Samples waited for the start bit, then length of the current high run.
+uint8_t adb_rx_run;
+/// Samples waited for the start bit of the last response.
+uint8_t adb_rx_wait;
+/// Timer2 count at the end of the last sample, see adb_rx_decode().
+uint8_t adb_rx_cost;
+#endif
+
+/// Milliseconds left in the bringup sequence (see adb_init()).
+uint16_t adb_reset_ms;
+
+// Supervisor state, see adb_tick()
+/// State, transmit step and bit count seen at the last tick.
+uint8_t adb_watch[3];
+/// Milliseconds since the state machine last moved.
+uint8_t adb_stall_ms;
+/// clock_us() when the current transaction started.
+uint32_t adb_txn_start;
+/// Timer1 count at the last receive edge.
+uint16_t adb_rx_edge;
+/// Timer1 count at the last falling receive edge, the start of a bit cell.
+uint16_t adb_rx_fall;
+/// Low time of the current bit cell, in timer1 counts.
+uint16_t adb_rx_low;
+/// Length of the last whole bit cell, in timer1 counts.
+uint16_t adb_rx_cell;
+
+#ifdef ADB_FAULT_INJECT
+/// Edges left until the next one is dropped.
+uint16_t adb_fault_count = ADB_FAULT_INJECT;
+#endif
+
+
+/**
+ * Append a bit to the transmit waveform. A 0 is 65us low then 35us
+ * high, a 1 is 35us low then 65us high.
+ */
+static void adb_wave_bit(uint8_t bit)
+{
+  if (bit) {
+    adb_tx_wave[adb_tx_steps++] = CLOCK_US(35);
+    adb_tx_wave[adb_tx_steps++] = ADB_STEP_HIGH | CLOCK_US(65);
+  } else {
+    adb_tx_wave[adb_tx_steps++] = CLOCK_US(65);
+    adb_tx_wave[adb_tx_steps++] = ADB_STEP_HIGH | CLOCK_US(35);
+  }
+}
+
+/// Append a byte to the transmit waveform, MSB first.
+static void adb_wave_byte(uint8_t data)
+{
+  uint8_t i;
+
+  for (i = 0x80; i != 0; i >>= 1) {
+    adb_wave_bit(data & i);
+  }
+}
 
 /**
- * Timer0 compare interrupt. Triggered when timer0 matches the compare
+ * Schedule the next compare interrupt relative to the last one, so
+ * that the bit timing does not depend on how late the handler ran.
+ */
+static inline void adb_timer_after(uint16_t ticks)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    OCR1A += ticks;
+  }
+}
+
+/**
+ * Schedule the next compare interrupt relative to now and clear any
+ * stale match.
+ */
+static inline void adb_timer_from(uint16_t now, uint16_t ticks)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    OCR1A = now + ticks;
+  }
+  TIFR = _BV(OCF1A); // write one to clear only this flag
+}
+
+/**
+ * The transmit waveform is done. Release the line and either go idle
+ * after a Listen or wait up to 240us for a response.
+ */
+static void adb_tx_done(void)
+{
+  ADB_PORT = ADB_TX_1;
+  if (adb_tx_listen) {
+    // Listen data has been sent. Release the line, nothing comes back.
+    // With the SPI shifter MOSI would stay an output driving low, and
+    // a low of 3ms resets the bus.
+    DDRB = ADB_DDR_TX;
+    TIMSK &= ~(_BV(OCIE1A)); // disable timer interrupt
+    adb_tx_listen = 0;
+    adb_state = ADB_STATE_IDLE;
+    event_post(EVENT_ADB);
+    return;
+  }
+  adb_state = ADB_STATE_RX_WAIT;
+  // Set up port to receive data
+  DDRB = ADB_DDR_RX;
+#if ADB_RX_SAMPLED
+  // Sample the line from here on, the sampler times out by itself
+  TIMSK &= ~(_BV(OCIE1A)); // disable timer interrupt
+  adb_rx_nsamp = 0;
+  adb_rx_run = 0;
+  TCNT2 = 0;
+  TIFR = _BV(OCF2);
+  TIMSK |= _BV(OCIE2);
+#else
+  // Enable INT2 to catch a falling edge
+  GICR &= ~(_BV(5));
+  MCUCSR &= ~(_BV(6));
+  GIFR = _BV(INTF2);
+  GICR |= _BV(5);
+  // Start counting time, up to 240us
+  adb_rx_edge = clock_ticks();
+  adb_timer_from(adb_rx_edge, CLOCK_US(240));
+  TIMSK |= _BV(OCIE1A); // enable interrupt
+#endif
+}
+
+#if ADB_TX_SPI
+/**
+ * Turn the transmit waveform after the attention signal into SPI
+ * samples, ADB_SPI_US each, MSB first. The last byte is padded with
+ * high samples, the line is released then anyway. adb_tx_steps becomes
+ * the number of bytes and adb_tx_step the next byte to send.
+ */
+static void adb_spi_encode(void)
+{
+  uint8_t i;
+  uint8_t n = 0;
+  uint8_t level;
+  uint16_t samples;
+  uint8_t acc = 0;
+  uint8_t bits = 0;
+
+  for (i = 0; i < adb_tx_steps; i++) {
+    level = (adb_tx_wave[i] & ADB_STEP_HIGH) ? 1 : 0;
+    samples = ADB_SPI_SAMPLES(adb_tx_wave[i] & ~ADB_STEP_HIGH);
+    while (samples--) {
+      acc = (acc << 1) | level;
+      if (++bits == 8) {
+        adb_spi_buf[n++] = acc;
+        bits = 0;
+      }
+    }
+  }
+  if (bits) {
+    adb_spi_buf[n++] = (acc << (8 - bits)) | (0xff >> bits);
+  }
+
+  adb_tx_steps = n;
+  adb_tx_step = 0;
+}
+
+/**
+ * Hand the line over to the SPI shifter. MOSI is strapped to the ADB
+ * line, so the ADB pin itself goes to input while MOSI drives.
+ */
+static inline void adb_spi_start(void)
+{
+  DDRB = ADB_DDR_SPI;
+  SPCR = _BV(SPIE) | _BV(SPE) | _BV(MSTR) | _BV(SPR1); // fosc/64
+  SPDR = adb_spi_buf[adb_tx_step++];
+}
+
+/**
+ * SPI transfer complete interrupt. Feeds the shifter the next byte of
+ * the waveform; once it is all out, MOSI goes back to input.
+ */
+ISR(SPI_STC_vect, ISR_NOBLOCK)
+{
+  stats_isr_enter();
+  if (adb_tx_step < adb_tx_steps) {
+    SPDR = adb_spi_buf[adb_tx_step++];
+  } else {
+    SPCR = 0;
+    adb_tx_done();
+  }
+  stats_isr_leave();
+}
+#endif
+
+/**
+ * Store a received bit. A device that babbles past the buffer gets its
+ * extra bits dropped and the frame thrown out as malformed. The count
+ * saturates so it cannot wrap back into range.
+ */
+static inline void adb_rx_store(uint8_t bit)
+{
+  if (adb_rx_count < 8 * sizeof(adb_rx_data)) {
+    adb_rx_data[adb_rx_count / 8] |= bit << (7 - (adb_rx_count % 8));
+  }
+  if (adb_rx_count < 0xff) {
+    adb_rx_count++;
+  }
+}
+
+/**
+ * Timer1 compare A interrupt. Triggered when timer1 matches the compare
  * value. This is used to make the ADB code send out the next bit.
  */
-ISR(TIMER0_COMP_vect, ISR_NOBLOCK)
+ISR(TIMER1_COMPA_vect, ISR_NOBLOCK)
 {
-  TCNT0 = 0;
+  uint16_t step;
 
+  stats_isr_enter();
   PORTA &= ~(_BV(0));
 
   switch (adb_state) {
 
-  case ADB_STATE_TX_ATTN:
-    // Just finished sending the ATTN pulse.
-    adb_state = ADB_STATE_TX_SYNC;
-    ADB_PORT = ADB_TX_1;
-    // Set up timer for 70us.
-    TCCR0 = 0xa;
-    OCR0 = 70 / 0.5;
+  case ADB_STATE_TX:
+#if ADB_TX_SPI
+    // Attention is over, the shifter sends the rest.
+    TIMSK &= ~(_BV(OCIE1A)); // disable timer interrupt
+    adb_spi_start();
     break;
-
-  case ADB_STATE_TX_SYNC:
-    // Just finished the SYNC pulse, which is the same as...
-  case ADB_STATE_TX_BIT_HIGH:
-    // Just finished the high part of a bit.
-    if (adb_tx_index == -2) {
-      adb_state = ADB_STATE_RX_WAIT;
-      // Set up port to receive data
-      ADB_PORT = ADB_TX_1;
-      DDRB = 0x00;
-      // Enable INT2 to catch a falling edge
-      GICR &= ~(_BV(5));
-      MCUCSR &= ~(_BV(6));
-      GIFR |= _BV(5);
-      GICR |= _BV(5);
-      // Start counting time, up to 240us
-      TCCR0 = 0xb;
-      OCR0 = 240 / 4;
+#endif
+    if (adb_tx_step < adb_tx_steps) {
+      // Next step of the waveform.
+      step = adb_tx_wave[adb_tx_step++];
+      ADB_PORT = (step & ADB_STEP_HIGH) ? ADB_TX_1 : ADB_TX_0;
+      adb_timer_after(step & ~ADB_STEP_HIGH);
       break;
     }
-    ADB_PORT = ADB_TX_0;
-    adb_state = ADB_STATE_TX_BIT_LOW;
-    // Set up timer for either 35us or 65us.
-    if (adb_tx_index == -1) {
-      OCR0 = 65 / 0.5;
-    } else if (((adb_tx_data >> adb_tx_index) & 0x1) == 0) {
-      OCR0 = 65 / 0.5;
-    } else {
-      OCR0 = 35 / 0.5;
-    }
-    break;
-
-  case ADB_STATE_TX_BIT_LOW:
-    ADB_PORT = ADB_TX_1;
-    adb_state = ADB_STATE_TX_BIT_HIGH;
-    // Set up timer for either 65us or 35us.
-    if (adb_tx_index == -1) {
-      OCR0 = 35 / 0.5;
-    } else if (((adb_tx_data >> adb_tx_index) & 0x1) == 0) {
-      OCR0 = 35 / 0.5;
-    } else {
-      OCR0 = 65 / 0.5;
-    }
-    adb_tx_index--;
+    adb_tx_done();
     break;
 
   case ADB_STATE_RX_LOW:
-    // About 128us have elapsed since the last bit received had started.
-    // The ADB device has stopped sending data and we need to stop
-    // receiving data.
-    TIMSK &= ~(_BV(1)); // disable timer interrupt
+    // The line has been high for 110us, longer than any bit. The ADB
+    // device has stopped sending data and we need to stop receiving
+    // data. The last cell, the stop bit, never ends, so it is a 1 if
+    // its low phase was under half the cell before it.
+    adb_rx_store((adb_rx_low << 1) < adb_rx_cell);
+    TIMSK &= ~(_BV(OCIE1A)); // disable timer interrupt
     // Disable INT2
     GICR &= ~(_BV(5));
     PORTA |= _BV(2);
+    stats_mark(STATS_STAMP_ADB_FRAME);
+    stats_rx.irqs++;
+    stats_rx.frames++;
     // All done!
     adb_state = ADB_STATE_HOLD;
+    event_post(EVENT_ADB);
+    break;
+
+  case ADB_STATE_RX_HIGH:
+    // The line has been low for 110us, longer than any bit. Either the
+    // rising edge was missed or the device is holding the line, so the
+    // frame ends here rather than at the supervisor. The bit that was
+    // cut short is not counted, so the frame reads as malformed and the
+    // main loop retries it.
+    TIMSK &= ~(_BV(OCIE1A)); // disable timer interrupt
+    // Disable INT2
+    GICR &= ~(_BV(5));
+    PORTA |= _BV(2);
+    stats_mark(STATS_STAMP_ADB_FRAME);
+    stats_rx.frames++;
+    adb_state = ADB_STATE_HOLD;
+    event_post(EVENT_ADB);
     break;
 
   case ADB_STATE_RX_WAIT:
     // 240us have elapsed since the stop bit. If an external interrupt
     // had fired by this point the state would have been modified and
     // we wouldn't get here. Re-initialize everything.
-    TIMSK &= ~(_BV(1)); // disable timer interrupt
+    TIMSK &= ~(_BV(OCIE1A)); // disable timer interrupt
     // Disable INT2
     GICR &= ~(_BV(5));
     // All done!
     adb_state = ADB_STATE_IDLE;
+    event_post(EVENT_ADB);
     break;
 
   default:
@@ -174,46 +384,211 @@ ISR(TIMER0_COMP_vect, ISR_NOBLOCK)
   }
 
   PORTA |= _BV(0);
+  stats_isr_leave();
 
   return;
 }
 
+#if ADB_RX_SAMPLED
+/**
+ * Store one sample of a response and detect the end of the frame.
+ */
+static inline void adb_rx_sample(uint8_t level)
+{
+  if (adb_state == ADB_STATE_RX_WAIT) {
+    // First low sample, the start bit.
+    PORTA &= ~(_BV(2));
+    adb_state = ADB_STATE_RX_LOW;
+    adb_rx_wait = adb_rx_run;
+    adb_rx_run = 0;
+  }
+
+  adb_rx_acc = (adb_rx_acc << 1) | level;
+  adb_rx_nsamp++;
+  if ((adb_rx_nsamp % 8) == 0) {
+    adb_rx_samples[adb_rx_nsamp / 8 - 1] = adb_rx_acc;
+  }
+
+  if (level) {
+    adb_rx_run++;
+  } else {
+    adb_rx_run = 0;
+  }
+  if ((adb_rx_run >= 130 / ADB_RX_SAMPLE_US) ||
+      (adb_rx_nsamp >= ADB_RX_SAMPLES)) {
+    // Timer2 restarted from 0 at the compare match, so this is how long
+    // one sample took, entry latency included.
+    adb_rx_cost = TCNT2;
+    // End of the frame. Store the partial byte, left aligned.
+    TIMSK &= ~(_BV(OCIE2));
+    if (adb_rx_nsamp % 8) {
+      adb_rx_samples[adb_rx_nsamp / 8] = adb_rx_acc << (8 - (adb_rx_nsamp % 8));
+    }
+    PORTA |= _BV(2);
+    stats_mark(STATS_STAMP_ADB_FRAME);
+    stats_rx.frames++;
+    adb_state = ADB_STATE_HOLD;
+    event_post(EVENT_ADB);
+  }
+}
+
+/**
+ * Timer2 compare interrupt. Samples the ADB line every
+ * ADB_RX_SAMPLE_US while a response is expected. Sampling starts with
+ * the first low sample, up to 240us after the stop bit, and ends once
+ * the line has been high for 130us, which no bit lasts.
+ *
+ * At 10us this runs every 160 cycles and holds up V-USB's INT0 like
+ * any other handler, so it only shifts and stores the sample. It is
+ * not counted in stats_isr, and its cost is worked out once per frame
+ * in adb_rx_decode().
+ */
+ISR(TIMER2_COMP_vect, ISR_NOBLOCK)
+{
+  uint8_t level = (ADB_PIN & ADB_TX_1) ? 1 : 0;
+
+#ifdef ADB_FAULT_INJECT
+  // Flip a sample now and then, as if the line was noisy.
+  if (--adb_fault_count == 0) {
+    adb_fault_count = ADB_FAULT_INJECT;
+    level ^= 1;
+  }
+#endif
+
+  PORTA &= ~(_BV(1));
+
+  if ((adb_state == ADB_STATE_RX_WAIT) && level) {
+    if (++adb_rx_run >= 240 / ADB_RX_SAMPLE_US) {
+      // No response.
+      TIMSK &= ~(_BV(OCIE2));
+      adb_state = ADB_STATE_IDLE;
+      stats_rx.irqs += 240 / ADB_RX_SAMPLE_US;
+      event_post(EVENT_ADB);
+    }
+  } else {
+    adb_rx_sample(level);
+  }
+
+  PORTA |= _BV(1);
+}
+
+/**
+ * Turn the samples into bits. Each bit is a low run followed by a high
+ * run, and is a 1 if the low run is the shorter one. The stop bit's
+ * high run never ends, so it is a 1 if its low run is under half the
+ * bit before it. The result goes to adb_rx_data and adb_rx_count just
+ * like the edge engine's, start and stop bits included.
+ *
+ * The sampler's cost for the frame is accounted here rather than in
+ * the handler: one interrupt per sample, waiting for the start bit
+ * included, each taking as long as the last sample of the frame did.
+ * That leaves out the handler's epilogue.
+ */
+static void adb_rx_decode(void)
+{
+  uint16_t i;
+  uint16_t low = 0;
+  uint16_t high = 0;
+  uint16_t cell = 100 / ADB_RX_SAMPLE_US;
+  uint8_t level;
+  uint16_t irqs = adb_rx_wait + adb_rx_nsamp;
+
+  stats_rx.irqs += irqs;
+  stats_rx.isr_ticks += (uint32_t)irqs * adb_rx_cost;
+
+  for (i = 0; i <= adb_rx_nsamp; i++) {
+    // One past the end is a high sample, it finishes the last bit.
+    level = (i == adb_rx_nsamp) ||
+      ((adb_rx_samples[i / 8] >> (7 - (i % 8))) & 0x1);
+    if (level) {
+      high++;
+      continue;
+    }
+    if (high && low && (adb_rx_count < 8 * sizeof(adb_rx_data))) {
+      if (low < high) {
+        adb_rx_data[adb_rx_count / 8] |= 0x80 >> (adb_rx_count % 8);
+      }
+      adb_rx_count++;
+      cell = low + high;
+      low = 0;
+    }
+    high = 0;
+    low++;
+  }
+  if (low && (adb_rx_count < 8 * sizeof(adb_rx_data))) {
+    if ((low << 1) < cell) {
+      adb_rx_data[adb_rx_count / 8] |= 0x80 >> (adb_rx_count % 8);
+    }
+    adb_rx_count++;
+  }
+}
+
+#else
 /**
  * External interrupt on ADB pin. Triggered when an ADB device starts 
  * transmitting data to the processor.
+ *
+ * A bit cell runs from one falling edge to the next, and is a 1 if its
+ * low phase is shorter than its high phase. So each bit is stored at
+ * the falling edge that ends its cell, and the stop bit, whose cell
+ * never ends, once the frame is over (see TIMER1_COMPA_vect).
  */
 ISR(INT2_vect, ISR_NOBLOCK) {
-  uint8_t adb_rx_low_duration = TCNT0;
-  uint8_t adb_rx_bit;
+  uint16_t now = clock_ticks();
+  uint16_t phase = now - adb_rx_edge;
+  uint16_t err;
 
+  stats_isr_enter();
   GICR &= ~(_BV(5));
-  TCNT0 = 0;
+  adb_rx_edge = now;
+
+#ifdef ADB_FAULT_INJECT
+  // Drop an edge now and then and leave INT2 off, as if it was missed.
+  if (--adb_fault_count == 0) {
+    adb_fault_count = ADB_FAULT_INJECT;
+    stats_isr_leave();
+    return;
+  }
+#endif
 
   PORTA &= ~(_BV(1));
 
   switch (adb_state) {
 
   case ADB_STATE_RX_WAIT:
-    TCCR0 = 0xa;
-    OCR0 = 220;
+    // Start bit. Until there is a whole cell to go by, the stop bit
+    // is held against the nominal 100us one.
     PORTA &= ~(_BV(2));
-    // Purposefully fall through to the next state...
+    adb_rx_cell = CLOCK_US(100);
+    adb_rx_fall = now;
+    // Give up if the next edge is more than 110us away.
+    adb_timer_from(now, CLOCK_US(110));
+    adb_state = ADB_STATE_RX_HIGH;
+    // Enable INT2 to catch a rising edge
+    MCUCSR |= _BV(6);
+    break;
 
   case ADB_STATE_RX_LOW:
+    // The last cell ends here, its high phase just did.
+    adb_rx_store(adb_rx_low < phase);
+    // A bit cell should be 100us long.
+    adb_rx_cell = now - adb_rx_fall;
+    err = (adb_rx_cell > CLOCK_US(100)) ?
+      adb_rx_cell - CLOCK_US(100) : CLOCK_US(100) - adb_rx_cell;
+    if (err > stats_isr.cell_err_max) {
+      stats_isr.cell_err_max = err;
+    }
+    adb_rx_fall = now;
+    adb_timer_from(now, CLOCK_US(110));
     adb_state = ADB_STATE_RX_HIGH;
     // Enable INT2 to catch a rising edge
     MCUCSR |= _BV(6);
     break;
 
   case ADB_STATE_RX_HIGH:
-    // Record the bit.
-    if (adb_rx_low_duration > (40 * 2)) {
-      adb_rx_bit = 0;
-    } else {
-      adb_rx_bit = 1;
-    }
-    adb_rx_data[adb_rx_count / 8] |= adb_rx_bit << (7 - (adb_rx_count % 8));
-    adb_rx_count++;
+    // The low phase of the cell is over.
+    adb_rx_low = phase;
+    adb_timer_from(now, CLOCK_US(110));
     adb_state = ADB_STATE_RX_LOW;
     // Enable INT2 to catch a falling edge
     MCUCSR &= ~(_BV(6));
@@ -224,28 +599,37 @@ ISR(INT2_vect, ISR_NOBLOCK) {
   }
   
   // Re-enable the external interrupt.
-  GIFR |= _BV(5);
+  GIFR = _BV(INTF2);
   GICR |= _BV(5);
     
   PORTA |= _BV(1);
 
+  stats_rx.irqs++;
+  stats_rx.isr_ticks += clock_ticks() - now;
+  stats_isr_leave();
+
   return;
 }
+#endif
 
 
 int8_t adb_init(void)
 {
   // Configure port for output
-  DDRB = 0xFF;
+  DDRB = ADB_DDR_TX;
   DDRA = 0xFF;
   PORTA = 0xFF;
 
-  // Reach steady state then reset devices
-  ADB_PORT = ADB_TX_1;
-  _delay_ms(1000.0);
-  ADB_PORT = ADB_TX_0;
-  _delay_ms(4.0);
+  // Reach steady state then reset devices, stepped by adb_tick()
   ADB_PORT = ADB_TX_1;
+  adb_reset_ms = ADB_SETTLE_MS + ADB_RESET_MS;
+  adb_state = ADB_STATE_RESET;
+
+#if ADB_RX_SAMPLED
+  // Sample clock: CTC mode, clk/8, one compare per ADB_RX_SAMPLE_US.
+  TCCR2 = _BV(WGM21) | _BV(CS21);
+  OCR2 = CLOCK_US(ADB_RX_SAMPLE_US) - 1;
+#endif
 
   // Initialize to default keyboard address
   // keyboard: 0x2
@@ -256,35 +640,168 @@ int8_t adb_init(void)
 }
 
 
-int8_t adb_command(uint8_t address, uint8_t command, uint8_t reg)
+/**
+ * Something that changes while a response is coming in: the bit count,
+ * or for the sampling engine, which only counts bits afterwards, the
+ * sample count.
+ */
+static inline uint8_t adb_rx_progress(void)
 {
-  if (adb_state != ADB_STATE_IDLE) {
-    return 1;
+#if ADB_RX_SAMPLED
+  return (uint8_t)adb_rx_nsamp;
+#else
+  return adb_rx_count;
+#endif
+}
+
+/**
+ * Abandon the current transaction. Shuts down the timer and INT2, releases
+ * the line and returns the state machine to idle. Called by the
+ * supervisor when the state machine has stalled.
+ *
+ * This runs from the main loop, and the ADB handlers that change TIMSK
+ * and GICR are ISR_NOBLOCK, so one could otherwise run in the middle of
+ * a read-modify-write and have its change undone, or re-arm itself
+ * after the shutdown.
+ */
+static void adb_recover(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    TIMSK &= ~(_BV(OCIE1A)); // disable timer interrupt
+    GICR &= ~(_BV(5));  // disable INT2
+#if ADB_RX_SAMPLED
+    TIMSK &= ~(_BV(OCIE2)); // disable sampler
+#endif
+#if ADB_TX_SPI
+    SPCR = 0;
+#endif
+    TIFR = _BV(OCF1A);
+    GIFR = _BV(INTF2);
+    DDRB = ADB_DDR_TX;
+    ADB_PORT = ADB_TX_1;
+
+    adb_tx_listen = 0;
+    adb_state = ADB_STATE_IDLE;
   }
 
+  stats_adb_recovered((clock_us() - adb_txn_start) / 1000);
+  event_post(EVENT_ADB);
+}
+
+void adb_tick(void)
+{
+  uint8_t state = adb_state;
+
+  if ((state == ADB_STATE_IDLE) || (state == ADB_STATE_HOLD)) {
+    adb_stall_ms = 0;
+    return;
+  }
+
+  if (state != ADB_STATE_RESET) {
+    if ((state == adb_watch[0]) && (adb_tx_step == adb_watch[1]) &&
+        (adb_rx_progress() == adb_watch[2])) {
+      adb_stall_ms++;
+    } else {
+      adb_stall_ms = 0;
+    }
+    adb_watch[0] = state;
+    adb_watch[1] = adb_tx_step;
+    adb_watch[2] = adb_rx_progress();
+
+    if ((adb_stall_ms >= ADB_STALL_MS) ||
+        (clock_us() - adb_txn_start >= ADB_TXN_MS * 1000UL)) {
+      adb_recover();
+      adb_stall_ms = 0;
+    }
+    return;
+  }
+
+  adb_reset_ms--;
+  if (adb_reset_ms == ADB_RESET_MS) {
+    ADB_PORT = ADB_TX_0;
+  } else if (adb_reset_ms == 0) {
+    ADB_PORT = ADB_TX_1;
+    adb_state = ADB_STATE_IDLE;
+    stats_boot_mark(STATS_BOOT_ADB_READY);
+  }
+}
+
+
+/**
+ * Build the command part of the waveform and start sending it. The
+ * attention signal is driven here, the compare interrupt takes over
+ * from the sync signal on.
+ */
+static void adb_start(uint8_t address, uint8_t command, uint8_t reg)
+{
   // Prepare port to output
-  DDRB = 0xff;
+  DDRB = ADB_DDR_TX;
 
-  // Construct command byte
-  adb_tx_data = 0;
-  adb_tx_data |= address << 4;
-  adb_tx_data |= command << 2;
-  adb_tx_data |= reg;
-  adb_tx_index = 7; // data is sent MSB first
+  // Sync, command byte and stop bit
+  adb_tx_steps = 0;
+  adb_tx_wave[adb_tx_steps++] = ADB_STEP_HIGH | CLOCK_US(70);
+  adb_wave_byte((address << 4) | (command << 2) | reg);
+  adb_wave_bit(0);
+  adb_tx_step = 0;
 
   // Prepare to receive data
   adb_rx_count = 0;
   memset((void *)adb_rx_data, 0, 9 * sizeof(uint8_t));
+}
 
-  // Start the state machine
-  adb_state = ADB_STATE_TX_ATTN;
+/// Drive the attention signal and hand the rest to the interrupt.
+static void adb_go(void)
+{
+  stats_mark(STATS_STAMP_ADB_START);
+  adb_txn_start = clock_us();
+  adb_state = ADB_STATE_TX;
   ADB_PORT = ADB_TX_0;
   // Kick off the timer for 800us
-  TCCR0 = 0xb;
-  TCNT0 = 0;
-  OCR0 = 800 / 4;
-  TIFR |= _BV(1); // clear any existing interrupt
-  TIMSK |= _BV(1); // enable interrupt
+  adb_timer_from(clock_ticks(), CLOCK_US(800));
+  TIMSK |= _BV(OCIE1A); // enable interrupt
+}
+
+int8_t adb_command(uint8_t address, uint8_t command, uint8_t reg)
+{
+  if (adb_state != ADB_STATE_IDLE) {
+    return 1;
+  }
+
+  adb_start(address, command, reg);
+  adb_tx_listen = 0;
+#if ADB_TX_SPI
+  adb_spi_encode();
+#endif
+  adb_go();
+
+  return 0;
+}
+
+
+int8_t adb_listen(uint8_t address, uint8_t reg, uint8_t *data, uint8_t len)
+{
+  uint8_t i;
+
+  if ((adb_state != ADB_STATE_IDLE) || (len == 0) || (len > ADB_LISTEN_MAX)) {
+    return 1;
+  }
+
+  adb_start(address, ADB_CMD_LISTEN, reg);
+
+  // The stop bit runs into the 200us stop-to-start time, then the data
+  // bytes go back to back between a start and a stop bit.
+  adb_tx_wave[adb_tx_steps - 1] += CLOCK_US(200);
+  adb_wave_bit(1);
+  for (i = 0; i < len; i++) {
+    adb_wave_byte(data[i]);
+  }
+  adb_wave_bit(0);
+  adb_tx_listen = 1;
+#if ADB_TX_SPI
+  adb_spi_encode();
+#endif
+
+  adb_go();
 
   return 0;
 }
@@ -293,18 +810,27 @@ int8_t adb_command(uint8_t address, uint8_t command, uint8_t reg)
 int8_t adb_read_data(uint8_t *len, uint8_t *buff)
 {
   uint8_t i;
+#if ADB_RX_SAMPLED
+  uint16_t start;
+#endif
 
   // First check to make sure we have received data.
   if (adb_state != ADB_STATE_HOLD) {
     return 1;
   }
+
+#if ADB_RX_SAMPLED
+  start = clock_ticks();
+  adb_rx_decode();
+  stats_rx.decode_ticks += clock_ticks() - start;
+#endif
   
   // Remove the start and stop bits from the data by shifting all
   // eight bytes left by one bit.
   for(i=0; i<8; i++) {
     adb_rx_data[i] = (adb_rx_data[i] << 1) | ((adb_rx_data[i + 1] & 0x80) >> 7);
   }
-  adb_rx_count = adb_rx_count - 2;
+  adb_rx_count = (adb_rx_count < 2) ? 0 : adb_rx_count - 2;
 
   // Copy data.
   *len = adb_rx_count;
@@ -24,18 +24,131 @@
 
 /// Output port
 #define ADB_PORT PORTB
+/// Input pins
+#define ADB_PIN PINB
 /// Output low value
 #define ADB_TX_0 0x0
 /// Output high value
 #define ADB_TX_1 0x4
 
-/// 2b code for a flush command.
+#ifndef ADB_TX_SPI
+/**
+   Transmit engine. 0 steps through the waveform with timer1 compare
+   interrupts. 1 is experimental: the SPI shifter clocks the waveform
+   out as ADB_SPI_US samples, one interrupt per eight samples. It needs
+   MOSI (PB5) strapped to the ADB line (PB2).
+*/
+#define ADB_TX_SPI 0
+#endif
+
+/// Length of one SPI transmit sample, in us (fosc/64).
+#define ADB_SPI_US 4
+
+#if ADB_TX_SPI
+/// Port directions while the ADB pin drives the line. MOSI stays an
+/// input since it is strapped to the line.
+#define ADB_DDR_TX (0xff & ~_BV(PB5))
+/// Port directions while the SPI shifter drives the line: MOSI, SCK and
+/// SS (which must be an output in master mode).
+#define ADB_DDR_SPI (_BV(PB4) | _BV(PB5) | _BV(PB7))
+#else
+/// Port directions while the ADB pin drives the line.
+#define ADB_DDR_TX 0xff
+#endif
+/// Port directions while receiving.
+#define ADB_DDR_RX 0x00
+
+/// 2b code for a flush command, sent with register ADB_REG_FLUSH.
 #define ADB_CMD_FLUSH 0
+/// Register field of a flush command. Register 0 would make it
+/// SendReset, which resets every device on the bus.
+#define ADB_REG_FLUSH 1
 /// 2b code for a listen command.
 #define ADB_CMD_LISTEN 2
 /// 2b code for a talk command.
 #define ADB_CMD_TALK 3
 
+/// Default address of a keyboard.
+#define ADB_ADDR_KEYBOARD 2
+/// Default address of a mouse.
+#define ADB_ADDR_MOUSE 3
+
+/// Time the line is held high after power up before the reset pulse, in ms.
+#define ADB_SETTLE_MS 250
+/// Length of the reset pulse, in ms. The spec states 3ms, but actual
+/// Mac II hardware will do 4ms.
+#define ADB_RESET_MS 4
+
+/**
+   Stall deadline, in ms. No state of the ADB state machine legitimately
+   lasts longer than the 800us attention signal before the state,
+   transmit step or bit count moves on. The supervisor in adb_tick() samples once
+   per millisecond, so two ticks without movement is a stall.
+*/
+#define ADB_STALL_MS 2
+/// Transaction deadline, in ms. Attention, command, stop-to-start time
+/// and an eight byte response add up to less than 9ms.
+#define ADB_TXN_MS 12
+
+/**
+   Retries of a malformed Talk response. A response of the wrong length
+   is retried straight away, then after 1, 2 and 4ms. If none of the
+   retries comes back whole the keyboard is assumed to be out of sync
+   and is sent a Flush command.
+*/
+#define ADB_RETRY_MAX 4
+
+/// Time without any keyboard response before checking with a Talk R3
+/// probe that the keyboard is still there, in ms. A keyboard with
+/// nothing to say does not answer a poll, but always answers Talk R3,
+/// so an idle keyboard is probed once per ADB_SILENT_MS.
+#define ADB_SILENT_MS 1000
+/// ADB_SILENT_MS while a key is held. The keyboard is just as silent
+/// then, but a key left down by an unplugged keyboard auto-repeats on
+/// the host until it is released.
+#define ADB_SILENT_HELD_MS 100
+/// Time between Talk R3 probes while no keyboard answers, in ms.
+#define ADB_PROBE_MS 250
+
+/// State values, see adb_state.
+enum adb_states {
+  ADB_STATE_IDLE = 0,
+  ADB_STATE_TX,
+  ADB_STATE_RX_WAIT,
+  ADB_STATE_RX_LOW,
+  ADB_STATE_RX_HIGH,
+  ADB_STATE_HOLD,
+  ADB_STATE_RESET
+};
+
+/// Current state of the ADB state machine, one of adb_states.
+extern uint8_t adb_state;
+
+/// Largest data packet adb_listen() can send, in bytes.
+#define ADB_LISTEN_MAX 2
+
+#ifndef ADB_RX_SAMPLED
+/**
+   Receive engine. 0 times every edge of the response with INT2. 1
+   samples the line every ADB_RX_SAMPLE_US with timer2 into a bit
+   buffer, and decodes the frame in adb_read_data(). Both engines keep
+   their costs in stats_rx.
+
+   The edge engine reads bit cells anywhere in the 70 to 130us the spec
+   allows a device. The sampling engine cannot tell the low and high
+   phase of a bit apart once they are within about two samples, which
+   limits it to cells of 85us and up (see host/adb_diff.c).
+*/
+#define ADB_RX_SAMPLED 0
+#endif
+
+/// Sample period of the sampling receive engine, in us.
+#define ADB_RX_SAMPLE_US 10
+/// Samples kept by the sampling receive engine: start bit, eight bytes
+/// and stop bit at 130us each, the slowest bit cell a device may send,
+/// plus the idle line after the stop bit.
+#define ADB_RX_SAMPLES 880
+
 /**
    Send a command packet and receive data if sent. Constructs a command
    packet and sent according to the ADB specification:
@@ -59,7 +172,10 @@
    Returned data is stored in adb_rx_data. The number of bits received
    is available in adb_rx_count.
   
-   This code uses timer0 and INT2 to make this call non-blocking.
+   This code uses timer1 compare A (see clock.c) and INT2 to make this
+   call non-blocking. The whole transmit waveform is worked out here
+   before the attention signal starts, the interrupt just steps
+   through it.
    Once the attention signal has been started this call will return.
    Successive calls will return non-zero status until the state machine
    reaches idle again.
@@ -72,6 +188,28 @@
 int8_t adb_command(uint8_t address, uint8_t command, uint8_t reg);
 
 
+/**
+   Send a Listen command followed by data. The command packet is sent as
+   in adb_command(), then the line is held high for the stop-to-start
+   time (200us) and the data packet follows:
+
+   -# Start bit (1)
+   -# len bytes of data, each sent MSB first.
+   -# Stop bit (0)
+
+   Like adb_command() this returns as soon as the attention signal has
+   been started. Nothing is received, the state machine goes straight
+   back to idle once the stop bit has been sent.
+
+   @param[in]  address Device address.
+   @param[in]  reg     Register to write.
+   @param[in]  data    Bytes to send.
+   @param[in]  len     Number of bytes, at most ADB_LISTEN_MAX.
+   @return     0 for success.
+*/
+int8_t adb_listen(uint8_t address, uint8_t reg, uint8_t *data, uint8_t len);
+
+
 /**
    Read received data. After an ADB command completes any received
    data will be stored into a temporary buffer. In order to get at
@@ -92,18 +230,33 @@ int8_t adb_read_data(uint8_t *len, uint8_t *buff);
 
 /**
    Initialize resources. This routine initializes the microprocesser 
-   resources used by the ADB code and performs the ADB bringup sequence. 
+   resources used by the ADB code and starts the ADB bringup sequence. 
    This consists of:
   
-   -# Raise the line and remain stable for 1s.
-   -# Perform reset pulse for 4ms (spec states 3ms, but actual Mac II
-      hardware will do 4ms).
+   -# Raise the line and remain stable for ADB_SETTLE_MS.
+   -# Perform reset pulse for ADB_RESET_MS.
    -# Raise line.
   
-   In addition to setting the ADB processor state interrupts will be enabled.
+   The sequence does not block, it is stepped by adb_tick(). Until it is
+   done adb_command() returns non-zero. A keyboard that is still powering
+   up when the sequence ends just does not answer the first polls.
   
    @return 0 for success.
 */
 int8_t adb_init(void);
 
+/**
+   Step the bringup sequence and supervise the state machine. Must be
+   called once per millisecond.
+
+   A missed edge can leave the state machine waiting forever with its
+   interrupts off, after which adb_command() would never succeed again.
+   The supervisor bounds every transaction: if the state machine stops
+   moving for ADB_STALL_MS, or a transaction takes longer than
+   ADB_TXN_MS, the timer and INT2 are shut down, the line is released
+   and the state machine goes back to idle. EVENT_ADB is posted as for a
+   normal timeout, and the recovery is counted in stats_count.
+*/
+void adb_tick(void);
+
 #endif
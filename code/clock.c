@@ -0,0 +1,85 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/** \file clock.c
+    \brief Free-running microsecond timebase.
+
+    Timer1 runs free at clk/8, 0.5us per count, and never has its
+    counter written. It is extended to a 32-bit microsecond clock
+    (clock_us()), which wraps after about 71 minutes.
+
+    There is no overflow interrupt: V-USB needs every handler to let it
+    in within a few cycles, and the ones that cannot re-enable
+    interrupts first would make it wait. Instead every reader folds a
+    pending TOV1 into clock_ovf with interrupts off (see
+    clock_sample()). The 1ms tick reads the clock through clock_poll(),
+    so no overflow is ever missed.
+
+    The two compare units of timer1 are shared out rather than
+    reprogramming a timer for every interval:
+
+    - OCR1A times the ADB state machine (see adb.c).
+    - OCR1B is the 1ms tick (see event.c).
+
+    Each one is set relative to the free-running count, so neither
+    disturbs the other and timestamps taken anywhere in the firmware can
+    be compared. Instrumentation (stats.h) stamps with clock_us16().
+*/
+
+#include <stdint.h>
+#include <avr/io.h>
+
+#include "clock.h"
+
+volatile uint32_t clock_ovf;
+
+/// Start timer1 free-running at clk/8.
+void clock_init(void)
+{
+  TCCR1A = 0;
+  TCCR1B = _BV(CS11);
+  TIFR = _BV(TOV1);
+}
+
+/**
+   Count a pending timer1 overflow. Must be called at least once every
+   32ms, the 1ms tick does.
+*/
+void clock_poll(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    clock_sample();
+  }
+}
+
+/**
+   Read the microsecond clock.
+
+   @return Microseconds since clock_init(), modulo 2^32.
+*/
+uint32_t clock_us(void)
+{
+  uint16_t now;
+  uint32_t ovf;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    now = clock_sample();
+    ovf = clock_ovf;
+  }
+
+  return (ovf << 15) | (now >> 1);
+}
@@ -0,0 +1,104 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/** \file clock.h
+    \brief Global routines for the microsecond timebase.
+*/
+
+#ifndef __inc_clock__
+#define __inc_clock__
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+/// Timer1 counts per microsecond (clk/8 at 16MHz).
+#define CLOCK_TICKS_PER_US 2
+/// Timer1 counts per millisecond, the period of the tick.
+#define CLOCK_TICKS_PER_MS (1000 * CLOCK_TICKS_PER_US)
+/// Convert microseconds to timer1 counts.
+#define CLOCK_US(us) ((uint16_t)((us) * CLOCK_TICKS_PER_US))
+
+/// Timer1 overflows since clock_init(), each is 32.768ms. Only
+/// up to date after clock_sample().
+extern volatile uint32_t clock_ovf;
+
+/**
+   Read timer1 and count an overflow since the last read. Must be
+   called with interrupts off, so the flag and clock_ovf move together.
+   If TOV1 is set the count is read again, since the first read may
+   have been taken just before the overflow.
+
+   @return Current timer1 count, consistent with clock_ovf.
+*/
+static inline uint16_t clock_sample(void)
+{
+  uint16_t now = TCNT1;
+
+  if (TIFR & _BV(TOV1)) {
+    TIFR = _BV(TOV1); // write one to clear only this flag
+    clock_ovf++;
+    now = TCNT1;
+  }
+
+  return now;
+}
+
+/**
+   Read timer1. This is the raw 0.5us count used to program compare
+   matches. Timer1 is 16 bits wide and reading it goes through the
+   shared TEMP register, so this has to be atomic: the ADB interrupt
+   handlers are ISR_NOBLOCK and may be interrupted by another handler
+   that also uses TEMP.
+
+   @return Current timer1 count.
+*/
+static inline uint16_t clock_ticks(void)
+{
+  uint16_t now;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    now = TCNT1;
+  }
+
+  return now;
+}
+
+/**
+   Read the low 16 bits of the microsecond clock. Cheap enough for the
+   interrupt handlers, good for intervals of up to 65ms.
+
+   @return Microseconds since clock_init(), modulo 65536.
+*/
+static inline uint16_t clock_us16(void)
+{
+  uint16_t now;
+  uint16_t ovf;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    now = clock_sample();
+    ovf = (uint16_t)clock_ovf;
+  }
+
+  return (ovf << 15) | (now >> 1);
+}
+
+void clock_init(void);
+void clock_poll(void);
+uint32_t clock_us(void);
+
+#endif
@@ -0,0 +1,141 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+/** \file event.c
+    \brief Main loop events and idle sleep.
+
+    The main loop only has work to do when something happens: an ADB
+    transaction finishes, the host picks up a report, the host changes
+    the LEDs or the timer ticks. Every one of those is an interrupt, so
+    when no event is pending the processor is put into idle sleep and
+    the next interrupt wakes it up again.
+
+    V-USB does not post an event when the interrupt endpoint becomes
+    ready, but its INT0 handler wakes the processor all the same and the
+    main loop polls usbInterruptIsReady() on every pass.
+
+    The time spent awake and asleep is accumulated in the duty-cycle
+    meter in stats.c. Interrupt handlers that run while the processor
+    is asleep are counted as sleep.
+*/
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+#include "clock.h"
+#include "event.h"
+#include "stats.h"
+
+volatile uint8_t event_pending;
+
+volatile uint16_t event_ms;
+
+/// Timestamp of the last wake up, for the duty-cycle meter.
+static uint16_t event_woke;
+
+/**
+ * Timer1 compare B interrupt. Fires every 1ms so that the main loop runs
+ * at least that often, whatever the USB host and ADB device are doing.
+ * The next compare is set from this one rather than from the current
+ * count, so the tick does not drift however late the handler runs. It
+ * also keeps the 32-bit clock counting overflows, see clock_poll().
+ */
+ISR(TIMER1_COMPB_vect, ISR_NOBLOCK)
+{
+  stats_isr_enter();
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    OCR1B += CLOCK_TICKS_PER_MS;
+  }
+  clock_poll();
+  event_ms++;
+  event_post(EVENT_TICK);
+  stats_isr_leave();
+}
+
+/// Start the tick and select the sleep mode. Needs clock_init().
+void event_init(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    OCR1B = TCNT1 + CLOCK_TICKS_PER_MS;
+  }
+  TIFR = _BV(OCF1B); // write one to clear only this flag
+  TIMSK |= _BV(OCIE1B);
+
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  event_woke = stats_now();
+}
+
+/**
+   Fetch and clear all pending events.
+
+   @return EVENT_* flags that were pending.
+*/
+uint8_t event_take(void)
+{
+  uint8_t event;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    event = event_pending;
+    event_pending = 0;
+  }
+
+  return event;
+}
+
+/**
+   Read the millisecond counter.
+
+   @return Milliseconds since event_init().
+*/
+uint16_t event_now_ms(void)
+{
+  uint16_t ms;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    ms = event_ms;
+  }
+
+  return ms;
+}
+
+/**
+   Sleep until an event is posted. Returns immediately if one is
+   already pending. Interrupts are disabled while checking so that an
+   event posted just before going to sleep cannot be missed; sei() only
+   takes effect after the following instruction, which is the sleep.
+*/
+void event_wait(void)
+{
+  uint16_t slept;
+  uint16_t woke;
+
+  cli();
+  if (event_pending) {
+    sei();
+    return;
+  }
+  slept = stats_now();
+  sleep_enable();
+  sei();
+  sleep_cpu();
+  sleep_disable();
+
+  woke = stats_now();
+  stats_duty_account(slept - event_woke, woke - slept);
+  event_woke = woke;
+}
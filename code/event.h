@@ -0,0 +1,62 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+/** \file event.h
+    \brief Global routines for main loop events.
+*/
+
+#ifndef __inc_event__
+#define __inc_event__
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+/// ADB transaction finished (frame received, timed out or sent).
+#define EVENT_ADB _BV(0)
+/// Host changed the keyboard LEDs.
+#define EVENT_LED _BV(1)
+/// Periodic 1ms timer tick (timer1 compare B, see clock.c).
+#define EVENT_TICK _BV(2)
+/// Host changed the key mapping, Fn layer or macros and the held keys
+/// were dropped, so a release report is due without a poll.
+#define EVENT_KEYS _BV(3)
+
+/// Pending events, a combination of the EVENT_* flags.
+extern volatile uint8_t event_pending;
+
+/// Milliseconds since event_init(), counted by the tick.
+extern volatile uint16_t event_ms;
+
+/**
+   Post an event. Safe to call from interrupt handlers, including the
+   ISR_NOBLOCK ones which may be nested.
+
+   @param[in] event EVENT_* flags to set.
+*/
+static inline void event_post(uint8_t event)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    event_pending |= event;
+  }
+}
+
+void event_init(void);
+uint8_t event_take(void);
+uint16_t event_now_ms(void);
+void event_wait(void);
+
+#endif
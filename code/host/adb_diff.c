@@ -0,0 +1,288 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/** \file host/adb_diff.c
+    \brief Differential test of the ADB receive engine.
+
+    Sends random keyboard responses within the device timing of the ADB
+    spec through the receive engine (see host.c), and decodes the same
+    edges with a reference decoder that knows nothing of the engine:
+
+    - A bit cell runs from one falling edge to the next. It is a 1 if
+      its low phase is shorter than its high phase, a 0 otherwise.
+    - The stop bit's cell has no end, so its low phase is held against
+      half the frame's mean bit cell instead.
+
+    Each response has a random number of bytes, from 2 to 8. Its bit
+    cell is 100us off by up to the skew, the low phase of a bit 35% or
+    65% of the cell off by up to the duty error, and it starts 160 to
+    239us after the command. Any frame the two read differently, in
+    length or in its data bits, is printed with its edges, and the test
+    fails.
+
+    \verbatim
+    adb_diff [-n frames] [-seed N] [-skew percent] [-duty percent]
+    \endverbatim
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <avr/io.h>
+
+#include "adb.h"
+#include "clock.h"
+#include "event.h"
+#include "host.h"
+
+/// Attention, sync, command byte and stop bit, in us.
+#define DIFF_CMD_US (800 + 70 + 9 * 100)
+/// Most bit cells in a response: start bit, 8 bytes and stop bit.
+#define DIFF_CELLS (1 + 8 * 8 + 1)
+
+/// A response as edges: the time each bit cell falls and rises, in
+/// timer1 counts from the end of the command.
+struct diff_frame {
+  uint8_t cells;
+  uint32_t fall[DIFF_CELLS];
+  uint32_t rise[DIFF_CELLS];
+  uint8_t data[8];
+  uint8_t bytes;
+};
+
+/// State of the random number generator, never 0.
+static uint64_t diff_rand_state = 0x2545f4914f6cdd1dULL;
+
+static uint64_t diff_rand(void)
+{
+  diff_rand_state ^= diff_rand_state << 13;
+  diff_rand_state ^= diff_rand_state >> 7;
+  diff_rand_state ^= diff_rand_state << 17;
+
+  return diff_rand_state;
+}
+
+/// Uniform random number from -1 to 1.
+static double diff_unit(void)
+{
+  return (double)(diff_rand() >> 11) / (double)(1ULL << 52) - 1.0;
+}
+
+/**
+   Make up a response.
+
+   @param[out] f    Response.
+   @param[in]  skew Largest bit cell error, as a fraction of 100us.
+   @param[in]  duty Largest low phase error, as a fraction of the cell.
+*/
+static void diff_make(struct diff_frame *f, double skew, double duty)
+{
+  double cell = 100.0 * (1.0 + skew * diff_unit());
+  double t = 160.0 + 79.0 * (diff_unit() + 1.0) / 2.0;
+  double low;
+  uint8_t i;
+  uint8_t one;
+
+  f->bytes = 2 + diff_rand() % 7;
+  for (i = 0; i < f->bytes; i++) {
+    f->data[i] = diff_rand();
+  }
+  f->cells = 8 * f->bytes + 2;
+  for (i = 0; i < f->cells; i++) {
+    // Start bit, data, stop bit.
+    one = (i == 0) ||
+      ((i < f->cells - 1) && ((f->data[(i - 1) / 8] << ((i - 1) % 8)) & 0x80));
+    low = cell * ((one ? 0.35 : 0.65) + duty * diff_unit());
+    f->fall[i] = t * CLOCK_TICKS_PER_US;
+    f->rise[i] = (t + low) * CLOCK_TICKS_PER_US;
+    t += cell;
+  }
+}
+
+/**
+   Reference decoder.
+
+   @param[in]  f    Response, only its edges are used.
+   @param[out] data Bits, start and stop bits included, MSB first.
+   @return     Number of bits.
+*/
+static uint8_t diff_reference(const struct diff_frame *f, uint8_t *data)
+{
+  uint8_t i;
+  uint8_t n = f->cells;
+  uint32_t low;
+  uint32_t high;
+  uint8_t one;
+
+  memset(data, 0, (DIFF_CELLS + 7) / 8);
+  for (i = 0; i < n; i++) {
+    low = f->rise[i] - f->fall[i];
+    if (i + 1 < n) {
+      high = f->fall[i + 1] - f->rise[i];
+      one = low < high;
+    } else {
+      // Half the mean cell, from the first fall to the last.
+      one = 2 * low * (n - 1) < f->fall[n - 1] - f->fall[0];
+    }
+    if (one) {
+      data[i / 8] |= 0x80 >> (i % 8);
+    }
+  }
+
+  return n;
+}
+
+/**
+   Run a response through the receive engine.
+
+   @param[in]  f    Response.
+   @param[out] len  Bits read by adb_read_data(), 0xff if nothing was.
+   @param[out] data Data read by adb_read_data().
+*/
+static void diff_engine(const struct diff_frame *f, uint8_t *len,
+                        uint8_t *data)
+{
+  uint64_t start;
+  uint8_t i;
+
+  *len = 0xff;
+  memset(data, 0, 8);
+  start = host_now;
+  host_enter();
+  adb_command(ADB_ADDR_KEYBOARD, ADB_CMD_TALK, 0);
+  host_leave();
+  start += CLOCK_US(DIFF_CMD_US);
+
+  for (i = 0; i < f->cells; i++) {
+    host_run(start + f->fall[i]);
+    host_drive(0);
+    host_run(start + f->rise[i]);
+    host_drive(1);
+  }
+  while (host_run(start + CLOCK_US(1000) + f->rise[f->cells - 1])) {
+    event_pending = 0;
+    host_enter();
+    adb_read_data(len, data);
+    host_leave();
+  }
+  if (adb_state != ADB_STATE_IDLE) {
+    fprintf(stderr, "adb_diff: state machine stuck in state %u\n",
+            adb_state);
+    exit(1);
+  }
+}
+
+/**
+   Compare the first bits of two buffers. Past the length
+   adb_read_data() leaves the stop bit, which is not data.
+
+   @return Non-zero if they differ.
+*/
+static uint8_t diff_bits(const uint8_t *a, const uint8_t *b, uint8_t bits)
+{
+  uint8_t i;
+
+  for (i = 0; (i < bits) && (i < 64); i++) {
+    if ((a[i / 8] ^ b[i / 8]) & (0x80 >> (i % 8))) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/// Print a response that was read differently.
+static void diff_report(const struct diff_frame *f, uint8_t ref_len,
+                        const uint8_t *ref, uint8_t len, const uint8_t *data)
+{
+  uint8_t i;
+
+  printf("mismatch: reference %u bits", ref_len);
+  for (i = 0; i < 8; i++) {
+    printf(" %02x", ref[i]);
+  }
+  printf(", engine %u bits", len);
+  for (i = 0; i < 8; i++) {
+    printf(" %02x", data[i]);
+  }
+  printf("\n  low/high us:");
+  for (i = 0; i < f->cells; i++) {
+    printf(" %.1f/%.1f", (double)(f->rise[i] - f->fall[i]) / CLOCK_TICKS_PER_US,
+           (i + 1 < f->cells) ?
+           (double)(f->fall[i + 1] - f->rise[i]) / CLOCK_TICKS_PER_US : 0.0);
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long frames = 1000000;
+  unsigned long n;
+  unsigned long bad = 0;
+  double skew = 0.30;
+  double duty = 0.05;
+  struct diff_frame f;
+  uint8_t raw[(DIFF_CELLS + 7) / 8];
+  uint8_t ref[8];
+  uint8_t ref_len;
+  uint8_t data[8];
+  uint8_t len;
+  uint8_t i;
+  int arg;
+
+  for (arg = 1; arg + 1 < argc; arg += 2) {
+    if (strcmp(argv[arg], "-n") == 0) {
+      frames = strtoul(argv[arg + 1], NULL, 0);
+    } else if (strcmp(argv[arg], "-seed") == 0) {
+      diff_rand_state = strtoull(argv[arg + 1], NULL, 0) | 1;
+    } else if (strcmp(argv[arg], "-skew") == 0) {
+      skew = atof(argv[arg + 1]) / 100.0;
+    } else if (strcmp(argv[arg], "-duty") == 0) {
+      duty = atof(argv[arg + 1]) / 100.0;
+    } else {
+      break;
+    }
+  }
+  if (arg < argc) {
+    fprintf(stderr, "usage: %s [-n frames] [-seed N] [-skew percent] "
+            "[-duty percent]\n", argv[0]);
+    return 1;
+  }
+
+  host_bringup();
+  for (n = 0; n < frames; n++) {
+    diff_make(&f, skew, duty);
+    diff_engine(&f, &len, data);
+
+    // The reference without start and stop bits, as adb_read_data()
+    // hands it over.
+    ref_len = diff_reference(&f, raw) - 2;
+    for (i = 0; i < 8; i++) {
+      ref[i] = (raw[i] << 1) | (raw[i + 1] >> 7);
+    }
+    if ((len != ref_len) || diff_bits(data, ref, len)) {
+      if (bad++ < 10) {
+        diff_report(&f, ref_len, ref, len, data);
+      }
+    }
+  }
+
+  printf("adb_diff: %lu frames, %lu read differently\n", frames, bad);
+
+  return bad ? 1 : 0;
+}
@@ -0,0 +1,48 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/** \file host/avr/eeprom.h
+    \brief EEPROM access for host builds. EEMEM variables live in RAM
+    and writes finish at once.
+*/
+
+#ifndef __inc_host_avr_eeprom__
+#define __inc_host_avr_eeprom__
+
+#include <stdint.h>
+#include <string.h>
+
+#define EEMEM
+
+static inline uint8_t eeprom_read_byte(const uint8_t *addr)
+{
+  return *addr;
+}
+
+static inline void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+  memcpy(dst, src, n);
+}
+
+static inline void eeprom_update_byte(uint8_t *addr, uint8_t value)
+{
+  *addr = value;
+}
+
+#define eeprom_is_ready() 1
+
+#endif
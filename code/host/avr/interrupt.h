@@ -0,0 +1,37 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/** \file host/avr/interrupt.h
+    \brief Interrupt handlers for host builds.
+
+    A handler is a plain function named after its vector (see
+    avr/io.h). host.c runs each one to completion, so there is no
+    nesting and sei() and cli() do nothing.
+*/
+
+#ifndef __inc_host_avr_interrupt__
+#define __inc_host_avr_interrupt__
+
+#include <avr/io.h>
+
+#define ISR_NOBLOCK
+#define ISR(vector, ...) void vector(void); void vector(void)
+
+#define sei()
+#define cli()
+
+#endif
@@ -0,0 +1,102 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/** \file host/avr/io.h
+    \brief ATmega32 registers for host builds.
+
+    The registers the firmware touches are plain variables, defined in
+    host.c, and the interrupt vectors are ordinary functions that host.c
+    calls when the hardware would. Only what adb.c, keyboard.c, clock.c
+    and the headers they include use is here.
+*/
+
+#ifndef __inc_host_avr_io__
+#define __inc_host_avr_io__
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+#define RAMEND 0x85F
+
+extern volatile uint8_t PORTA;
+extern volatile uint8_t DDRA;
+extern volatile uint8_t PINA;
+extern volatile uint8_t PORTB;
+extern volatile uint8_t DDRB;
+extern volatile uint8_t PINB;
+extern volatile uint8_t SPCR;
+extern volatile uint8_t SPDR;
+extern volatile uint8_t TIMSK;
+extern volatile uint8_t TIFR;
+extern volatile uint8_t GICR;
+extern volatile uint8_t GIFR;
+extern volatile uint8_t MCUCSR;
+extern volatile uint8_t TCCR1A;
+extern volatile uint8_t TCCR1B;
+extern volatile uint16_t TCNT1;
+extern volatile uint16_t OCR1A;
+extern volatile uint16_t OCR1B;
+extern volatile uint8_t TCCR2;
+extern volatile uint8_t TCNT2;
+extern volatile uint8_t OCR2;
+extern volatile uint16_t SP;
+
+// PORTB
+#define PB2 2
+#define PB4 4
+#define PB5 5
+#define PB7 7
+
+// SPCR
+#define SPIE 7
+#define SPE 6
+#define MSTR 4
+#define SPR1 1
+
+// TIMSK
+#define OCIE2 7
+#define OCIE1A 4
+#define OCIE1B 3
+
+// TIFR
+#define OCF2 7
+#define OCF1A 4
+#define OCF1B 3
+#define TOV1 2
+
+// GICR and GIFR
+#define INT2 5
+#define INTF2 5
+
+// MCUCSR
+#define ISC2 6
+
+// TCCR1B
+#define CS11 1
+
+// TCCR2
+#define WGM21 3
+#define CS21 1
+
+#define INT2_vect host_int2_vect
+#define TIMER1_COMPA_vect host_timer1_compa_vect
+#define TIMER1_COMPB_vect host_timer1_compb_vect
+#define TIMER2_COMP_vect host_timer2_comp_vect
+#define SPI_STC_vect host_spi_stc_vect
+
+#endif
@@ -0,0 +1,318 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/** \file host/fuzz.c
+    \brief Stand-alone driver for the fuzz targets.
+
+    For machines without libFuzzer. Takes the same kind of command line
+    and calls the same LLVMFuzzerTestOneInput(), but it has no coverage
+    feedback: it plays every corpus file once, then the given number of
+    random mutations of them. Built with clang the targets can be linked
+    against libFuzzer instead (see the Makefile).
+
+    \verbatim
+    fuzz_target [-runs=N] [-seed=N] [-max_len=N] corpus_dir_or_file...
+    \endverbatim
+
+    When an input fails, it is written to crash-<run> in the current
+    directory before the process dies, to be replayed by passing the
+    file on the command line.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/// An input.
+struct fuzz_input {
+  uint8_t *data;
+  size_t size;
+};
+
+/// Inputs read from the command line.
+static struct fuzz_input *fuzz_corpus;
+/// Number of entries in fuzz_corpus.
+static size_t fuzz_count;
+/// Input being run, saved if it fails.
+static const uint8_t *fuzz_data;
+/// Size of fuzz_data.
+static size_t fuzz_size;
+/// Number of the run in progress.
+static unsigned long fuzz_run;
+/// State of the random number generator, never 0.
+static uint64_t fuzz_rand_state = 0x9e3779b97f4a7c15ULL;
+
+/// Values worth trying as input bytes: the edges of the targets'
+/// encodings.
+static const uint8_t fuzz_special[] = {
+  0x00, 0x01, 0x02, 0x10, 0x12, 0x20, 0x22, 0x40, 0x7f, 0x80,
+  0xef, 0xf0, 0xff
+};
+
+/// Ask the sanitizers to abort, so fuzz_crash() gets to save the input.
+const char *__asan_default_options(void)
+{
+  return "abort_on_error=1";
+}
+
+/// See __asan_default_options().
+const char *__ubsan_default_options(void)
+{
+  return "abort_on_error=1:halt_on_error=1:print_stacktrace=1";
+}
+
+static uint64_t fuzz_rand(void)
+{
+  fuzz_rand_state ^= fuzz_rand_state << 13;
+  fuzz_rand_state ^= fuzz_rand_state >> 7;
+  fuzz_rand_state ^= fuzz_rand_state << 17;
+
+  return fuzz_rand_state;
+}
+
+/// Save the input that was running and die of the same signal.
+static void fuzz_crash(int sig)
+{
+  char name[32];
+  int fd;
+
+  snprintf(name, sizeof(name), "crash-%lu", fuzz_run);
+  fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0) {
+    if (write(fd, fuzz_data, fuzz_size) != (ssize_t)fuzz_size) {
+      perror(name);
+    }
+    close(fd);
+  }
+  fprintf(stderr, "fuzz: run %lu failed, input saved to %s\n", fuzz_run,
+          name);
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+/// Run one input.
+static void fuzz_one(const uint8_t *data, size_t size)
+{
+  fuzz_data = data;
+  fuzz_size = size;
+  LLVMFuzzerTestOneInput(data, size);
+  fuzz_run++;
+}
+
+/// Read a file into the corpus.
+static void fuzz_load(const char *path)
+{
+  FILE *f;
+  struct fuzz_input *in;
+  long size;
+
+  f = fopen(path, "rb");
+  if ((f == NULL) || (fseek(f, 0, SEEK_END) != 0) ||
+      ((size = ftell(f)) < 0) || (fseek(f, 0, SEEK_SET) != 0)) {
+    perror(path);
+    exit(1);
+  }
+  fuzz_corpus = realloc(fuzz_corpus, (fuzz_count + 1) * sizeof(*fuzz_corpus));
+  in = &fuzz_corpus[fuzz_count++];
+  in->size = size;
+  in->data = malloc(size ? size : 1);
+  if ((fuzz_corpus == NULL) || (in->data == NULL) ||
+      (fread(in->data, 1, size, f) != (size_t)size)) {
+    perror(path);
+    exit(1);
+  }
+  fclose(f);
+}
+
+/// Read every file in a directory into the corpus.
+static void fuzz_load_dir(const char *path)
+{
+  DIR *dir;
+  struct dirent *ent;
+  char name[4096];
+
+  dir = opendir(path);
+  if (dir == NULL) {
+    perror(path);
+    exit(1);
+  }
+  while ((ent = readdir(dir)) != NULL) {
+    if (ent->d_name[0] == '.') {
+      continue;
+    }
+    snprintf(name, sizeof(name), "%s/%s", path, ent->d_name);
+    fuzz_load(name);
+  }
+  closedir(dir);
+}
+
+/**
+   Change an input in place a few times over.
+
+   @param[in,out] data Input, with room for max bytes.
+   @param[in]     size Bytes of data in use.
+   @param[in]     max  Size of data.
+   @return        Bytes of data in use afterwards.
+*/
+static size_t fuzz_mutate(uint8_t *data, size_t size, size_t max)
+{
+  unsigned n = 1 + fuzz_rand() % 4;
+  const struct fuzz_input *other;
+  size_t pos;
+  size_t len;
+
+  while (n--) {
+    pos = size ? fuzz_rand() % size : 0;
+    switch (fuzz_rand() % 8) {
+    case 0:
+      if (size) {
+        data[pos] ^= 1 << (fuzz_rand() % 8);
+      }
+      break;
+    case 1:
+      if (size) {
+        data[pos] = fuzz_rand();
+      }
+      break;
+    case 2:
+      if (size) {
+        data[pos] = fuzz_special[fuzz_rand() % sizeof(fuzz_special)];
+      }
+      break;
+    case 3:
+      if (size) {
+        data[pos] += (fuzz_rand() % 33) - 16;
+      }
+      break;
+    case 4:
+      // Insert a byte.
+      if (size < max) {
+        memmove(&data[pos + 1], &data[pos], size - pos);
+        data[pos] = fuzz_rand();
+        size++;
+      }
+      break;
+    case 5:
+      // Erase a run of bytes.
+      if (size) {
+        len = 1 + fuzz_rand() % (size - pos);
+        memmove(&data[pos], &data[pos + len], size - pos - len);
+        size -= len;
+      }
+      break;
+    case 6:
+      // Repeat a run of bytes, up to max.
+      if (size) {
+        len = 1 + fuzz_rand() % (size - pos);
+        while ((size + len <= max) && (fuzz_rand() % 4)) {
+          memmove(&data[pos + len], &data[pos], size - pos);
+          size += len;
+        }
+      }
+      break;
+    default:
+      // Splice in part of another input.
+      other = &fuzz_corpus[fuzz_rand() % fuzz_count];
+      if (other->size) {
+        len = 1 + fuzz_rand() % other->size;
+        if (pos + len > max) {
+          len = max - pos;
+        }
+        memcpy(&data[pos], other->data + other->size - len, len);
+        if (pos + len > size) {
+          size = pos + len;
+        }
+      }
+      break;
+    }
+  }
+
+  return size;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long runs = 0;
+  unsigned long run;
+  size_t max_len = 1024;
+  size_t i;
+  size_t size;
+  uint8_t *buf;
+  struct stat st;
+  const struct fuzz_input *in;
+
+  for (i = 1; i < (size_t)argc; i++) {
+    if (strncmp(argv[i], "-runs=", 6) == 0) {
+      runs = strtoul(argv[i] + 6, NULL, 0);
+    } else if (strncmp(argv[i], "-seed=", 6) == 0) {
+      fuzz_rand_state = strtoull(argv[i] + 6, NULL, 0) | 1;
+    } else if (strncmp(argv[i], "-max_len=", 9) == 0) {
+      max_len = strtoul(argv[i] + 9, NULL, 0);
+    } else if (argv[i][0] == '-') {
+      fprintf(stderr, "fuzz: unknown option %s\n", argv[i]);
+      return 1;
+    } else if ((stat(argv[i], &st) == 0) && S_ISDIR(st.st_mode)) {
+      fuzz_load_dir(argv[i]);
+    } else {
+      fuzz_load(argv[i]);
+    }
+  }
+  if (fuzz_count == 0) {
+    fprintf(stderr, "usage: %s [-runs=N] [-seed=N] [-max_len=N] "
+            "corpus_dir_or_file...\n", argv[0]);
+    return 1;
+  }
+
+  signal(SIGABRT, fuzz_crash);
+  signal(SIGSEGV, fuzz_crash);
+
+  for (i = 0; i < fuzz_count; i++) {
+    fuzz_one(fuzz_corpus[i].data, fuzz_corpus[i].size);
+  }
+  printf("fuzz: %zu corpus inputs ok\n", fuzz_count);
+
+  buf = malloc(max_len ? max_len : 1);
+  if (buf == NULL) {
+    return 1;
+  }
+  for (run = 0; run < runs; run++) {
+    in = &fuzz_corpus[fuzz_rand() % fuzz_count];
+    size = (in->size < max_len) ? in->size : max_len;
+    memcpy(buf, in->data, size);
+    size = fuzz_mutate(buf, size, max_len);
+    fuzz_one(buf, size);
+  }
+  if (runs) {
+    printf("fuzz: %lu mutated inputs ok\n", runs);
+  }
+
+  free(buf);
+  for (i = 0; i < fuzz_count; i++) {
+    free(fuzz_corpus[i].data);
+  }
+  free(fuzz_corpus);
+
+  return 0;
+}
@@ -0,0 +1,175 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/** \file host/fuzz_adb_rx.c
+    \brief Fuzz target for the ADB receive engine.
+
+    Each input is one transaction with a keyboard that answers with
+    arbitrary timing:
+
+    - Byte 0 picks the command: bits 0-1 are the register, bit 2 sends
+      a Listen with two data bytes instead of a Talk.
+    - Byte 1 is how long the device waits after the command's stop bit
+      before pulling the line low, in 2us steps.
+    - Every other byte is how long the line then stays low, then high,
+      then low and so on: 1 to 240us, or 1 to 16ms for 0xf0 and up.
+
+    Memory errors are left to the sanitizers. On top of that no input
+    may leave the state machine stuck:
+
+    - Every transaction ends, idle or with a frame held, within
+      ADB_TXN_MS plus one tick of starting.
+    - Once it has ended the state machine stays idle with its
+      interrupts off, whatever the line does.
+    - The next transaction goes through.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <avr/io.h>
+
+#include "adb.h"
+#include "clock.h"
+#include "event.h"
+#include "host.h"
+
+/// Attention, sync, command byte and stop bit, in us.
+#define FUZZ_CMD_US (800 + 70 + 9 * 100)
+/// Longest a transaction may take, in timer1 counts. The supervisor
+/// checks ADB_TXN_MS on every tick.
+#define FUZZ_TXN_MAX ((uint64_t)(ADB_TXN_MS + 1) * CLOCK_TICKS_PER_MS)
+/// Line activity past this, in timer1 counts from the start, is dropped.
+#define FUZZ_SPAN ((uint64_t)(ADB_TXN_MS + 4) * CLOCK_TICKS_PER_MS)
+
+/// host_now when the transaction started.
+static uint64_t fuzz_start;
+/// Non-zero once the transaction has ended.
+static uint8_t fuzz_done;
+
+static void fuzz_fail(const char *why)
+{
+  fprintf(stderr, "fuzz_adb_rx: %s at %lluus into the transaction, "
+          "state %u\n", why,
+          (unsigned long long)((host_now - fuzz_start) / CLOCK_TICKS_PER_US),
+          adb_state);
+  abort();
+}
+
+/// Check the state machine is idle with nothing left to fire.
+static void fuzz_quiet(void)
+{
+  if (adb_state != ADB_STATE_IDLE) {
+    fuzz_fail("state machine not idle");
+  }
+  if ((TIMSK & (_BV(OCIE1A) | _BV(OCIE2))) || (GICR & _BV(INT2))) {
+    fuzz_fail("interrupts left on");
+  }
+}
+
+/// The main loop's side of EVENT_ADB: pick up the frame, if any.
+static void fuzz_event(void)
+{
+  uint8_t len;
+  uint8_t data[8];
+
+  event_pending = 0;
+  if (adb_state == ADB_STATE_HOLD) {
+    host_enter();
+    adb_read_data(&len, data);
+    host_leave();
+  }
+  if (!fuzz_done) {
+    fuzz_done = 1;
+    if (host_now - fuzz_start > FUZZ_TXN_MAX) {
+      fuzz_fail("transaction overran");
+    }
+  }
+  fuzz_quiet();
+}
+
+/// Run up to a time, handling events on the way.
+static void fuzz_run(uint64_t until)
+{
+  while (host_run(until)) {
+    fuzz_event();
+  }
+  if (fuzz_done) {
+    fuzz_quiet();
+  }
+}
+
+/// Start a transaction.
+static void fuzz_begin(uint8_t cmd)
+{
+  static uint8_t listen[2] = { 0x5a, 0xa5 };
+  int8_t busy;
+
+  fuzz_start = host_now;
+  fuzz_done = 0;
+  host_enter();
+  if (cmd & 0x4) {
+    busy = adb_listen(ADB_ADDR_KEYBOARD, cmd & 0x3, listen, sizeof(listen));
+  } else {
+    busy = adb_command(ADB_ADDR_KEYBOARD, ADB_CMD_TALK, cmd & 0x3);
+  }
+  host_leave();
+  if (busy) {
+    fuzz_fail("state machine busy");
+  }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  uint64_t t;
+  size_t i;
+  uint8_t level = 0;
+
+  if (size < 2) {
+    return 0;
+  }
+
+  host_bringup();
+  fuzz_begin(data[0]);
+  t = fuzz_start + CLOCK_US(FUZZ_CMD_US) + data[1] * CLOCK_US(2);
+  for (i = 2; (i < size) && (t - fuzz_start < FUZZ_SPAN); i++) {
+    fuzz_run(t);
+    host_drive(level);
+    level ^= 1;
+    if (data[i] < 0xf0) {
+      t += CLOCK_US(data[i] + 1);
+    } else {
+      t += (uint64_t)(data[i] - 0xef) * CLOCK_TICKS_PER_MS;
+    }
+  }
+  fuzz_run(t);
+  host_drive(1);
+  fuzz_run(fuzz_start + FUZZ_SPAN);
+  if (!fuzz_done) {
+    fuzz_fail("transaction never ended");
+  }
+
+  // A Talk nobody answers still times out as it should.
+  fuzz_begin(0);
+  fuzz_run(fuzz_start + FUZZ_TXN_MAX);
+  if (!fuzz_done) {
+    fuzz_fail("next transaction never ended");
+  }
+
+  return 0;
+}
@@ -0,0 +1,224 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/** \file host/fuzz_kb.c
+    \brief Fuzz target for keycode handling.
+
+    Each input is a list of records, played in order from a freshly
+    cleared keyboard. The low three bits of a record's first byte say
+    what it is, the bytes after it are its arguments:
+
+    - 0: an ADB response, as the receive engine leaves it. The argument
+      is the bit count, start and stop bits included, followed by as
+      many bytes of bits as that covers, up to nine. It goes through
+      adb_read_data() and, if it is 16 bits, kb_register() as in the
+      main loop.
+    - 1: kb_remap_set(a, b).
+    - 2: kb_layer_set(a, b).
+    - 3: kb_layer_fn(a).
+    - 4: kb_macro_begin(a).
+    - 5: kb_macro_step(a, b).
+    - 6: build a report: an array report, an NKRO report or a bitmap,
+      by the top bits of the record byte.
+    - 7: kb_remap_clear(), kb_arena_clear(), kb_reset() or
+      kb_remap_tick(), by the top bits of the record byte.
+
+    Every array report must list its keys first and its empty slots
+    last, or be all ErrorRollOver. At the end every key is released and
+    any macro left to play out; after that no key may be held and the
+    reports must be empty, so no input leaves a key stuck down.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "adb.h"
+#include "keyboard.h"
+#include "host.h"
+
+extern uint8_t adb_rx_data[9];
+extern uint8_t adb_rx_count;
+
+/// Longest a macro can play for, in reports: every step of a full
+/// arena, with a gap before each.
+#define FUZZ_MACRO_REPORTS KB_ARENA_SIZE
+
+static void fuzz_fail(const char *why)
+{
+  fprintf(stderr, "fuzz_kb: %s\n", why);
+  abort();
+}
+
+/// Check the keys of an array report.
+static void fuzz_check_keys(const uint8_t *keys)
+{
+  uint8_t i;
+
+  for (i = 1; i < KB_REPORT_KEYS; i++) {
+    if ((keys[i] != 0) && (keys[i - 1] == 0)) {
+      fuzz_fail("key after an empty slot");
+    }
+  }
+}
+
+/// Hand a response to adb_read_data() and kb_register().
+static size_t fuzz_frame(const uint8_t *data, size_t size)
+{
+  uint8_t len;
+  uint8_t buff[8];
+  size_t n;
+
+  if (size < 1) {
+    return size;
+  }
+  n = (data[0] + 7) / 8;
+  if (n > sizeof(adb_rx_data)) {
+    n = sizeof(adb_rx_data);
+  }
+  if (n > size - 1) {
+    n = size - 1;
+  }
+  memset(adb_rx_data, 0, sizeof(adb_rx_data));
+  memcpy(adb_rx_data, &data[1], n);
+  adb_rx_count = data[0];
+  adb_state = ADB_STATE_HOLD;
+
+  if (adb_read_data(&len, buff) != 0) {
+    fuzz_fail("held frame not read");
+  }
+  if (len == 16) {
+    kb_register(buff[0]);
+    if (buff[1] != 0xff) {
+      kb_register(buff[1]);
+    }
+  }
+
+  return 1 + n;
+}
+
+/// Build a report of the kind picked by sel.
+static void fuzz_report(uint8_t sel)
+{
+  uint8_t report[1 + KB_BITMAP_SIZE];
+
+  switch (sel % 3) {
+  case 0:
+    kb_usbhid_report(report);
+    fuzz_check_keys(&report[1]);
+    break;
+  case 1:
+    kb_usbhid_nkro(report);
+    break;
+  default:
+    kb_usbhid_bitmap(report);
+    break;
+  }
+}
+
+/// Release everything, let macros play out and check nothing is left.
+static void fuzz_release(void)
+{
+  uint8_t report[1 + KB_BITMAP_SIZE];
+  uint8_t empty[1 + KB_BITMAP_SIZE] = { 0 };
+  uint16_t i;
+
+  for (i = 0; i < KB_STATE_SIZE * 8; i++) {
+    kb_register(0x80 | i);
+  }
+  for (i = 0; i < FUZZ_MACRO_REPORTS; i++) {
+    kb_usbhid_report(report);
+  }
+  if (kb_held()) {
+    fuzz_fail("key held after releasing every key");
+  }
+  kb_usbhid_report(report);
+  if (memcmp(report, empty, 1 + KB_REPORT_KEYS) != 0) {
+    fuzz_fail("array report not empty after releasing every key");
+  }
+  kb_usbhid_nkro(report);
+  if (memcmp(report, empty, sizeof(report)) != 0) {
+    fuzz_fail("NKRO report not empty after releasing every key");
+  }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  size_t i = 0;
+  uint8_t op;
+  uint8_t a;
+  uint8_t b;
+
+  kb_arena_clear();
+  kb_remap_clear();
+
+  while (i < size) {
+    op = data[i++];
+    a = (i < size) ? data[i] : 0;
+    b = (i + 1 < size) ? data[i + 1] : 0;
+    switch (op & 0x7) {
+    case 0:
+      i += fuzz_frame(&data[i], size - i);
+      continue;
+    case 1:
+      kb_remap_set(a, b);
+      i += 2;
+      break;
+    case 2:
+      kb_layer_set(a, b);
+      i += 2;
+      break;
+    case 3:
+      kb_layer_fn(a);
+      i += 1;
+      break;
+    case 4:
+      kb_macro_begin(a);
+      i += 1;
+      break;
+    case 5:
+      kb_macro_step(a, b);
+      i += 2;
+      break;
+    case 6:
+      fuzz_report(op >> 3);
+      break;
+    default:
+      switch ((op >> 3) & 0x3) {
+      case 0:
+        kb_remap_clear();
+        break;
+      case 1:
+        kb_arena_clear();
+        break;
+      case 2:
+        kb_reset();
+        break;
+      default:
+        kb_remap_tick();
+        break;
+      }
+      break;
+    }
+  }
+
+  fuzz_release();
+
+  return 0;
+}
@@ -0,0 +1,288 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/** \file host/host.c
+    \brief ATmega32 and ADB bus model for host builds.
+
+    Runs adb.c unchanged on a PC. The registers it uses are variables
+    (see avr/io.h here) and this file plays the hardware around them:
+
+    - Timer1 counts host_now. Compare A fires when it reaches OCR1A
+      with OCIE1A set. There is no overflow interrupt on the device
+      either, an overflow is counted straight into clock_ovf, which is
+      what clock_sample() would do.
+    - Timer2 in CTC mode fires every OCR2 + 1 counts while OCIE2 is set,
+      counting from when it was set (the firmware clears TCNT2 first).
+    - The ADB line is the wired AND of PB2, when it is an output, and
+      of the device (host_drive()). Edges set INTF2 as ISC2 selects,
+      and INT2 fires while it is enabled in GICR.
+    - adb_tick() runs every millisecond, like the main loop's tick.
+
+    Handlers take no time and run to completion, one at a time. Flags
+    are cleared by writing one to them, which is seen after the
+    firmware returns; between firmware calls TIFR and GIFR read 0. A
+    compare match is not kept while its interrupt is off, the firmware
+    clears it before enabling anyway.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <avr/io.h>
+
+#include "adb.h"
+#include "clock.h"
+#include "event.h"
+#include "stats.h"
+#include "host.h"
+
+#if ADB_TX_SPI
+#error "host builds use the bit-banged transmit engine"
+#endif
+
+volatile uint8_t PORTA;
+volatile uint8_t DDRA;
+volatile uint8_t PINA;
+volatile uint8_t PORTB;
+volatile uint8_t DDRB;
+volatile uint8_t PINB;
+volatile uint8_t SPCR;
+volatile uint8_t SPDR;
+volatile uint8_t TIMSK;
+volatile uint8_t TIFR;
+volatile uint8_t GICR;
+volatile uint8_t GIFR;
+volatile uint8_t MCUCSR;
+volatile uint8_t TCCR1A;
+volatile uint8_t TCCR1B;
+volatile uint16_t TCNT1;
+volatile uint16_t OCR1A;
+volatile uint16_t OCR1B;
+volatile uint8_t TCCR2;
+volatile uint8_t TCNT2;
+volatile uint8_t OCR2;
+volatile uint16_t SP;
+
+uint64_t host_now;
+void (*host_tick)(void);
+
+/// Level the device drives the line to, 1 for released.
+static uint8_t host_device;
+/// Line level as of the last edge.
+static uint8_t host_level;
+/// INT2 flag.
+static uint8_t host_intf2;
+/// Time of the next 1ms tick.
+static uint64_t host_tick_next;
+/// Time of the next timer2 compare, 0 while OCIE2 is off.
+static uint64_t host_t2_next;
+/// Time timer2 last started from 0.
+static uint64_t host_t2_base;
+
+/// Never, as a time.
+#define HOST_NEVER UINT64_MAX
+
+/**
+   Put the model and every register back to power up, at time 0.
+*/
+void host_reset(void)
+{
+  PORTA = DDRA = PINA = 0;
+  PORTB = DDRB = PINB = 0;
+  SPCR = SPDR = 0;
+  TIMSK = TIFR = GICR = GIFR = MCUCSR = 0;
+  TCCR1A = TCCR1B = 0;
+  TCNT1 = OCR1A = OCR1B = 0;
+  TCCR2 = TCNT2 = OCR2 = 0;
+  SP = RAMEND;
+
+  host_now = 0;
+  host_device = 1;
+  host_level = 1;
+  host_intf2 = 0;
+  host_tick_next = CLOCK_TICKS_PER_MS;
+  host_t2_next = 0;
+  host_t2_base = 0;
+
+  clock_ovf = 0;
+  event_pending = 0;
+  event_ms = 0;
+  stats_isr_depth = 0;
+  memset((void *)&stats_count, 0, sizeof(stats_count));
+  memset((void *)&stats_rx, 0, sizeof(stats_rx));
+  memset((void *)&stats_isr, 0, sizeof(stats_isr));
+  memset((void *)stats_isr.sp_min, 0xff, sizeof(stats_isr.sp_min));
+}
+
+/**
+   Level of the ADB line.
+
+   @return 1 if nothing drives it low.
+*/
+uint8_t host_line(void)
+{
+  uint8_t mcu = !(DDRB & _BV(PB2)) || (PORTB & _BV(PB2));
+
+  return mcu && host_device;
+}
+
+/**
+   Set up the registers the firmware reads for the current time. Call
+   before any firmware code, then host_leave().
+*/
+void host_enter(void)
+{
+  TCNT1 = (uint16_t)host_now;
+  TCNT2 = host_t2_next ? (host_now - host_t2_base) % (OCR2 + 1) : 0;
+  PINB = host_line() ? _BV(PB2) : 0;
+  TIFR = 0;
+  GIFR = 0;
+}
+
+/// Run a handler or other firmware function between host_enter() and
+/// host_leave().
+static void host_call(void (*fn)(void))
+{
+  host_enter();
+  fn();
+  host_leave();
+}
+
+/**
+   Take in what the firmware just did: flags it cleared, timer2 being
+   started or stopped and the line it may have moved, then run INT2 if
+   that raised it.
+*/
+void host_leave(void)
+{
+  uint8_t level;
+
+  if (GIFR & _BV(INTF2)) {
+    host_intf2 = 0;
+  }
+  GIFR = 0;
+  TIFR = 0;
+
+  if (!(TIMSK & _BV(OCIE2))) {
+    host_t2_next = 0;
+  } else if (!host_t2_next) {
+    host_t2_base = host_now;
+    host_t2_next = host_now + OCR2 + 1;
+  }
+
+  level = host_line();
+  if (level != host_level) {
+    host_level = level;
+    if (level == !!(MCUCSR & _BV(ISC2))) {
+      host_intf2 = 1;
+    }
+  }
+
+#if !ADB_RX_SAMPLED
+  if (host_intf2 && (GICR & _BV(INT2))) {
+    host_intf2 = 0;
+    host_call(host_int2_vect);
+  }
+#endif
+}
+
+/**
+   Drive the line from the device side, at the current time.
+
+   @param[in] level 0 to pull the line low, 1 to release it.
+*/
+void host_drive(uint8_t level)
+{
+  host_device = level;
+  host_enter();
+  host_leave();
+}
+
+/// Move time forward, counting timer1 overflows on the way.
+static void host_advance(uint64_t t)
+{
+  clock_ovf += (uint32_t)((t >> 16) - (host_now >> 16));
+  host_now = t;
+}
+
+/**
+   Run the firmware's interrupts and the 1ms tick up to a time, or
+   until one of them posts an event for the main loop to handle.
+
+   @param[in] until Time to stop at.
+   @return 1 if stopped early by an event, host_now is then its time.
+*/
+uint8_t host_run(uint64_t until)
+{
+  uint64_t next;
+  uint64_t compa;
+
+  while (!event_pending) {
+    compa = HOST_NEVER;
+    if (TIMSK & _BV(OCIE1A)) {
+      compa = host_now + (uint16_t)(OCR1A - (uint16_t)host_now);
+      if (compa == host_now) {
+        compa += 0x10000;
+      }
+    }
+    next = host_tick_next;
+    if (compa < next) {
+      next = compa;
+    }
+    if (host_t2_next && (host_t2_next < next)) {
+      next = host_t2_next;
+    }
+    if (next > until) {
+      host_advance(until);
+      return 0;
+    }
+    host_advance(next);
+
+    if (next == compa) {
+      host_call(host_timer1_compa_vect);
+#if ADB_RX_SAMPLED
+    } else if (next == host_t2_next) {
+      host_t2_next += OCR2 + 1;
+      host_call(host_timer2_comp_vect);
+#endif
+    } else {
+      host_tick_next += CLOCK_TICKS_PER_MS;
+      event_ms++;
+      host_call(adb_tick);
+      if (host_tick) {
+        host_tick();
+      }
+    }
+  }
+
+  return 1;
+}
+
+/**
+   Reset everything and run the ADB bringup sequence (see adb_init()),
+   leaving the state machine idle.
+*/
+void host_bringup(void)
+{
+  host_reset();
+  host_enter();
+  adb_init();
+  host_leave();
+  while (adb_state != ADB_STATE_IDLE) {
+    host_run(host_now + CLOCK_TICKS_PER_MS);
+  }
+  event_pending = 0;
+}
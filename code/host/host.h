@@ -0,0 +1,45 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/** \file host/host.h
+    \brief Global routines for running the ADB code on a PC.
+*/
+
+#ifndef __inc_host__
+#define __inc_host__
+
+#include <stdint.h>
+
+/// Timer1 counts since host_reset(). Timer1 itself is the low 16 bits.
+extern uint64_t host_now;
+
+/// Called on every 1ms tick after adb_tick(), if set.
+extern void (*host_tick)(void);
+
+void host_reset(void);
+void host_enter(void);
+void host_leave(void);
+void host_drive(uint8_t level);
+uint8_t host_line(void);
+uint8_t host_run(uint64_t until);
+void host_bringup(void);
+
+void host_int2_vect(void);
+void host_timer1_compa_vect(void);
+void host_timer2_comp_vect(void);
+
+#endif
@@ -0,0 +1,183 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/** \file host/seed.c
+    \brief Builds the fuzz corpus from serial logs of a real keyboard.
+
+    Reads the "Poll: received N bits: HEX" lines that the firmware
+    printed over the serial port (see log/ at the top of the tree) and
+    writes:
+
+    - one fuzz_adb_rx input per distinct response, timed as the ADB
+      spec has it, and one for a device that never stops sending, into
+      the first directory;
+    - one fuzz_kb input per log, replaying its responses in order with
+      a report after each, into the second directory.
+
+    \verbatim
+    seed rx_dir kb_dir log...
+    \endverbatim
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/// Longest response in the logs worth keeping, in data bits.
+#define SEED_BITS_MAX 64
+/// Bit cells sent by seed_babble(), more than ADB_TXN_MS holds.
+#define SEED_BABBLE_CELLS 160
+
+/// Write a file, or die.
+static void seed_write(const char *dir, const char *name,
+                       const uint8_t *data, size_t size)
+{
+  char path[4096];
+  FILE *f;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  f = fopen(path, "wb");
+  if ((f == NULL) || (fwrite(data, 1, size, f) != size) || fclose(f)) {
+    perror(path);
+    exit(1);
+  }
+}
+
+/**
+   Write the fuzz_adb_rx input for a response: a Talk R0, the start of
+   the response 200us after the stop bit, then each bit cell as a low
+   and a high time, 35us and 65us for a 1, the other way round for a 0.
+*/
+static void seed_rx(const char *dir, const char *hex, const uint8_t *bits,
+                    unsigned count)
+{
+  uint8_t in[2 + 2 * (SEED_BITS_MAX + 2)];
+  size_t n = 0;
+  unsigned i;
+  uint8_t one;
+  char name[96];
+
+  in[n++] = 0x00;
+  in[n++] = 100;
+  for (i = 0; i < count + 2; i++) {
+    // Start bit, data, stop bit.
+    one = (i == 0) || ((i <= count) && bits[i - 1]);
+    in[n++] = one ? 35 - 1 : 65 - 1;
+    in[n++] = one ? 65 - 1 : 35 - 1;
+  }
+  snprintf(name, sizeof(name), "rx-%u-%s", count, hex);
+  seed_write(dir, name, in, n);
+}
+
+/**
+   Write a fuzz_adb_rx input for a device that keeps sending 1 bits
+   past the end of the transaction, so only the supervisor ends it.
+*/
+static void seed_babble(const char *dir)
+{
+  uint8_t in[2 + 2 * SEED_BABBLE_CELLS];
+  size_t n = 0;
+
+  in[n++] = 0x00;
+  in[n++] = 100;
+  while (n < sizeof(in)) {
+    in[n++] = 35 - 1;
+    in[n++] = 65 - 1;
+  }
+  seed_write(dir, "rx-babble", in, n);
+}
+
+/**
+   Add a response to a fuzz_kb input: the bits as the receive engine
+   stores them, start and stop bits included, then a report.
+*/
+static size_t seed_kb(uint8_t *in, const uint8_t *bits, unsigned count)
+{
+  size_t n = 0;
+  unsigned i;
+
+  in[n++] = 0;
+  in[n++] = count + 2;
+  memset(&in[n], 0, (count + 2 + 7) / 8);
+  in[n] |= 0x80;
+  for (i = 0; i < count; i++) {
+    if (bits[i]) {
+      in[n + (i + 1) / 8] |= 0x80 >> ((i + 1) % 8);
+    }
+  }
+  n += (count + 2 + 7) / 8;
+  in[n++] = 6;
+
+  return n;
+}
+
+int main(int argc, char **argv)
+{
+  static uint8_t kb[1 << 16];
+  uint8_t bits[SEED_BITS_MAX];
+  char line[256];
+  char hex[64];
+  const char *base;
+  size_t kb_len;
+  unsigned count;
+  unsigned i;
+  unsigned byte;
+  int arg;
+  FILE *f;
+
+  if (argc < 4) {
+    fprintf(stderr, "usage: %s rx_dir kb_dir log...\n", argv[0]);
+    return 1;
+  }
+
+  seed_babble(argv[1]);
+  for (arg = 3; arg < argc; arg++) {
+    f = fopen(argv[arg], "r");
+    if (f == NULL) {
+      perror(argv[arg]);
+      return 1;
+    }
+    kb_len = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+      if ((sscanf(line, "Poll: received %u bits: %63[0-9a-fA-F]",
+                  &count, hex) != 2) ||
+          (count > SEED_BITS_MAX) || (strlen(hex) * 4 < count)) {
+        continue;
+      }
+      for (i = 0; i < count; i++) {
+        sscanf(&hex[(i / 8) * 2], "%2x", &byte);
+        bits[i] = (byte >> (7 - (i % 8))) & 0x1;
+      }
+      hex[(count + 7) / 8 * 2] = '\0';
+      seed_rx(argv[1], hex, bits, count);
+      if (kb_len + 16 < sizeof(kb)) {
+        kb_len += seed_kb(&kb[kb_len], bits, count);
+      }
+    }
+    fclose(f);
+
+    base = strrchr(argv[arg], '/');
+    base = base ? base + 1 : argv[arg];
+    if (kb_len) {
+      snprintf(line, sizeof(line), "kb-%s", base);
+      seed_write(argv[2], line, kb, kb_len);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,619 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+/** \file host/stack.c
+    \brief Worst-case stack use of the firmware, from its call graph.
+
+    Reads the firmware's disassembly (avr-objdump -d main.elf), its
+    symbols (avr-nm main.elf) and the -fstack-usage files, and works out
+    how deep the stack can get:
+
+    - A function's frame is its .su figure, which on the AVR already
+      counts the return address. Functions without one (avr-libc, V-USB's
+      assembly) are sized from their code: every push, the frame made by
+      sbiw/subi on r28 or by __prologue_saves__, and the return address.
+      Assembly that branches from one label to another is one function.
+    - Calls are call and rcall, and jmp and rjmp to another function,
+      which is a tail call. An icall (or an ijmp outside the switch
+      tables) may call any function with a .su figure that is never
+      called directly, like the scheduler's tasks, unless -icall names
+      the callees. Recursion can't be bounded and fails the check.
+    - Interrupts pile up on top of the deepest path from main(). A
+      handler that starts with sei (ISR_NOBLOCK) can be interrupted by
+      any other handler; one that doesn't can only be the last. No
+      handler interrupts itself, and -nest caps the handlers on the
+      stack at once.
+
+    The sum is checked against the RAM between the end of static data
+    (_end) and __stack, or -max, and the exit status is 1 when it is
+    over.
+
+    \verbatim
+    stack [-max bytes] [-nest levels] [-icall caller=callee,...]
+          main.dis main.nm file.su...
+    \endverbatim
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/// Longest symbol name kept.
+#define STACK_NAME_MAX 64
+/// Most -icall options.
+#define STACK_ICALL_MAX 16
+/// Longest call path printed.
+#define STACK_PATH_MAX 32
+
+/// Kinds of edge out of a function.
+enum stack_edges {
+  /// call or rcall.
+  STACK_CALL,
+  /// jmp, rjmp or a branch to another symbol.
+  STACK_JUMP,
+};
+
+/// An edge out of a function to another one.
+struct stack_edge {
+  /// Index of the other function.
+  unsigned to;
+  /// One of stack_edges.
+  uint8_t kind;
+};
+
+/// Progress of stack_depth() through a function.
+enum stack_states {
+  STACK_NEW,
+  STACK_BUSY,
+  STACK_DONE,
+};
+
+/// A function, or a label in the disassembly.
+struct stack_fn {
+  char name[STACK_NAME_MAX];
+  /// Frame from -fstack-usage, or -1.
+  int su;
+  /// Bytes pushed, counted from the code.
+  unsigned pushes;
+  /// Frame allocated on top of the pushes, counted from the code.
+  unsigned alloc;
+  /// Edges to other functions.
+  struct stack_edge *edges;
+  unsigned edge_count;
+  /// Has an icall, or an ijmp that isn't a switch table.
+  uint8_t indirect;
+  /// First instruction is sei.
+  uint8_t sei;
+  /// Seen the first instruction.
+  uint8_t started;
+  /// Called or tail called from somewhere.
+  uint8_t called;
+  /// One of stack_states.
+  uint8_t state;
+  /// Deepest stack from its entry, return address included.
+  unsigned depth;
+  /// Next function on the deepest path, or -1.
+  int next;
+  /// Mark for stack_region().
+  unsigned mark;
+};
+
+/// Callees given for the icalls in one function.
+struct stack_icall {
+  char caller[STACK_NAME_MAX];
+  /// Comma separated callees.
+  const char *callees;
+};
+
+static struct stack_fn *stack_fns;
+static unsigned stack_fn_count;
+static struct stack_icall stack_icalls[STACK_ICALL_MAX];
+static unsigned stack_icall_count;
+/// Set when a path can't be bounded.
+static int stack_unbounded;
+/// Last mark given out by stack_depth().
+static unsigned stack_mark;
+
+/// Find a function by name, adding it if it is new.
+static unsigned stack_fn(const char *name)
+{
+  unsigned i;
+
+  for (i = 0; i < stack_fn_count; i++) {
+    if (strcmp(stack_fns[i].name, name) == 0) {
+      return i;
+    }
+  }
+  stack_fns = realloc(stack_fns, (stack_fn_count + 1) * sizeof(*stack_fns));
+  if (stack_fns == NULL) {
+    perror("stack");
+    exit(1);
+  }
+  memset(&stack_fns[i], 0, sizeof(*stack_fns));
+  snprintf(stack_fns[i].name, sizeof(stack_fns[i].name), "%s", name);
+  stack_fns[i].su = -1;
+  stack_fns[i].next = -1;
+  stack_fn_count++;
+  return i;
+}
+
+/// Add an edge, unless it is already there.
+static void stack_edge(unsigned from, unsigned to, uint8_t kind)
+{
+  struct stack_fn *fn = &stack_fns[from];
+  unsigned i;
+
+  for (i = 0; i < fn->edge_count; i++) {
+    if ((fn->edges[i].to == to) && (fn->edges[i].kind == kind)) {
+      return;
+    }
+  }
+  fn->edges = realloc(fn->edges, (fn->edge_count + 1) * sizeof(*fn->edges));
+  if (fn->edges == NULL) {
+    perror("stack");
+    exit(1);
+  }
+  fn->edges[fn->edge_count].to = to;
+  fn->edges[fn->edge_count].kind = kind;
+  fn->edge_count++;
+  stack_fns[to].called = 1;
+}
+
+/// Open a file, or die.
+static FILE *stack_open(const char *path)
+{
+  FILE *f = fopen(path, "r");
+
+  if (f == NULL) {
+    perror(path);
+    exit(1);
+  }
+  return f;
+}
+
+/// Read the frames from a -fstack-usage file, file:line:col:name size kind.
+static void stack_read_su(const char *path)
+{
+  char line[512];
+  char *name;
+  char *tab;
+  unsigned i;
+  int size;
+  FILE *f = stack_open(path);
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    tab = strchr(line, '\t');
+    if (tab == NULL) {
+      continue;
+    }
+    *tab = '\0';
+    name = strrchr(line, ':');
+    name = name ? name + 1 : line;
+    size = atoi(tab + 1);
+    i = stack_fn(name);
+    if (size > stack_fns[i].su) {
+      stack_fns[i].su = size;
+    }
+  }
+  fclose(f);
+}
+
+/// Is this a conditional branch?
+static int stack_branch(const char *op)
+{
+  return (op[0] == 'b') && (op[1] == 'r');
+}
+
+/**
+   Read the disassembly. Function headers are "0000abcd <name>:" and
+   instructions "  abcd:<tab>bytes<tab>op<tab>operands<tab>; comment",
+   where the comment names a jump's target as <name> or <name+0x12>.
+*/
+static void stack_read_dis(const char *path)
+{
+  char line[512];
+  char name[STACK_NAME_MAX];
+  char op[16];
+  char operands[64];
+  char *field;
+  char *target;
+  char *end;
+  struct stack_fn *fn;
+  unsigned r26 = 0;
+  unsigned r27 = 0;
+  unsigned value;
+  unsigned to;
+  int cur = -1;
+  FILE *f = stack_open(path);
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if ((line[0] != ' ') &&
+        (sscanf(line, "%*x <%63[^>]>:", name) == 1)) {
+      cur = stack_fn(name);
+      r26 = r27 = 0;
+      continue;
+    }
+    field = strchr(line, '\t');
+    if ((cur < 0) || (line[0] != ' ') || (field == NULL)) {
+      continue;
+    }
+    field = strchr(field + 1, '\t');
+    operands[0] = '\0';
+    if ((field == NULL) ||
+        (sscanf(field + 1, "%15s %63[^\t;\n]", op, operands) < 1)) {
+      continue;
+    }
+    fn = &stack_fns[cur];
+    if (!fn->started) {
+      fn->started = 1;
+      fn->sei = (strcmp(op, "sei") == 0);
+    }
+
+    if (strcmp(op, "push") == 0) {
+      fn->pushes++;
+    } else if ((strcmp(op, "sbiw") == 0) || (strcmp(op, "subi") == 0)) {
+      if ((sscanf(operands, "r28, %i", &value) == 1) && (value > fn->alloc)) {
+        fn->alloc = value;
+      }
+    } else if (strcmp(op, "ldi") == 0) {
+      sscanf(operands, "r26, %i", &r26);
+      sscanf(operands, "r27, %i", &r27);
+    } else if ((strcmp(op, "icall") == 0) || (strcmp(op, "eicall") == 0) ||
+               (((strcmp(op, "ijmp") == 0) || (strcmp(op, "eijmp") == 0)) &&
+                (strncmp(fn->name, "__tablejump", 11) != 0))) {
+      fn->indirect = 1;
+    } else if ((strcmp(op, "rcall") == 0) &&
+               (strncmp(operands, ".+0", 3) == 0) &&
+               ((operands[3] == '\0') || (operands[3] == ' '))) {
+      // Makes room for a two byte frame.
+      fn->pushes += 2;
+      continue;
+    }
+
+    if ((strcmp(op, "call") != 0) && (strcmp(op, "rcall") != 0) &&
+        (strcmp(op, "jmp") != 0) && (strcmp(op, "rjmp") != 0) &&
+        !stack_branch(op)) {
+      continue;
+    }
+    target = strchr(line, ';');
+    target = target ? strchr(target, '<') : NULL;
+    if (target == NULL) {
+      continue;
+    }
+    target++;
+    end = strpbrk(target, "+>");
+    if ((end == NULL) || (end - target >= STACK_NAME_MAX)) {
+      continue;
+    }
+    snprintf(name, sizeof(name), "%.*s", (int)(end - target), target);
+    if (strcmp(name, "__prologue_saves__") == 0) {
+      // Pushes r2 to r17, r28 and r29, less the ones skipped, then
+      // makes a frame of r27:r26 bytes.
+      value = (*end == '+') ? strtoul(end + 1, NULL, 0) : 0;
+      fn->pushes += 18 - value / 2;
+      fn->alloc += r26 + 256 * r27;
+      continue;
+    }
+    if ((strcmp(name, "__epilogue_restores__") == 0) ||
+        (strcmp(name, fn->name) == 0)) {
+      continue;
+    }
+    to = stack_fn(name);
+    stack_edge(cur, to,
+               ((strcmp(op, "call") == 0) || (strcmp(op, "rcall") == 0)) ?
+               STACK_CALL : STACK_JUMP);
+  }
+  fclose(f);
+}
+
+/// Read _end and __stack from the symbols, as "0080012a B _end".
+static int stack_read_nm(const char *path, unsigned *end, unsigned *top)
+{
+  char line[256];
+  char name[STACK_NAME_MAX];
+  unsigned value;
+  int found = 0;
+  FILE *f = stack_open(path);
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "%x %*s %63s", &value, name) != 2) {
+      continue;
+    }
+    if (strcmp(name, "_end") == 0) {
+      *end = value & 0xffff;
+      found |= 1;
+    } else if (strcmp(name, "__stack") == 0) {
+      *top = value & 0xffff;
+      found |= 2;
+    }
+  }
+  fclose(f);
+  return found == 3;
+}
+
+/// Is this an interrupt handler, __vector_N with N > 0?
+static int stack_vector(const char *name)
+{
+  return (strncmp(name, "__vector_", 9) == 0) && (atoi(&name[9]) > 0);
+}
+
+/// Can an icall from anywhere reach this function?
+static int stack_icall_target(const struct stack_fn *fn)
+{
+  return (fn->su >= 0) && !fn->called && strcmp(fn->name, "main") &&
+    !stack_vector(fn->name);
+}
+
+static unsigned stack_depth(unsigned i);
+
+/// Follow a call to another function, keeping the deepest.
+static void stack_callee(unsigned to, unsigned *best, int *next)
+{
+  unsigned depth = stack_depth(to);
+
+  if (depth > *best) {
+    *best = depth;
+    *next = to;
+  }
+}
+
+/// Follow an icall in function i.
+static void stack_indirect(unsigned i, unsigned *best, int *next)
+{
+  char name[STACK_NAME_MAX];
+  const char *p;
+  size_t len;
+  unsigned k;
+
+  for (k = 0; k < stack_icall_count; k++) {
+    if (strcmp(stack_icalls[k].caller, stack_fns[i].name)) {
+      continue;
+    }
+    for (p = stack_icalls[k].callees; *p; p += len + (p[len] == ',')) {
+      len = strcspn(p, ",");
+      snprintf(name, sizeof(name), "%.*s", (int)len, p);
+      stack_callee(stack_fn(name), best, next);
+    }
+    return;
+  }
+  for (k = 0; k < stack_fn_count; k++) {
+    if (stack_icall_target(&stack_fns[k])) {
+      stack_callee(k, best, next);
+    }
+  }
+}
+
+/**
+   Gather the frame and the callees of function i. For a function
+   without a .su figure this takes in every label without one that it
+   jumps or branches to, as they are the same piece of assembly.
+*/
+static unsigned stack_region(unsigned i, unsigned mark, unsigned *best,
+                             int *next)
+{
+  struct stack_fn *fn = &stack_fns[i];
+  struct stack_edge *e;
+  unsigned frame;
+  unsigned k;
+
+  if (fn->su >= 0) {
+    for (k = 0; k < fn->edge_count; k++) {
+      stack_callee(fn->edges[k].to, best, next);
+    }
+    if (fn->indirect) {
+      stack_indirect(i, best, next);
+    }
+    return fn->su;
+  }
+
+  fn->mark = mark;
+  frame = fn->pushes + fn->alloc;
+  for (k = 0; k < fn->edge_count; k++) {
+    e = &fn->edges[k];
+    if ((e->kind == STACK_JUMP) && (stack_fns[e->to].su < 0)) {
+      if (stack_fns[e->to].mark != mark) {
+        frame += stack_region(e->to, mark, best, next);
+      }
+    } else {
+      stack_callee(e->to, best, next);
+    }
+  }
+  if (fn->indirect) {
+    stack_indirect(i, best, next);
+  }
+  return frame;
+}
+
+/// Deepest stack from the entry of function i, return address included.
+static unsigned stack_depth(unsigned i)
+{
+  struct stack_fn *fn = &stack_fns[i];
+  unsigned best = 0;
+  int next = -1;
+  unsigned frame;
+
+  if (fn->state == STACK_DONE) {
+    return fn->depth;
+  }
+  if (fn->state == STACK_BUSY) {
+    fprintf(stderr, "stack: %s is recursive, see -icall\n", fn->name);
+    stack_unbounded = 1;
+    return 0;
+  }
+  fn->state = STACK_BUSY;
+  frame = stack_region(i, ++stack_mark, &best, &next);
+  if (fn->su < 0) {
+    // The return address, which .su figures count already.
+    frame += 2;
+  }
+  fn->depth = frame + best;
+  fn->next = next;
+  fn->state = STACK_DONE;
+  return fn->depth;
+}
+
+/// Print the deepest path from function i.
+static void stack_path(unsigned i)
+{
+  int fn = i;
+  unsigned n;
+
+  for (n = 0; (fn >= 0) && (n < STACK_PATH_MAX); n++) {
+    printf("%s%s", n ? " > " : "", stack_fns[fn].name);
+    fn = stack_fns[fn].next;
+  }
+  printf("%s\n", (fn >= 0) ? " > ..." : "");
+}
+
+int main(int argc, char **argv)
+{
+  unsigned *isrs;
+  unsigned isr_count = 0;
+  unsigned nest = 0;
+  unsigned limit = 0;
+  unsigned end = 0;
+  unsigned top = 0;
+  unsigned worst;
+  unsigned total;
+  unsigned used;
+  unsigned levels;
+  unsigned main_fn;
+  unsigned last;
+  unsigned best;
+  unsigned k;
+  unsigned i;
+  int pick;
+  int nest_set = 0;
+  int arg;
+  char *eq;
+  char *taken;
+
+  for (arg = 1; (arg < argc) && (argv[arg][0] == '-'); arg += 2) {
+    if (arg + 1 >= argc) {
+      break;
+    }
+    if (strcmp(argv[arg], "-max") == 0) {
+      limit = strtoul(argv[arg + 1], NULL, 0);
+    } else if (strcmp(argv[arg], "-nest") == 0) {
+      nest = strtoul(argv[arg + 1], NULL, 0);
+      nest_set = 1;
+    } else if ((strcmp(argv[arg], "-icall") == 0) &&
+               (stack_icall_count < STACK_ICALL_MAX) &&
+               ((eq = strchr(argv[arg + 1], '=')) != NULL)) {
+      snprintf(stack_icalls[stack_icall_count].caller, STACK_NAME_MAX,
+               "%.*s", (int)(eq - argv[arg + 1]), argv[arg + 1]);
+      stack_icalls[stack_icall_count++].callees = eq + 1;
+    } else {
+      break;
+    }
+  }
+  if (argc - arg < 3) {
+    fprintf(stderr, "usage: %s [-max bytes] [-nest levels] "
+            "[-icall caller=callee,...] main.dis main.nm file.su...\n",
+            argv[0]);
+    return 1;
+  }
+
+  for (k = arg + 2; k < (unsigned)argc; k++) {
+    stack_read_su(argv[k]);
+  }
+  stack_read_dis(argv[arg]);
+  if (!stack_read_nm(argv[arg + 1], &end, &top) && !limit) {
+    fprintf(stderr, "stack: no _end or __stack in %s, give -max\n",
+            argv[arg + 1]);
+    return 1;
+  }
+  if (!limit) {
+    limit = top + 1 - end;
+  }
+
+  main_fn = stack_fn("main");
+  total = stack_depth(main_fn);
+  printf("%-14s %4u  ", "main", total);
+  stack_path(main_fn);
+
+  isrs = calloc(stack_fn_count, sizeof(*isrs));
+  taken = calloc(stack_fn_count, 1);
+  if ((isrs == NULL) || (taken == NULL)) {
+    perror("stack");
+    return 1;
+  }
+  for (i = 0; i < stack_fn_count; i++) {
+    if (stack_vector(stack_fns[i].name) && stack_fns[i].started) {
+      isrs[isr_count++] = i;
+      if (!nest_set && stack_fns[i].sei) {
+        nest++;
+      }
+      printf("%-14s %4u  %s", stack_fns[i].name, stack_depth(i),
+             stack_fns[i].sei ? "nests: " : "");
+      stack_path(i);
+    }
+  }
+  if (!nest_set) {
+    // Every handler that nests, and one more on top.
+    nest++;
+  }
+
+  // Any handler last, under it the deepest handlers that nest.
+  worst = 0;
+  last = 0;
+  for (k = 0; (k < isr_count) && nest; k++) {
+    used = stack_fns[isrs[k]].depth;
+    memset(taken, 0, stack_fn_count);
+    taken[isrs[k]] = 1;
+    for (levels = 1; levels < nest; levels++) {
+      pick = -1;
+      best = 0;
+      for (i = 0; i < isr_count; i++) {
+        if (!taken[isrs[i]] && stack_fns[isrs[i]].sei &&
+            (stack_fns[isrs[i]].depth >= best)) {
+          best = stack_fns[isrs[i]].depth;
+          pick = isrs[i];
+        }
+      }
+      if (pick < 0) {
+        break;
+      }
+      taken[pick] = 1;
+      used += best;
+    }
+    if (used > worst) {
+      worst = used;
+      last = k;
+    }
+  }
+
+  printf("worst case %u bytes: main %u, interrupts %u", total + worst,
+         total, worst);
+  if (worst) {
+    printf(" with %s on top", stack_fns[isrs[last]].name);
+  }
+  printf("\nlimit %u bytes\n", limit);
+  free(isrs);
+  free(taken);
+
+  if (stack_unbounded) {
+    fprintf(stderr, "stack: recursion, worst case not bounded\n");
+    return 1;
+  }
+  if (total + worst > limit) {
+    fprintf(stderr, "stack: worst case %u bytes is over the limit of %u\n",
+            total + worst, limit);
+    return 1;
+  }
+  return 0;
+}
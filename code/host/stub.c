@@ -0,0 +1,56 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/** \file host/stub.c
+    \brief The parts of event.c and stats.c that adb.c and keyboard.c
+    use, for host builds. The real ones need the rest of the device.
+*/
+
+#include <stdint.h>
+
+#include "event.h"
+#include "stats.h"
+
+volatile uint8_t event_pending;
+volatile uint16_t event_ms;
+
+struct stats_counters stats_count;
+struct stats_rx stats_rx;
+struct stats_isr stats_isr;
+volatile uint8_t stats_isr_depth;
+uint16_t stats_boot[STATS_BOOT_COUNT];
+volatile uint16_t stats_stamp[STATS_STAMP_COUNT];
+
+uint16_t event_now_ms(void)
+{
+  return event_ms;
+}
+
+void stats_boot_mark(uint8_t milestone)
+{
+  if (stats_boot[milestone] == 0) {
+    stats_boot[milestone] = event_now_ms();
+  }
+}
+
+void stats_adb_recovered(uint8_t ms)
+{
+  stats_count.adb_recover++;
+  if (ms > stats_count.adb_stall_max) {
+    stats_count.adb_stall_max = ms;
+  }
+}
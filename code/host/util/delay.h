@@ -0,0 +1,28 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/** \file host/util/delay.h
+    \brief Busy waits for host builds, which have no time to wait out.
+*/
+
+#ifndef __inc_host_util_delay__
+#define __inc_host_util_delay__
+
+#define _delay_us(us) ((void)(us))
+#define _delay_ms(ms) ((void)(ms))
+
+#endif
@@ -23,6 +23,7 @@
     in software.
 
     When a key is pressed, bit 7 is 0. When it is released, bit 7 is 1.
+    Every keycode is tracked as one bit of a 128-bit map, see kb_state.
 
     I have determined the keycode for each key on the keyboard below:
 
@@ -30,175 +31,183 @@
 
     This keyboard has option and command keys instead of super and alt. This
     library will remap those accordingly.
+
+    On top of that there is an Fn layer and macros, both set up from the
+    host and kept in kb_arena, a fixed block of RAM handed out by a bump
+    allocator. Nothing is ever freed on its own, kb_arena_clear() drops
+    everything at once. While the Fn key is held, keys are registered
+    through the layer table. A macro replaces its trigger key with a
+    sequence of steps, each one a modifier byte and a usage that go into
+    one report. Reports are built after every ADB poll, so a macro
+    plays at one step per USB interval alongside the other keys. Two
+    steps in a row with the same usage get an empty report between
+    them, or the host would see one long press instead of two.
 */
 
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <avr/eeprom.h>
 #include <avr/pgmspace.h>
 
+#include "keyboard.h"
+
 #define DEBUG 0
 
 /// Represent a translation from ADB to USB or ascii
 struct keycode_translation {
-  unsigned char adb;
   unsigned char usb;
   char ascii;
 };
 
 /** \brief ADB to USB translation
  *
- * Maps ADB keycodes to USB HID values. See chapter 10 of the 
- * USB HID Usage Tables document.
+ * Maps ADB keycodes to USB HID values and characters, built from
+ * keymap.def. The table is indexed directly by ADB keycode. Keycodes
+ * without an entry translate to 0, which is also what the modifier keys
+ * translate to since they are reported in the modifier byte instead.
  */
-const struct keycode_translation keycodes[] PROGMEM = {
-
-  // <esc> 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15
-  {0x35, 41, ' '},
-  {0x7a, 58, ' '},
-  {0x78, 59, ' '},
-  {0x63, 60, ' '},
-  {0x76, 61, ' '},
-  {0x60, 62, ' '},
-  {0x61, 63, ' '},
-  {0x62, 64, ' '},
-  {0x64, 65, ' '},
-  {0x65, 66, ' '},
-  {0x6d, 67, ' '},
-  {0x67, 68, ' '},
-  {0x6f, 69, ' '},
-  {0x69, 104, ' '},
-  {0x6b, 105, ' '},
-  {0x71, 106, ' '},
-
-  // ~ 1 2 3 4 5 6 7 8 9 0 - + <del>
-  {0x32, 53, '`'},
-  {0x12, 30, '1'},
-  {0x13, 31, '2'},
-  {0x14, 32, '3'},
-  {0x15, 33, '4'},
-  {0x17, 34, '5'},
-  {0x16, 35, '6'},
-  {0x1a, 36, '7'},
-  {0x1c, 37, '8'},
-  {0x19, 38, '9'},
-  {0x1d, 39, '0'},
-  {0x1b, 45, '-'},
-  {0x18, 46, '='},
-  {0x33, 42, ' '},
-  /* <tab> q w e r t y u i o p [ ] \ */
-  {0x30, 43, ' '},
-  {0x0c, 20, 'q'},
-  {0x0d, 26, 'w'},
-  {0x0e, 8, 'e'},
-  {0x0f, 21, 'r'},
-  {0x11, 23, 't'},
-  {0x10, 28, 'y'},
-  {0x20, 24, 'u'},
-  {0x22, 12, 'i'},
-  {0x1f, 18, 'o'},
-  {0x23, 19, 'p'},
-  {0x21, 47, '['},
-  {0x1e, 48, ']'},
-  {0x2a, 49, '\\'},
-  // <cap> a s d f g h j k l ; ' <ret>
-  {0x39, 57, ' '},
-  {0x00, 4, 'a'},
-  {0x01, 22, 's'},
-  {0x02, 7, 'd'},
-  {0x03, 9, 'f'},
-  {0x05, 10, 'g'},
-  {0x04, 11, 'h'},
-  {0x26, 13, 'j'},
-  {0x28, 14, 'k'},
-  {0x25, 15, 'l'},
-  {0x29, 51, ';'},
-  {0x27, 52, '\''},
-  {0x24, 40, ' '},
-  // <shift> z x c v b n m , . / <shift>           
-  // 38 (shift)
-  {0x06, 29, 'z'},
-  {0x07, 27, 'x'},
-  {0x08, 06, 'c'},
-  {0x09, 25, 'v'},
-  {0x0b, 05, 'b'},
-  {0x2d, 17, 'n'},
-  {0x2e, 16, 'm'},
-  {0x2b, 54, ','},
-  {0x2f, 55, '.'},
-  {0x2c, 56, '/'},
-  // 38 (shift)
-  // <ctrl> <o> <c> <space> <c> <o> <ctrl>        
-  // 36 (ctrl)
-  // 3a (opt -> super)
-  // 37 (command -> alt)
-  {0x31, 44, ' '},
-  // 37 (command -> alt)
-  // 3a (opt -> super)
-  // 36 (ctrl)
-
-  // <help> <hom> <pgup>
-  {0x72, 117, ' '},
-  {0x73, 74, ' '},
-  {0x74, 75, ' '},
-  // <del>  <end> <pgdn>
-  {0x75, 76, ' '},
-  {0x77, 77, ' '},
-  {0x79, 78, ' '},
-  
-  // up arrow      
-  {0x3e, 82, ' '},
-  // left, down, right arrows
-  {0x3b, 80, ' '},
-  {0x3d, 81, ' '},
-  // ??
-
-  // <c> = / *
-  {0x47, 83, ' '},
-  {0x51, 103, '='},
-  {0x4b, 84, '/'},
-  {0x43, 85, '*'},
-  // 7 8 9 -
-  {0x59, 95, '7'},
-  {0x5b, 96, '8'},
-  {0x5c, 97, '9'},
-  {0x4e, 86, '-'},
-  // 4 5 6 +
-  {0x56, 92, '4'},
-  {0x57, 93, '5'},
-  {0x58, 94, '6'},
-  {0x45, 87, '+'},
-  // 1 2 3 <ent>
-  {0x53, 89, '1'},
-  {0x54, 90, '2'},
-  {0x55, 91, '3'},
-  {0x4c, 88, ' '},
-  // 0 .
-  {0x52, 98, '0'},
-  {0x41, 99, '.'},
-
-  {0, 0, 0}
+#define KEY(adb, usb, ascii) [adb] = {usb, ascii},
+#define MOD(adb, bit)
+const struct keycode_translation keycodes[KB_STATE_SIZE * 8] PROGMEM = {
+#include "keymap.def"
 };
+#undef KEY
+#undef MOD
 
-/// Shift key modifier flag
-uint8_t kb_mod_shift;
-/// Control key modifier flag
-uint8_t kb_mod_ctrl;
-/// Opt key modifier flag
-uint8_t kb_mod_opt;
-/// Command key modifier flag
-uint8_t kb_mod_com;
+/** \brief USB to ADB translation
+ *
+ * The inverse of keycodes, indexed directly by HID usage: the ADB
+ * keycode with bit 7 set, or 0 for usages no key has. Modifier usages
+ * are above the table, they have no entries.
+ */
+#define KEY(adb, usb, ascii) [usb] = 0x80 | (adb),
+#define MOD(adb, bit)
+static const uint8_t kb_usages[KB_BITMAP_SIZE * 8] PROGMEM = {
+#include "keymap.def"
+};
+#undef KEY
+#undef MOD
 
-/// Capslock flag
-uint8_t kb_tog_capslock;
+/*
+ * Checks of keymap.def. Every keycode and usage has to fit the tables
+ * above, which are indexed by them directly.
+ */
+#define KEY(adb, usb, ascii) \
+  _Static_assert((adb) < KB_STATE_SIZE * 8, "ADB keycode above 0x7f"); \
+  _Static_assert(((usb) != 0) && ((usb) < KB_BITMAP_SIZE * 8), \
+                 "HID usage 0 or above 0x7f");
+#define MOD(adb, bit) \
+  _Static_assert((adb) < KB_STATE_SIZE * 8, "ADB keycode above 0x7f");
+#include "keymap.def"
+#undef KEY
+#undef MOD
+
+/*
+ * No two lines of keymap.def may share a keycode or a usage. A
+ * designated initializer given twice just keeps the last one, and the
+ * inverse table can only hold one key per usage. Duplicate case labels
+ * are an error, so each switch here checks one column. Never called.
+ */
+static void kb_keymap_unique(uint8_t code, uint8_t usage)
+  __attribute__((unused));
+static void kb_keymap_unique(uint8_t code, uint8_t usage)
+{
+  switch (code) {
+#define KEY(adb, usb, ascii) case (adb):
+#define MOD(adb, bit) case (adb):
+#include "keymap.def"
+#undef KEY
+#undef MOD
+    break;
+  }
+  switch (usage) {
+#define KEY(adb, usb, ascii) case (usb):
+#define MOD(adb, bit)
+#include "keymap.def"
+#undef KEY
+#undef MOD
+    break;
+  }
+}
 
-/// Current key
-uint8_t kb_key;
+/** \brief Pressed keys
+ *
+ * One bit per ADB keycode, set while the key is held down. Keycode n is
+ * bit (n % 8) of byte (n / 8). This is the only keyboard state, the
+ * modifiers and the HID report are all derived from it.
+ */
+uint8_t kb_state[KB_STATE_SIZE];
+
+uint8_t kb_changed = 1;
+
+uint8_t kb_remap[KB_STATE_SIZE * 8];
+
+/// Saved copy of kb_remap.
+static uint8_t kb_remap_ee[KB_STATE_SIZE * 8] EEMEM;
+/// KB_REMAP_MAGIC once kb_remap_ee has been saved in full.
+static uint8_t kb_remap_ee_magic EEMEM;
+
+/// Marks a saved remap table in EEPROM.
+#define KB_REMAP_MAGIC 0xa5
+/// kb_remap_save when there is nothing to save.
+#define KB_REMAP_CLEAN 0xff
+
+/// Next entry of kb_remap to save, or KB_REMAP_CLEAN.
+static uint8_t kb_remap_save = KB_REMAP_CLEAN;
+/// Milliseconds without changes left before saving starts.
+static uint16_t kb_remap_quiet_ms;
+
+/// Storage for the layer and macros, see kb_arena_alloc().
+static uint8_t kb_arena[KB_ARENA_SIZE];
+/// Bytes of kb_arena handed out.
+static uint8_t kb_arena_used;
+
+/// A macro as stored in kb_arena.
+struct kb_macro {
+  /// ADB keycode that plays it.
+  uint8_t trigger;
+  /// Number of steps.
+  uint8_t steps;
+  /// Modifier byte and usage of each step.
+  uint8_t step[][2];
+};
+
+/// Fn layer: the keycode each key is registered as while Fn is held,
+/// NULL until a key is put on the layer.
+static uint8_t *kb_layer;
+/// ADB keycode of the Fn key, or KB_FN_NONE.
+static uint8_t kb_fn = KB_FN_NONE;
+/// Non-zero while the Fn key is held.
+static uint8_t kb_fn_held;
+
+/// Defined macros.
+static struct kb_macro *kb_macros[KB_MACROS_MAX];
+/// Number of entries in kb_macros.
+static uint8_t kb_macro_count;
+/// One bit per ADB keycode that triggers a macro, like kb_state.
+static uint8_t kb_macro_keys[KB_STATE_SIZE];
+/// Macro being added to by kb_macro_step(), NULL if none.
+static struct kb_macro *kb_macro_open;
+/// Macro playing, NULL if none.
+static const struct kb_macro *kb_macro_play;
+/// Step of kb_macro_play that goes into the next report.
+static uint8_t kb_macro_pos;
+/// Non-zero if the next report leaves the macro out, to release a usage
+/// the next step presses again.
+static uint8_t kb_macro_gap;
+
+/// Byte and bit of an ADB keycode in kb_state.
+#define KB_BYTE(code) ((code) >> 3)
+#define KB_BIT(code)  (1 << ((code) & 0x7))
+/// Non-zero if the key with this ADB keycode is held down.
+#define KB_PRESSED(code) (kb_state[KB_BYTE(code)] & KB_BIT(code))
 
 /** \brief Register a keypress
  *
  * Sets internal keyboard state according to a keycode returned from the ADB
- * keyboard. Tracks modifier keys and regular keys.
+ * keyboard. Every key, modifier or not, is a single bit in kb_state.
  *
  * @param[in]   keycode 8b value returned from keyboard.
  * @return      0 for success.
@@ -206,50 +215,52 @@ uint8_t kb_key;
 uint8_t kb_register(uint8_t keycode)
 {
   // The top bit of the keycode tells us whether a key was pressed or
-  // released. It is 0 when pressed and 1 when released.
-  uint8_t pressed = (~keycode & 0x80) >> 7;
-  uint8_t adb_code = keycode & 0x7f;
+  // released. It is 0 when pressed and 1 when released. The key is
+  // registered as whatever it is remapped to.
+  uint8_t adb_code = kb_remap[keycode & 0x7f];
+  uint8_t i;
 
 #if DEBUG
   printf("kb_register() debug:\n");
   printf("- keycode: %x\n", keycode);
-  printf("- pressed: %x\n", pressed);
   printf("- adb_code: %x\n", adb_code);
 #endif
 
-  // Modifier keys are handled separately.
-  switch(adb_code) {
-  case 0x38:
-    kb_mod_shift = pressed;
-    return 0;
-  case 0x36:
-    kb_mod_ctrl = pressed;
-    return 0;
-  case 0x3a: 
-    kb_mod_opt = pressed;
-    return 0;
-  case 0x37: 
-    kb_mod_com = pressed;
+  if (adb_code == kb_fn) {
+    kb_fn_held = !(keycode & 0x80);
     return 0;
   }
-    
-  // Search for the translation for this keycode.
-  uint8_t index = 0;
-  while(pgm_read_byte(&keycodes[index].usb) != 0) {
-    if (pgm_read_byte(&keycodes[index].adb) == adb_code) {
-      kb_key = pgm_read_byte(&keycodes[index].usb);
+
+  if (kb_macro_keys[KB_BYTE(adb_code)] & KB_BIT(adb_code)) {
+    // Trigger keys only start their macro, one at a time.
+    if (!(keycode & 0x80) && (kb_macro_play == NULL)) {
+      for (i = 0; i < kb_macro_count; i++) {
+        if ((kb_macros[i]->trigger == adb_code) && kb_macros[i]->steps) {
+          kb_macro_play = kb_macros[i];
+          kb_macro_pos = 0;
+          kb_macro_gap = 0;
+          kb_changed = 1;
+          break;
+        }
+      }
     }
-    index++;
+    return 0;
   }
 
-  // Zero out the value if the key was being released.
-  if (!pressed) {
-    kb_key = 0;
+  if (keycode & 0x80) {
+    // Fn may have been let go first, so release the key on both layers.
+    kb_state[KB_BYTE(adb_code)] &= ~KB_BIT(adb_code);
+    if (kb_layer) {
+      adb_code = kb_layer[adb_code];
+      kb_state[KB_BYTE(adb_code)] &= ~KB_BIT(adb_code);
+    }
+  } else {
+    if (kb_layer && kb_fn_held) {
+      adb_code = kb_layer[adb_code];
+    }
+    kb_state[KB_BYTE(adb_code)] |= KB_BIT(adb_code);
   }
-
-#if DEBUG
-  printf("- kb_key: %x\n", kb_key);
-#endif
+  kb_changed = 1;
 
   return 0;
 }
@@ -272,8 +283,9 @@ uint8_t kb_register(uint8_t keycode)
  * \endverbatim
  *
  * Unfortunately the Apple Extended Keyboard II will return the same keycode
- * for both left and right keys. This function will only populate the left
- * modifier keys.
+ * for both left and right keys unless it is switched to device handler 3,
+ * which this code does not do. The right-hand keycodes are mapped anyway.
+ * There is no separate right command key.
  *
  * @return uint8_t modifiers
  */
@@ -281,22 +293,181 @@ uint8_t kb_usbhid_modifiers()
 {
   uint8_t mods = 0;
 
-  mods |= kb_mod_ctrl;
-  mods |= kb_mod_shift << 1;
-  mods |= kb_mod_com << 2;
-  mods |= kb_mod_opt << 3;
+  // One test per MOD() line of keymap.def.
+#define KEY(adb, usb, ascii)
+#define MOD(adb, bit) if (KB_PRESSED(adb)) mods |= (bit);
+#include "keymap.def"
+#undef KEY
+#undef MOD
+  if (kb_macro_play && !kb_macro_gap) {
+    mods |= kb_macro_play->step[kb_macro_pos][0];
+  }
 
   return mods;
 }
 
+/** \brief Convert a HID usage back to a keycode.
+ *
+ * For host-side requests that name keys by usage, see
+ * USBRQ_VENDOR_USAGE_TO_ADB.
+ *
+ * @param[in]   usage HID usage from the keyboard page.
+ * @return      ADB keycode, or 0xff if no key has that usage.
+ */
+uint8_t kb_usbhid_to_adb(uint8_t usage)
+{
+  uint8_t adb;
+
+  if (usage >= sizeof(kb_usages)) {
+    return 0xff;
+  }
+  adb = pgm_read_byte(&kb_usages[usage]);
+  if (!(adb & 0x80)) {
+    return 0xff;
+  }
+
+  return adb & 0x7f;
+}
+
 /** \brief Return current keys in USB representation.
  *
- * Returns an array of the currently pressed keys for use in an HID report.
+ * Fills an array of KB_REPORT_KEYS with the currently pressed keys for use
+ * in an HID report, by scanning the set bits of kb_state. Unused slots
+ * are zero. If more keys are held than fit, every slot is set to the
+ * ErrorRollOver usage as the HID spec requires.
  */
 void kb_usbhid_keys(char *keys)
 {
-  // Right now I only support one key at a time, so this is easy.
-  keys[0] = kb_key;
+  uint8_t i;
+  uint8_t bit;
+  uint8_t bits;
+  uint8_t usb;
+  uint8_t n = 0;
+
+  if (kb_macro_play && !kb_macro_gap && kb_macro_play->step[kb_macro_pos][1]) {
+    keys[n++] = kb_macro_play->step[kb_macro_pos][1];
+  }
+  for (i = 0; i < KB_STATE_SIZE; i++) {
+    bits = kb_state[i];
+    for (bit = 0; bits != 0; bit++, bits >>= 1) {
+      if (!(bits & 0x1)) {
+        continue;
+      }
+      usb = pgm_read_byte(&keycodes[(i << 3) | bit].usb);
+      if (usb == 0) {
+        continue;
+      }
+      if (n == KB_REPORT_KEYS) {
+        memset((void *)keys, 0x01, KB_REPORT_KEYS);
+        return;
+      }
+      keys[n++] = usb;
+    }
+  }
+  while (n < KB_REPORT_KEYS) {
+    keys[n++] = 0;
+  }
+
+  return;
+}
+
+/**
+ * Move a playing macro on to its next step, once a report with the
+ * current one has been built. If the next step has the same usage as
+ * this one, a report without the macro goes out first.
+ */
+static void kb_macro_advance(void)
+{
+  const struct kb_macro *macro = kb_macro_play;
+  uint8_t usage;
+
+  if (macro == NULL) {
+    return;
+  }
+  usage = macro->step[kb_macro_pos][1];
+  if (!kb_macro_gap && (usage != 0) &&
+      (kb_macro_pos + 1 < macro->steps) &&
+      (macro->step[kb_macro_pos + 1][1] == usage)) {
+    kb_macro_gap = 1;
+  } else {
+    kb_macro_gap = 0;
+    if (++kb_macro_pos >= macro->steps) {
+      kb_macro_play = NULL;
+    }
+  }
+  kb_changed = 1;
+
+  return;
+}
+
+/** \brief Write the body of the array report.
+ *
+ * Writes the modifier byte followed by KB_REPORT_KEYS keys, which is the
+ * array report without its ID. Meant to write straight into the USB
+ * driver's transmit buffer (see usb_report_begin()). Clears kb_changed.
+ *
+ * @param[out]  report Buffer of 1 + KB_REPORT_KEYS bytes.
+ */
+void kb_usbhid_report(uint8_t *report)
+{
+  report[0] = kb_usbhid_modifiers();
+  kb_usbhid_keys((char *)&report[1]);
+  kb_changed = 0;
+  kb_macro_advance();
+
+  return;
+}
+
+/** \brief Return current keys as a USB usage bitmap.
+ *
+ * Fills KB_BITMAP_SIZE bytes with one bit per HID usage, set while a key
+ * with that usage is held. Used for the NKRO report, which has no
+ * rollover limit. Modifiers are not included, they go in the modifier
+ * byte as usual. Unlike kb_usbhid_nkro() it leaves a playing macro
+ * where it is, so it can also answer a GET_REPORT.
+ */
+void kb_usbhid_bitmap(uint8_t *bits)
+{
+  uint8_t i;
+  uint8_t bit;
+  uint8_t state;
+  uint8_t usb;
+
+  memset((void *)bits, 0, KB_BITMAP_SIZE);
+  usb = (kb_macro_play && !kb_macro_gap) ?
+    kb_macro_play->step[kb_macro_pos][1] : 0;
+  if ((usb != 0) && (usb < (KB_BITMAP_SIZE * 8))) {
+    bits[usb >> 3] |= 1 << (usb & 0x7);
+  }
+  for (i = 0; i < KB_STATE_SIZE; i++) {
+    state = kb_state[i];
+    for (bit = 0; state != 0; bit++, state >>= 1) {
+      if (!(state & 0x1)) {
+        continue;
+      }
+      usb = pgm_read_byte(&keycodes[(i << 3) | bit].usb);
+      if ((usb != 0) && (usb < (KB_BITMAP_SIZE * 8))) {
+        bits[usb >> 3] |= 1 << (usb & 0x7);
+      }
+    }
+  }
+
+  return;
+}
+
+/** \brief Write the body of the NKRO report.
+ *
+ * Writes the modifier byte followed by the KB_BITMAP_SIZE byte usage
+ * bitmap, which is the NKRO report without its ID, then moves a playing
+ * macro on to its next step.
+ *
+ * @param[out]  report Buffer of 1 + KB_BITMAP_SIZE bytes.
+ */
+void kb_usbhid_nkro(uint8_t *report)
+{
+  report[0] = kb_usbhid_modifiers();
+  kb_usbhid_bitmap(&report[1]);
+  kb_macro_advance();
 
   return;
 }
@@ -314,21 +485,18 @@ char kb_dtoa(uint8_t keycode)
 {
   uint8_t pressed = ~keycode & 0x80;
   uint8_t adb_code = keycode & 0x7f;
+  char ascii;
 
   if (!pressed) {
     return ' ';
   }
 
-  // Search for a translation.
-  uint8_t index = 0;
-  while(pgm_read_byte(&keycodes[index].usb) != 0) {
-    if (pgm_read_byte(&keycodes[index].adb) == adb_code) {
-      return pgm_read_byte(&keycodes[index].ascii);
-    }
-    index++;
+  ascii = pgm_read_byte(&keycodes[adb_code].ascii);
+  if (ascii == 0) {
+    return ' ';
   }
   
-  return ' ';
+  return ascii;
 }
 
 /**
@@ -339,11 +507,273 @@ char kb_dtoa(uint8_t keycode)
  */
 void kb_reset()
 {
-  kb_mod_ctrl = 0;
-  kb_mod_shift = 0;
-  kb_mod_com = 0;
-  kb_mod_opt = 0;
-  kb_key = 0;
+  memset((void *)kb_state, 0, KB_STATE_SIZE);
+  kb_fn_held = 0;
+  kb_changed = 1;
+
+  return;
+}
+
+/**
+ * Check for held keys.
+ *
+ * @return      Non-zero if any key is down in kb_state.
+ */
+uint8_t kb_held(void)
+{
+  uint8_t i;
+
+  for (i = 0; i < KB_STATE_SIZE; i++) {
+    if (kb_state[i]) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Load the remap table saved in EEPROM, or start with every key mapped
+ * to itself if none has been saved.
+ */
+void kb_remap_load(void)
+{
+  uint8_t i;
+
+  if (eeprom_read_byte(&kb_remap_ee_magic) == KB_REMAP_MAGIC) {
+    eeprom_read_block((void *)kb_remap, (const void *)kb_remap_ee,
+                      sizeof(kb_remap));
+    for (i = 0; i < sizeof(kb_remap); i++) {
+      kb_remap[i] &= 0x7f;
+    }
+  } else {
+    for (i = 0; i < sizeof(kb_remap); i++) {
+      kb_remap[i] = i;
+    }
+  }
+  kb_remap_save = KB_REMAP_CLEAN;
+
+  return;
+}
+
+/// Start saving kb_remap once it has been left alone for KB_REMAP_SAVE_MS.
+static void kb_remap_changed(void)
+{
+  // Keys held now would be released under a different keycode.
+  kb_reset();
+  kb_remap_quiet_ms = KB_REMAP_SAVE_MS;
+  kb_remap_save = 0;
+
+  return;
+}
+
+/**
+ * Remap a key. It takes effect at once and is saved to EEPROM later,
+ * see kb_remap_tick().
+ *
+ * @param[in]   from ADB keycode of the key pressed.
+ * @param[in]   to   ADB keycode to register it as.
+ */
+void kb_remap_set(uint8_t from, uint8_t to)
+{
+  kb_remap[from & 0x7f] = to & 0x7f;
+  kb_remap_changed();
+
+  return;
+}
+
+/// Map every key back to itself.
+void kb_remap_clear(void)
+{
+  uint8_t i;
+
+  for (i = 0; i < sizeof(kb_remap); i++) {
+    kb_remap[i] = i;
+  }
+  kb_remap_changed();
+
+  return;
+}
+
+/**
+ * Save remap changes to EEPROM. Must be called once per millisecond.
+ *
+ * Changes are batched: saving starts once the table has been left alone
+ * for KB_REMAP_SAVE_MS, so a host setting up a whole layout costs one
+ * pass. A pass compares one entry per call and only writes entries that
+ * differ, so unchanged cells are never worn. A write takes 8.5ms and
+ * the next one waits for it without blocking. The marker is written
+ * last, so a table cut short by a power loss on its first save is
+ * never loaded.
+ */
+void kb_remap_tick(void)
+{
+  if (kb_remap_save == KB_REMAP_CLEAN) {
+    return;
+  }
+  if (kb_remap_quiet_ms) {
+    kb_remap_quiet_ms--;
+    return;
+  }
+  if (!eeprom_is_ready()) {
+    return;
+  }
+
+  if (kb_remap_save < sizeof(kb_remap)) {
+    eeprom_update_byte(&kb_remap_ee[kb_remap_save], kb_remap[kb_remap_save]);
+    kb_remap_save++;
+  } else {
+    eeprom_update_byte(&kb_remap_ee_magic, KB_REMAP_MAGIC);
+    kb_remap_save = KB_REMAP_CLEAN;
+  }
+
+  return;
+}
+
+/**
+ * Hand out memory from kb_arena.
+ *
+ * @param[in]   len Bytes wanted.
+ * @return      The memory, or NULL if the arena is full.
+ */
+static void *kb_arena_alloc(uint8_t len)
+{
+  void *p;
+
+  if (len > sizeof(kb_arena) - kb_arena_used) {
+    return NULL;
+  }
+  p = &kb_arena[kb_arena_used];
+  kb_arena_used += len;
+
+  return p;
+}
+
+/// Drop the Fn layer and every macro, and free the whole arena.
+void kb_arena_clear(void)
+{
+  kb_arena_used = 0;
+  kb_layer = NULL;
+  kb_fn = KB_FN_NONE;
+  kb_macro_count = 0;
+  kb_macro_open = NULL;
+  kb_macro_play = NULL;
+  memset((void *)kb_macro_keys, 0, sizeof(kb_macro_keys));
+  kb_reset();
 
   return;
 }
+
+/**
+ * Put a key on the Fn layer. The layer table takes KB_STATE_SIZE * 8
+ * bytes of the arena, allocated when the first key is put on it.
+ *
+ * @param[in]   from ADB keycode of the key pressed with Fn.
+ * @param[in]   to   ADB keycode to register it as.
+ * @return      0 for success, 1 if the arena is full.
+ */
+int8_t kb_layer_set(uint8_t from, uint8_t to)
+{
+  uint8_t i;
+
+  if (kb_layer == NULL) {
+    kb_layer = kb_arena_alloc(KB_STATE_SIZE * 8);
+    if (kb_layer == NULL) {
+      return 1;
+    }
+    for (i = 0; i < KB_STATE_SIZE * 8; i++) {
+      kb_layer[i] = i;
+    }
+  }
+  kb_layer[from & 0x7f] = to & 0x7f;
+  kb_reset();
+
+  return 0;
+}
+
+/**
+ * Choose the Fn key. It is not reported to the host itself.
+ *
+ * @param[in]   keycode ADB keycode, after remapping, or KB_FN_NONE.
+ */
+void kb_layer_fn(uint8_t keycode)
+{
+  kb_fn = keycode;
+  kb_reset();
+
+  return;
+}
+
+/**
+ * Start defining a macro, then add its steps with kb_macro_step(). A
+ * macro already on the same key is replaced, its memory is only freed
+ * by kb_arena_clear(). Held keys are dropped, like for a remap.
+ *
+ * @param[in]   trigger ADB keycode, after remapping, that plays it.
+ * @return      0 for success, 1 if there is no room.
+ */
+int8_t kb_macro_begin(uint8_t trigger)
+{
+  struct kb_macro *macro;
+  uint8_t i;
+
+  trigger &= 0x7f;
+  for (i = 0; i < kb_macro_count; i++) {
+    if (kb_macros[i]->trigger == trigger) {
+      break;
+    }
+  }
+  if (i == KB_MACROS_MAX) {
+    return 1;
+  }
+  macro = kb_arena_alloc(sizeof(struct kb_macro));
+  if (macro == NULL) {
+    return 1;
+  }
+
+  macro->trigger = trigger;
+  macro->steps = 0;
+  if ((i < kb_macro_count) && (kb_macro_play == kb_macros[i])) {
+    kb_macro_play = NULL;
+  }
+  kb_macros[i] = macro;
+  if (i == kb_macro_count) {
+    kb_macro_count++;
+  }
+  kb_macro_keys[KB_BYTE(trigger)] |= KB_BIT(trigger);
+  kb_macro_open = macro;
+  // A trigger key held now would never be released.
+  kb_reset();
+
+  return 0;
+}
+
+/**
+ * Add a step to the macro started by kb_macro_begin(). The steps are
+ * stored right after it, so nothing else may be allocated in between.
+ *
+ * @param[in]   mods  HID modifier byte for the step.
+ * @param[in]   usage HID usage for the step, 0 for none.
+ * @return      0 for success, 1 if there is no room or no open macro.
+ */
+int8_t kb_macro_step(uint8_t mods, uint8_t usage)
+{
+  uint8_t *step;
+
+  if ((kb_macro_open == NULL) ||
+      (&kb_macro_open->step[kb_macro_open->steps][0] !=
+       &kb_arena[kb_arena_used])) {
+    kb_macro_open = NULL;
+    return 1;
+  }
+  step = kb_arena_alloc(2);
+  if (step == NULL) {
+    return 1;
+  }
+
+  step[0] = mods;
+  step[1] = usage;
+  kb_macro_open->steps++;
+
+  return 0;
+}
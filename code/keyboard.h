@@ -21,10 +21,46 @@
 #ifndef __inc_keyboard__
 #define __inc_keyboard__
 
+/// Size of the pressed-key bitmap, one bit per ADB keycode.
+#define KB_STATE_SIZE 16
+/// Number of key slots in the HID report.
+#define KB_REPORT_KEYS 4
+/// Size of the HID usage bitmap, covering usages 0x00 to 0x7f.
+#define KB_BITMAP_SIZE 16
+
+/// Time remap changes are held back before saving to EEPROM, in ms.
+#define KB_REMAP_SAVE_MS 2000
+/// Bytes of RAM set aside for the Fn layer and macros.
+#define KB_ARENA_SIZE 192
+/// Most macros that can be defined at once.
+#define KB_MACROS_MAX 8
+/// kb_fn when there is no Fn key.
+#define KB_FN_NONE 0xff
+
+/// Non-zero if kb_state changed since the last kb_usbhid_report().
+extern uint8_t kb_changed;
+
+/// ADB keycode each key is registered as, see kb_remap_set().
+extern uint8_t kb_remap[KB_STATE_SIZE * 8];
+
 char kb_dtoa(uint8_t d);
 void kb_usbhid_keys(char *keys);
+void kb_usbhid_report(uint8_t *report);
+void kb_usbhid_bitmap(uint8_t *bits);
+void kb_usbhid_nkro(uint8_t *report);
 uint8_t kb_usbhid_modifiers();
+uint8_t kb_usbhid_to_adb(uint8_t usage);
 uint8_t kb_register(uint8_t keycode);
 void kb_reset();
+uint8_t kb_held(void);
+void kb_remap_load(void);
+void kb_remap_set(uint8_t from, uint8_t to);
+void kb_remap_clear(void);
+void kb_remap_tick(void);
+void kb_arena_clear(void);
+int8_t kb_layer_set(uint8_t from, uint8_t to);
+void kb_layer_fn(uint8_t keycode);
+int8_t kb_macro_begin(uint8_t trigger);
+int8_t kb_macro_step(uint8_t mods, uint8_t usage);
 
 #endif
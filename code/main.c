@@ -22,74 +22,506 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <avr/wdt.h>
+#include <avr/interrupt.h>
 
 #include "adb.h"
+#include "clock.h"
+#include "event.h"
 #include "keyboard.h"
+#include "phase.h"
+#include "sched.h"
+#include "stats.h"
 #include "uart.h"
 #include "usb.h"
 
+#ifdef SIM
+#include "avr_mcu_section.h"
+
+// Tells simavr which part and clock to run main.elf at, and what to
+// trace into a VCD file (see 'make sim'). The PORTA pins are the
+// debug markers the ADB interrupt handlers drive low while they run,
+// so the trace gives handler cost and interleaving with V-USB to the
+// cycle.
+AVR_MCU(F_CPU, "atmega32");
+AVR_MCU_VCD_FILE("main.vcd", 1000);
+
+const struct avr_mmcu_vcd_trace_t main_trace[] _MMCU_ = {
+  { AVR_MCU_VCD_SYMBOL("ADB"), .mask = _BV(PB2), .what = (void *)&PINB, },
+  { AVR_MCU_VCD_SYMBOL("USB_DPLUS"), .mask = _BV(USB_CFG_DPLUS_BIT), .what = (void *)&PIND, },
+  { AVR_MCU_VCD_SYMBOL("USB_DMINUS"), .mask = _BV(USB_CFG_DMINUS_BIT), .what = (void *)&PIND, },
+  { AVR_MCU_VCD_SYMBOL("ADB_TIMER_ISR"), .mask = _BV(0), .what = (void *)&PORTA, },
+  { AVR_MCU_VCD_SYMBOL("ADB_EDGE_ISR"), .mask = _BV(1), .what = (void *)&PORTA, },
+  { AVR_MCU_VCD_SYMBOL("ADB_RX_WAIT"), .mask = _BV(2), .what = (void *)&PORTA, },
+};
+#endif
+
 /// File handle to UART device
 static FILE uart_str = FDEV_SETUP_STREAM(uart_putchar, NULL, _FDEV_SETUP_WRITE);
 
+// Main loop state, shared by the tasks below.
+/// ADB command in flight, 0 when the bus is free.
+static uint8_t adb_busy;
+/// Retries of a malformed response so far.
+static uint8_t adb_retry;
+/// Backoff before the next retry, in ms.
+static uint8_t adb_retry_ms;
+/// Non-zero if the keyboard is out of sync and needs a flush.
+static uint8_t adb_flush;
+/// Non-zero if a poll finished and its report is not sent.
+static uint8_t report_due;
+/// Non-zero while a report is waiting for the host.
+static uint8_t report_inflight;
+/// Format of the last report, one of USB_REPORT_*.
+static uint8_t report_mode = USB_REPORT_ARRAY;
+/// Non-zero if the host LED state has not been sent to the keyboard.
+static uint8_t led_dirty;
+/// Device the ADB command in flight is for.
+static uint8_t adb_addr;
+/// Milliseconds until the mouse is polled again.
+static uint8_t mouse_poll_ms;
+/// Non-zero if mouseReportBuffer holds motion or buttons not yet sent.
+static uint8_t mouse_due;
+/// Non-zero if the ADB command in flight is a Talk R3 probe.
+static uint8_t adb_probe;
+/// Non-zero while no keyboard answers probes.
+static uint8_t kb_absent;
+/// Milliseconds until the next probe while kb_absent.
+static uint8_t kb_probe_ms;
+/// event_now_ms() at the last keyboard response.
+static uint16_t kb_heard_ms;
+
+/// Service the USB driver.
+static void task_usb_poll(void)
+{
+  usb_poll();
+}
+
+/// Add a mouse delta to an accumulated one, saturating at +-127.
+static int8_t mouse_add(int8_t sum, int8_t delta)
+{
+  int16_t total = sum + delta;
+
+  if (total > 127) {
+    return 127;
+  } else if (total < -127) {
+    return -127;
+  }
+  return total;
+}
+
+/// Fold a mouse register 0 response into mouseReportBuffer.
+/**
+   The mouse only answers when it has something to say, so no response
+   just means no motion. Motion that arrives before the last report was
+   picked up is added to it, so none is lost.
+*/
+static void mouse_read(void)
+{
+  uint8_t len;
+  uint8_t data[8];
+
+  if ((adb_read_data(&len, data) != 0) || (len != 16)) {
+    return;
+  }
+
+  // Bit 7 of each byte is a button, active low: the first byte has the
+  // main button, the second has the second button if there is one. The
+  // other 7 bits are Y and X motion, in two's complement.
+  mouseReportBuffer.buttonMask = ((data[0] & 0x80) ? 0 : 0x01) |
+                                 ((data[1] & 0x80) ? 0 : 0x02);
+  mouseReportBuffer.dy = mouse_add(mouseReportBuffer.dy,
+                                   (int8_t)(data[0] << 1) >> 1);
+  mouseReportBuffer.dx = mouse_add(mouseReportBuffer.dx,
+                                   (int8_t)(data[1] << 1) >> 1);
+  mouse_due = 1;
+}
+
+/// Note that the keyboard answered.
+static void kb_heard(void)
+{
+  kb_heard_ms = event_now_ms();
+}
+
+/**
+   Handle the answer to a Talk R3 probe. A keyboard that does not answer
+   has been unplugged, so every key it was holding is released at once
+   instead of staying stuck on the host. Probing then goes on every
+   ADB_PROBE_MS, and a keyboard that answers again is picked up where
+   it was plugged in, LEDs included.
+*/
+static void kb_probe_done(void)
+{
+  uint8_t len;
+  uint8_t data[8];
+  uint16_t ms;
+
+  adb_probe = 0;
+  // Any response at all means something is there, even a garbled one.
+  if (adb_read_data(&len, data) == 0) {
+    if (kb_absent) {
+      kb_absent = 0;
+      led_dirty = 1;
+      stats_count.kb_replug++;
+    }
+    kb_heard();
+    return;
+  }
+
+  if (!kb_absent) {
+    kb_absent = 1;
+    kb_reset();
+    report_due = 1;
+    stats_count.kb_unplug++;
+    ms = event_now_ms() - kb_heard_ms;
+    if (ms > stats_count.kb_unplug_ms_max) {
+      stats_count.kb_unplug_ms_max = ms;
+    }
+  }
+  kb_probe_ms = ADB_PROBE_MS;
+}
+
+/// Handle pending events: the tick, a finished ADB transaction, LEDs and keys.
+static void task_events(void)
+{
+  uint8_t event;
+  uint8_t adb_len;
+  uint8_t adb_data[8];
+
+  event = event_take();
+
+  if (event & EVENT_TICK) {
+    usb_tick();
+    adb_tick();
+    if (adb_retry_ms) {
+      adb_retry_ms--;
+    }
+    if (mouse_poll_ms) {
+      mouse_poll_ms--;
+    }
+    if (kb_probe_ms) {
+      kb_probe_ms--;
+    }
+    kb_remap_tick();
+  }
+
+  /* ADB transaction finished. */
+  if (event & EVENT_ADB) {
+    if ((adb_busy == ADB_CMD_TALK) && (adb_addr == ADB_ADDR_MOUSE)) {
+      mouse_read();
+    } else if ((adb_busy == ADB_CMD_TALK) && adb_probe) {
+      kb_probe_done();
+    } else if (adb_busy == ADB_CMD_TALK) {
+      if (adb_read_data(&adb_len, adb_data) != 0) {
+        // No response. Whatever a malformed response held is gone.
+        if (adb_retry) {
+          stats_count.frame_lost++;
+          adb_retry = 0;
+        }
+        report_due = 1;
+      } else if (adb_len == 16) {
+        kb_heard();
+        stats_mark(STATS_STAMP_ADB_READ);
+        phase_adb_done(stats_stamp[STATS_STAMP_ADB_FRAME] -
+                       stats_stamp[STATS_STAMP_ADB_START]);
+        // Two keycodes per response, 0xff when there is no second.
+        kb_register(adb_data[0]);
+        if (adb_data[1] != 0xff) {
+          kb_register(adb_data[1]);
+        }
+        stats_mark(STATS_STAMP_KB_REGISTER);
+        stats_event_open();
+        if (adb_retry) {
+          stats_count.frame_recovered++;
+          adb_retry = 0;
+        }
+        report_due = 1;
+      } else {
+        // Malformed response, retry without waiting for the USB
+        // endpoint. Backoff is 0, 1, 2 and 4ms.
+        kb_heard();
+        stats_count.frame_malformed++;
+        adb_retry++;
+        adb_retry_ms = (1 << adb_retry) >> 2;
+        if (adb_retry > ADB_RETRY_MAX) {
+          // Out of sync. Drop our state and flush the keyboard's.
+          stats_count.frame_lost++;
+          adb_retry = 0;
+          adb_flush = 1;
+          kb_reset();
+          report_due = 1;
+        }
+      }
+    }
+    adb_busy = 0;
+  }
+  if (event & EVENT_LED) {
+    led_dirty = 1;
+  }
+  if (event & EVENT_KEYS) {
+    report_due = 1;
+  }
+}
+
+/// Send the host LED state to the keyboard. Recovery goes first.
+static void task_led_sync(void)
+{
+  static uint8_t led_data[2];
+
+  if (adb_busy || adb_retry || adb_flush || !led_dirty) {
+    return;
+  }
+
+  // Register 2 LEDs are active low: bit 0 num, 1 caps, 2 scroll.
+  led_data[0] = 0xff;
+  led_data[1] = ~(usb_led_state & 0x07);
+  if (adb_listen(ADB_ADDR_KEYBOARD, 2, led_data, sizeof(led_data)) == 0) {
+    adb_busy = ADB_CMD_LISTEN;
+    led_dirty = 0;
+  }
+}
+
+/// Send a Talk R3 probe to the keyboard.
+static void kb_probe(void)
+{
+  if (adb_command(ADB_ADDR_KEYBOARD, ADB_CMD_TALK, 3) == 0) {
+    adb_busy = ADB_CMD_TALK;
+    adb_probe = 1;
+  }
+}
+
+/// Start the next ADB command: a retry, a flush or the next poll.
+/**
+   A keyboard that has not answered anything for ADB_SILENT_MS, or
+   ADB_SILENT_HELD_MS while a key is held, is probed with Talk R3, see
+   kb_probe_done(). Like the mouse poll, the
+   probe only goes out in a gap between keyboard polls. While the
+   keyboard is gone it is only probed, every ADB_PROBE_MS.
+
+   The mouse is polled once per USB_CFG_INTR_POLL_INTERVAL while its last
+   report is sent, in the gaps between keyboard polls. It is not polled
+   if that would still be on the bus when the keyboard poll is due.
+*/
+static void task_adb(void)
+{
+  if (adb_busy) {
+    return;
+  }
+  adb_addr = ADB_ADDR_KEYBOARD;
+
+  if (adb_retry) {
+    if ((adb_retry_ms == 0) && (adb_command(ADB_ADDR_KEYBOARD, ADB_CMD_TALK, 0) == 0)) {
+      adb_busy = ADB_CMD_TALK;
+    }
+  } else if (adb_flush) {
+    if (adb_command(ADB_ADDR_KEYBOARD, ADB_CMD_FLUSH, ADB_REG_FLUSH) == 0) {
+      adb_busy = ADB_CMD_FLUSH;
+      adb_flush = 0;
+    }
+  } else if (kb_absent && (kb_probe_ms == 0)) {
+    kb_probe();
+  } else if (!kb_absent && !usb_report_busy() && !report_due &&
+             phase_due(stats_now())) {
+    if (adb_command(ADB_ADDR_KEYBOARD, ADB_CMD_TALK, 0) == 0) {
+      adb_busy = ADB_CMD_TALK;
+    }
+  } else if (!kb_absent &&
+             ((uint16_t)(event_now_ms() - kb_heard_ms) >=
+              (kb_held() ? ADB_SILENT_HELD_MS : ADB_SILENT_MS)) &&
+             (usb_report_busy() || report_due ||
+              !phase_due(stats_now() + PHASE_TXN_INIT))) {
+    kb_probe();
+  } else if ((mouse_poll_ms == 0) && !mouse_due &&
+             (kb_absent || usb_report_busy() || report_due ||
+              !phase_due(stats_now() + PHASE_TXN_INIT))) {
+    if (adb_command(ADB_ADDR_MOUSE, ADB_CMD_TALK, 0) == 0) {
+      adb_busy = ADB_CMD_TALK;
+      adb_addr = ADB_ADDR_MOUSE;
+      mouse_poll_ms = USB_CFG_INTR_POLL_INTERVAL;
+    }
+  }
+}
+
+/// Feed the interrupt endpoint and build the report of a finished poll.
+static void task_report(void)
+{
+  uint16_t build_start;
+  uchar *report;
+
+  if (usb_report_continue()) {
+    phase_pickup(stats_now());
+    if (report_inflight && !usb_report_busy()) {
+      stats_mark(STATS_STAMP_USB_PICKUP);
+      stats_event_close();
+      report_inflight = 0;
+    }
+  }
+  if (!report_due || usb_report_busy()) {
+    return;
+  }
+
+  if (report_mode != usb_report_mode) {
+    // The format changed. Release every key in the old format first
+    // so the host does not see them stuck.
+    if (report_mode == USB_REPORT_NKRO) {
+      keybNkroReportBuffer.meta = 0;
+      memset((void *)keybNkroReportBuffer.bits, 0, KB_BITMAP_SIZE);
+      usb_report((void *)&keybNkroReportBuffer, sizeof(keybNkroReportBuffer));
+    } else {
+      keybReportBuffer.meta = 0;
+      memset((void *)keybReportBuffer.b, 0, KB_REPORT_KEYS);
+      usb_report((void *)&keybReportBuffer, sizeof(keybReportBuffer));
+    }
+    report_mode = usb_report_mode;
+    return;
+  }
+
+  build_start = stats_now();
+  if (report_mode == USB_REPORT_NKRO) {
+    kb_usbhid_nkro((uint8_t *)&keybNkroReportBuffer.meta);
+    stats_report_built(report_mode, build_start);
+    stats_mark(STATS_STAMP_REPORT_QUEUED);
+    usb_report((void *)&keybNkroReportBuffer, sizeof(keybNkroReportBuffer));
+  } else if (!kb_changed && (usb_report_repeat() == 0)) {
+    // Nothing changed, the last report goes out again as it is.
+    stats_report_built(report_mode, build_start);
+    stats_mark(STATS_STAMP_REPORT_QUEUED);
+  } else {
+    // Built straight into the driver's transmit buffer.
+    report = usb_report_begin();
+    report[0] = keybReportBuffer.id;
+    kb_usbhid_report(&report[1]);
+    stats_report_built(report_mode, build_start);
+    stats_mark(STATS_STAMP_REPORT_QUEUED);
+    usb_report_commit(sizeof(keybReport_t));
+  }
+  stats_mark(STATS_STAMP_USB_HANDOFF);
+  stats_event_queued();
+  stats_count.kb_reports++;
+  report_inflight = 1;
+  if (usbConfiguration != 0) {
+    stats_boot_mark(STATS_BOOT_FIRST_REPORT);
+  }
+  report_due = 0;
+}
+
+/// Send mouse motion on endpoint 3 once the host has taken the last.
+static void task_mouse(void)
+{
+  if (!mouse_due || !usbInterruptIsReady3()) {
+    return;
+  }
+
+  usbSetInterrupt3((void *)&mouseReportBuffer, sizeof(mouseReportBuffer));
+  mouseReportBuffer.dx = 0;
+  mouseReportBuffer.dy = 0;
+  mouse_due = 0;
+  stats_count.mouse_reports++;
+}
+
+/// Send the next queued character.
+static void task_uart(void)
+{
+  uart_drain();
+}
+
+/**
+   Main loop tasks, run in this order on every pass. The order matters:
+   events are handled before the ADB tasks look at the bus, and the LED
+   update goes before a poll. Deadlines are in us; the loop runs at
+   least once per 1ms tick, so only usbPoll() has real slack, V-USB
+   needs it every 50ms.
+*/
+static const struct sched_task main_tasks[] = {
+  {task_usb_poll, 10000, SCHED_URGENT},
+  {task_events,    2000, 0},
+  {task_led_sync, 20000, 0},
+  {task_adb,       2000, 0},
+  {task_report,    2000, 0},
+  {task_mouse,     2000, 0},
+  {task_uart,      2000, 0},
+};
+
+/// Number of main loop tasks.
+#define MAIN_TASKS (sizeof(main_tasks) / sizeof(main_tasks[0]))
+
 /*! \brief Reset entry point.
-  
-  At reset the device starts executing at this point. This will call
-  initializers to disable the watch dog timer and enable the ADB and
-  USB interfaces. The watch dog timer is a nice feature to have but it hasn't been necessary (yet) for this project.
 
-  The function usb_init() handles all of the USB interface initialization. No other global state is necessary for 
-  The ADB interface is set up by declaring and initializing the variables that the data returned by the keyboard. The adb_init() function is then called, which will handle the reset tasks on the line.
+  At reset the device starts executing at this point. The initializers
+  run in dependency order:
+
+  -# stats_init() reads the reset flags, so it goes before anything
+     else touches MCUCSR, and counts watchdog resets.
+  -# clock_init() starts timer1, which everything else schedules
+     against.
+  -# usb_init() starts the fake disconnect that forces the host to
+     enumerate the device again.
+  -# adb_init() starts the ADB bus reset.
+  -# kb_remap_load() reads the key remapping from EEPROM.
+  -# event_init() starts the 1ms tick and selects idle sleep.
+  -# uart_init() sets up the debug output.
+  -# The watchdog is enabled with a 250ms timeout.
+
+  None of the initializers block. Once interrupts are enabled the USB
+  disconnect and the ADB reset run side by side, both stepped by the
+  tick, so bringup takes as long as the longer of the two rather than
+  their sum. The banner is only queued for the UART.
 
+  The main loop then runs the task table main_tasks once per pass (see
+  sched.c) and sleeps in event_wait() until the next interrupt. The
+  tasks handle whatever events are pending (see event.h), start the
+  next ADB command and send the reports. A keyboard poll is started
+  when the USB interrupt endpoint is free and there is just enough time
+  left to finish it before the host polls the endpoint again (see
+  phase.c), and its report is sent as soon as the poll is done. A mouse
+  is polled in the gaps and has its own interrupt endpoint, so the two
+  never queue behind each other on the USB side.
 
-It then enters the main
-  loop and polls the ADB device and sends data on the USB interface as
-  needed.
+  The watchdog is reset on every pass, which happens at least once per
+  tick, so it only fires on a total lockup. A stalled ADB transaction is
+  caught well before that by the supervisor in adb_tick().
 */
 int main(void)
 {
-  // Initialize watchdog timer.
-  wdt_disable();
+  // Initialize instrumentation first, it looks at the reset flags.
+  stats_init();
+
+  // Start the timebase, everything else schedules against it.
+  clock_init();
 
   // Initialize USB.
   usb_init();
 
   // Initialize ADB.
-  uint8_t adb_status = 0;
-  uint8_t adb_len;
-  uint8_t adb_data[8];
   adb_init();
 
+  // Load the key remapping.
+  kb_remap_load();
+
+  // Initialize main loop events.
+  event_init();
+
   // Initialize UART.
   uart_init();
   stdout = &uart_str;
+
+  // Initialize watchdog timer.
+  wdt_enable(WDTO_250MS);
+
+  // USB and ADB bringup continue from the tick from here on.
+  sei();
     
   printf("ADBUSB v0.4\n");
   printf("Copyright 2011-12 Devrin Talen\n");
 
+  sched_reset();
   while(1) {
-    usbPoll();
-    /* ADB phase. */
-    if (usbInterruptIsReady()) {
-      adb_status = adb_command(2, ADB_CMD_TALK, 0);
-    }
-    if (adb_status != 0) {
-      adb_status = adb_read_data(&adb_len, adb_data);
-      if (adb_status == 0) {
-    	if (adb_len == 16) {
-    	  kb_register(adb_data[0]);
-    	} else {
-    	  //kb_reset();
-    	}
-      }
-    }
-    /* USB phase. */
-    if (usbInterruptIsReady()) {
-      keybReportBuffer.meta = kb_usbhid_modifiers();
-      kb_usbhid_keys(keybReportBuffer.b);
-      usbSetInterrupt((void *)&keybReportBuffer, sizeof(keybReportBuffer));
-      keybReportBuffer.b[0] = 0;
-    }
+    wdt_reset();
+    sched_run(main_tasks, MAIN_TASKS);
+
+    /* Nothing left to do until the next interrupt. */
+    event_wait();
   }
 
   return 0;
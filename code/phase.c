@@ -0,0 +1,120 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/** \file phase.c
+    \brief Locks the ADB poll to the host's polls of the interrupt endpoint.
+
+    A report sits in the endpoint until the host next polls it, so a key
+    read just after a poll waits for a whole interval. Polling ADB as
+    soon as the endpoint is free puts the read at the start of that wait.
+    Instead the ADB poll is started so that it finishes just before the
+    host's next poll.
+
+    V-USB can count SOF packets only with its interrupt on D-, which this
+    board does not have. The host's polls are seen instead as the points
+    where it picks up a packet (usb_report_continue()). Since a report
+    is queued after every ADB poll the endpoint is picked up once per
+    poll interval.
+
+    The interval and the length of an ADB transaction are both tracked
+    with a moving average. The guard time before the host's poll grows
+    whenever a report misses its poll and slowly shrinks again while
+    they are on time. All times are in microseconds, from stats_now().
+*/
+
+#include <stdint.h>
+#include "phase.h"
+
+/// Estimated interval between the host's polls.
+static uint16_t phase_period = PHASE_PERIOD_INIT;
+/// Estimated length of an ADB transaction.
+static uint16_t phase_txn = PHASE_TXN_INIT;
+/// Guard time between the end of the ADB poll and the host's poll.
+static uint16_t phase_margin = PHASE_MARGIN_INIT;
+/// Time of the last pickup.
+static uint16_t phase_last;
+/// Non-zero once a pickup has been seen.
+static uint8_t phase_locked;
+
+/**
+   Note that the host picked up a packet.
+
+   @param[in] now Time of the pickup.
+*/
+void phase_pickup(uint16_t now)
+{
+  uint16_t gap;
+
+  gap = now - phase_last;
+  phase_last = now;
+  if (!phase_locked) {
+    phase_locked = 1;
+    return;
+  }
+
+  if ((gap < PHASE_PERIOD_MIN) || (gap > PHASE_PERIOD_MAX)) {
+    // Not a poll interval, the bus was idle or suspended.
+    return;
+  }
+  if (gap > phase_period + (phase_period >> 1)) {
+    // The report missed a poll and waited for the next one.
+    if (phase_margin < PHASE_MARGIN_MAX) {
+      phase_margin += PHASE_MARGIN_STEP;
+    }
+    return;
+  }
+
+  // Moving average over 8 intervals.
+  phase_period = phase_period - (phase_period >> 3) + (gap >> 3);
+  if (phase_margin > PHASE_MARGIN_MIN) {
+    phase_margin -= PHASE_MARGIN_DECAY;
+  }
+}
+
+/**
+   Note how long an ADB transaction took.
+
+   @param[in] duration From the command to the end of the response.
+*/
+void phase_adb_done(uint16_t duration)
+{
+  // Moving average over 4 transactions.
+  phase_txn = phase_txn - (phase_txn >> 2) + (duration >> 2);
+}
+
+/**
+   Check whether the next ADB poll should start.
+
+   @param[in] now Current time.
+   @return Non-zero if a poll started now would finish in time for the
+           host's next poll.
+*/
+uint8_t phase_due(uint16_t now)
+{
+  uint16_t lead;
+
+  if (!PHASE_LOCK || !phase_locked) {
+    return 1;
+  }
+
+  lead = phase_txn + phase_margin;
+  if (lead >= phase_period) {
+    return 1;
+  }
+
+  return (uint16_t)(now - phase_last) >= phase_period - lead;
+}
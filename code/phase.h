@@ -0,0 +1,55 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/** \file phase.h
+    \brief Global routines for locking the ADB poll to the USB poll.
+*/
+
+#ifndef __inc_phase__
+#define __inc_phase__
+
+#include <stdint.h>
+
+#ifndef PHASE_LOCK
+/// Set to 0 to poll ADB as soon as the endpoint is free, for comparison.
+#define PHASE_LOCK 1
+#endif
+
+/// Period assumed until the host has been measured, in us.
+#define PHASE_PERIOD_INIT 10000
+/// Shortest plausible endpoint poll period, in us.
+#define PHASE_PERIOD_MIN 1000
+/// Longest plausible endpoint poll period, in us.
+#define PHASE_PERIOD_MAX 32000
+/// ADB transaction length assumed until one has been measured, in us.
+#define PHASE_TXN_INIT 4000
+/// Guard time between the end of the poll and the host's poll, in us.
+#define PHASE_MARGIN_INIT 1500
+/// Smallest guard time, in us.
+#define PHASE_MARGIN_MIN 1000
+/// Guard time added after every missed poll, in us.
+#define PHASE_MARGIN_STEP 500
+/// Guard time taken off after every poll that was on time, in us.
+#define PHASE_MARGIN_DECAY 4
+/// Largest guard time, in us.
+#define PHASE_MARGIN_MAX 5000
+
+void phase_pickup(uint16_t now);
+void phase_adb_done(uint16_t duration);
+uint8_t phase_due(uint16_t now);
+
+#endif
@@ -0,0 +1,151 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/** \file sched.c
+    \brief Cooperative deadline scheduler for the main loop.
+
+    The main loop is a table of tasks, run in order once per pass. Every
+    task does a bounded slice of work and returns; none of them waits.
+    Each task has a deadline, the longest it may go between two runs.
+    A run that comes later than that is counted as a miss, and the
+    longest gap and the longest pass through the table are recorded, so
+    a new feature that slows the loop down shows up in the measurements
+    instead of as a flaky USB connection.
+
+    V-USB needs usbPoll() at least every 50ms. Its task is flagged
+    SCHED_URGENT, which makes the scheduler run it again between other
+    tasks whenever half of its deadline has gone by, so one slow task
+    cannot push it past its budget.
+
+    Built with SOAK_JITTER, every pass is held up by a random amount
+    before a random task, see sched_soak().
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "clock.h"
+#include "sched.h"
+
+struct sched_stats sched_stats;
+
+/// clock_us() at the last run of each task.
+static uint32_t sched_last[SCHED_TASKS_MAX];
+
+#ifdef SOAK_JITTER
+_Static_assert(SOAK_JITTER < 1000, "SOAK_JITTER must be shorter than a tick");
+
+/// Soak test random sequence, a 16 bit Galois LFSR. Not static, so
+/// a simulator can seed it differently for every instance.
+uint16_t sched_soak_lfsr = 0xace1;
+
+/**
+   Hold up the main loop for a random 0 to SOAK_JITTER us. Interrupts
+   are left alone, so the ADB and USB handlers still run on time, but
+   the tasks after this are late by a different amount each pass. Left
+   running overnight, the latency histograms and counters in stats.c
+   show what that costs in drops and recoveries.
+*/
+static void sched_soak(void)
+{
+  uint32_t start = clock_us();
+  uint16_t wait;
+
+  sched_soak_lfsr = (sched_soak_lfsr >> 1) ^
+    (-(sched_soak_lfsr & 1) & 0xb400);
+  wait = sched_soak_lfsr % (SOAK_JITTER + 1);
+  while (clock_us() - start < wait) {
+  }
+
+  sched_stats.soak_passes++;
+  sched_stats.soak_us += wait;
+}
+#endif
+
+/// Run one task and account for the time since its last run.
+static void sched_start(const struct sched_task *task, uint8_t i)
+{
+  uint32_t now = clock_us();
+  uint32_t gap = now - sched_last[i];
+
+  sched_last[i] = now;
+  if (gap > 0xffff) {
+    gap = 0xffff;
+  }
+  if (gap > sched_stats.gap_max_us[i]) {
+    sched_stats.gap_max_us[i] = gap;
+  }
+  if (task->deadline_us && (gap > task->deadline_us) &&
+      (sched_stats.miss[i] != 0xffff)) {
+    sched_stats.miss[i]++;
+  }
+
+  task->run();
+}
+
+/**
+   Run every task once, in order. Urgent tasks may run more than once.
+
+   @param[in] tasks Task table.
+   @param[in] count Number of tasks, at most SCHED_TASKS_MAX.
+*/
+void sched_run(const struct sched_task *tasks, uint8_t count)
+{
+  uint32_t start = clock_us();
+  uint32_t pass;
+  uint8_t i;
+  uint8_t j;
+#ifdef SOAK_JITTER
+  uint8_t soak = sched_soak_lfsr % count;
+#endif
+
+  for (i = 0; i < count; i++) {
+#ifdef SOAK_JITTER
+    if (i == soak) {
+      sched_soak();
+    }
+#endif
+    sched_start(&tasks[i], i);
+
+    for (j = 0; j < count; j++) {
+      if ((j != i) && (tasks[j].flags & SCHED_URGENT) &&
+          (clock_us() - sched_last[j] > (tasks[j].deadline_us >> 1))) {
+        sched_start(&tasks[j], j);
+      }
+    }
+  }
+
+  pass = clock_us() - start;
+  if (pass > 0xffff) {
+    pass = 0xffff;
+  }
+  if (pass > sched_stats.loop_max_us) {
+    sched_stats.loop_max_us = pass;
+  }
+}
+
+/// Clear the measurements and restart every deadline from now.
+void sched_reset(void)
+{
+  uint32_t now = clock_us();
+  uint8_t i;
+
+  memset((void *)&sched_stats, 0, sizeof(sched_stats));
+  for (i = 0; i < SCHED_TASKS_MAX; i++) {
+    sched_last[i] = now;
+  }
+}
@@ -0,0 +1,69 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/** \file sched.h
+    \brief Global routines for the main loop scheduler.
+*/
+
+#ifndef __inc_sched__
+#define __inc_sched__
+
+#include <stdint.h>
+#include <avr/io.h>
+
+/// Most tasks a task table may have.
+#define SCHED_TASKS_MAX 8
+
+/// Task flag: also run between other tasks once half its deadline is gone.
+#define SCHED_URGENT _BV(0)
+
+/// A main loop task.
+struct sched_task {
+  /// Does one slice of work and returns, it must never wait.
+  void (*run)(void);
+  /// Longest allowed time between two runs, in us. 0 for none.
+  uint16_t deadline_us;
+  /// SCHED_* flags.
+  uint8_t flags;
+};
+
+/// Scheduler measurements, read as one block over USB.
+struct sched_stats {
+  /// Longest pass through the task table, in us.
+  uint16_t loop_max_us;
+  /// Runs that came later than the task's deadline.
+  uint16_t miss[SCHED_TASKS_MAX];
+  /// Longest time between two runs of each task, in us.
+  uint16_t gap_max_us[SCHED_TASKS_MAX];
+  /// Passes held up by SOAK_JITTER, 0 without it.
+  uint16_t soak_passes;
+  /// Total time they were held up for, in us.
+  uint32_t soak_us;
+};
+
+/// Scheduler measurements, indexed like the task table.
+extern struct sched_stats sched_stats;
+
+#ifdef SOAK_JITTER
+/// State of the soak test's random sequence, never 0.
+extern uint16_t sched_soak_lfsr;
+#endif
+
+void sched_run(const struct sched_task *tasks, uint8_t count);
+void sched_reset(void);
+
+#endif
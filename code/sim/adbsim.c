@@ -0,0 +1,825 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+/** \file sim/adbsim.c
+    \brief Runs main.elf against a keyboard and a USB host.
+
+    The firmware runs unchanged in simavr. Two models sit on its pins:
+
+    - kbd.c is an ADB keyboard on PB2 that types at random and answers
+      the firmware's commands with the device timing of the spec.
+    - usbhost.c is a low speed USB host on PD2 and PD4 that resets the
+      device when it connects, keeps the bus alive every frame and
+      polls endpoints 1 and 3 with IN tokens every 10ms.
+
+    The models watch the firmware's outputs by reading the port
+    registers after every instruction, and drive its inputs through
+    the pin IRQs so INT0 and INT2 fire as on the real part. At the end
+    of the run adbsim prints what it measured next to what the firmware
+    measured of itself (stats.h):
+
+    - Key latency, from the keyboard seeing a key change to the host
+      getting the report that has it.
+    - INT0 latency, from the D+ edge to V-USB's handler, which has to
+      stay within a few cycles for V-USB to sync to the packet.
+    - Duty cycle, the share of cycles the processor was not asleep.
+
+    With -soak or -sweep, adbsim runs a batch of instances instead, -j
+    at a time in child processes:
+
+    - -soak N runs N instances, each making up its own crystal error,
+      keyboard timing, USB phase and SOAK_JITTER sequence from its seed
+      (see sim_soak_config()).
+    - -sweep N keeps everything else as given and moves the USB frames
+      across the 10ms between two polls of endpoint 1 in N steps, at
+      each of SIM_SWEEP_TLT keyboard response times (see
+      sim_sweep_config()). That puts USB packets at every offset from
+      the ADB edges, which is where the ISR_NOBLOCK handlers nest with
+      V-USB's INT0 handler.
+
+    The totals over all instances are printed at the end, then the worst
+    case of each measurement that bounds the interrupt design, and the
+    command line that repeats it and each instance that crashed or lost
+    a key or a packet.
+
+    \verbatim
+    adbsim [-t seconds] [-seed N] [-ppm N] [-skew percent] [-tlt us]
+           [-jitter us] [-type ms] [-phase us] [-lfsr N]
+           [-soak instances | -sweep steps] [-j jobs] main.elf
+    \endverbatim
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_irq.h"
+#include "sim_interrupts.h"
+#include "sim_cycle_timers.h"
+
+#include "sim.h"
+
+/// Nominal processor clock.
+#define SIM_F_CPU 16000000
+/// Top of the ATmega32's RAM, where the stack starts.
+#define SIM_RAMEND 0x85f
+/// Largest crystal error of a soak instance, in ppm.
+#define SIM_SOAK_PPM 500.0
+/// Largest keyboard bit cell error of a soak instance, within what
+/// both receive engines read (see ADB_RX_SAMPLED).
+#define SIM_SOAK_SKEW 0.15
+/// Largest keyboard edge jitter of a soak instance, in us.
+#define SIM_SOAK_JITTER_US 5.0
+/// Keyboard response times in a sweep, from 160us to 240us. 10us apart,
+/// which moves the response's edges across most of a bit cell.
+#define SIM_SWEEP_TLT 9
+/// USB frames between two polls of endpoint 1.
+#define SIM_SWEEP_US 10000
+/// Failed instances of a batch to print.
+#define SIM_BATCH_SHOW 20
+
+/// Ways to make up the settings of the instances of a batch.
+enum sim_batches {
+  SIM_SOAK = 0,
+  SIM_SWEEP,
+};
+
+/// An instance's settings and what it measured, as sent back from its
+/// process.
+struct sim_batch_msg {
+  struct sim_config cfg;
+  struct sim_result res;
+};
+
+/// Worst value of a measurement over a batch, and where it was seen.
+struct sim_worst {
+  double value;
+  struct sim_config cfg;
+  uint8_t seen;
+};
+
+/// Worst cases over a batch.
+struct sim_batch_worst {
+  /// INT0 entry latency, in cycles.
+  struct sim_worst int0;
+  /// Bit cell error of a command, as the keyboard timed it, in us.
+  struct sim_worst adb_cell;
+  /// Bit cell error of a response, as the firmware timed it, in us.
+  struct sim_worst fw_cell;
+  /// Stack below RAMEND on entry at each nesting level, in bytes.
+  struct sim_worst stack[STATS_ISR_LEVELS];
+  /// Stack below RAMEND at any time, in bytes.
+  struct sim_worst stack_any;
+  /// USB packets lost: timeouts, bad and repeated packets.
+  struct sim_worst usb_lost;
+  /// Key latency, in ms.
+  struct sim_worst key;
+};
+
+/// The firmware's counters summed over a batch, which would overflow
+/// its own 16 bit ones.
+struct sim_batch_firmware {
+  uint64_t adb_recover;
+  uint64_t frame_malformed;
+  uint64_t frame_recovered;
+  uint64_t frame_lost;
+  uint64_t kb_reports;
+  uint64_t kb_unplug;
+  uint64_t soak_passes;
+  uint64_t soak_us;
+  uint64_t duty[2];
+  uint16_t loop_max_us;
+};
+
+avr_t *sim_avr;
+struct sim_config sim_cfg = {
+  .seconds = 10.0,
+  .seed = 1,
+  .clock_ppm = 0.0,
+  .adb_skew = 0.0,
+  .adb_tlt_us = 200.0,
+  .adb_jitter_us = 0.0,
+  .type_ms = 150.0,
+  .usb_phase_us = 0.0,
+  .soak_lfsr = 0,
+};
+struct sim_result sim_res;
+
+/// State of the random number generator, never 0.
+static uint64_t sim_rand_state;
+/// Cycle INT0 was last raised at.
+static uint64_t sim_int0_pending;
+
+uint64_t sim_rand(void)
+{
+  sim_rand_state ^= sim_rand_state << 13;
+  sim_rand_state ^= sim_rand_state >> 7;
+  sim_rand_state ^= sim_rand_state << 17;
+
+  return sim_rand_state;
+}
+
+double sim_unit(void)
+{
+  return (double)(sim_rand() >> 11) / (double)(1ULL << 53);
+}
+
+/**
+   Convert real time to cycles. The processor's crystal is off by
+   clock_ppm, the models' time is not.
+
+   @param[in] us Time in us.
+   @return Cycles of the simulated processor.
+*/
+uint64_t sim_us(double us)
+{
+  return us * (SIM_F_CPU / 1e6) * (1.0 + sim_cfg.clock_ppm / 1e6) + 0.5;
+}
+
+double sim_cycles_us(uint64_t cycles)
+{
+  return cycles / ((SIM_F_CPU / 1e6) * (1.0 + sim_cfg.clock_ppm / 1e6));
+}
+
+void sim_hist_init(struct sim_hist *h, double width)
+{
+  memset(h, 0, sizeof(*h));
+  h->width = width;
+  h->min = 1e300;
+}
+
+void sim_hist_add(struct sim_hist *h, double v)
+{
+  uint32_t b = v / h->width;
+
+  if (b >= 256) {
+    b = 255;
+  }
+  h->bucket[b]++;
+  h->count++;
+  h->sum += v;
+  if (v > h->max) {
+    h->max = v;
+  }
+  if (v < h->min) {
+    h->min = v;
+  }
+}
+
+/**
+   Percentile of a histogram, to the upper edge of its bucket.
+
+   @param[in] h   Histogram.
+   @param[in] pct Percentile, 0 to 100.
+   @return Value pct percent of the samples are at or below.
+*/
+double sim_hist_pct(const struct sim_hist *h, double pct)
+{
+  uint64_t want = h->count * pct / 100.0;
+  uint64_t seen = 0;
+  int b;
+
+  for (b = 0; b < 256; b++) {
+    seen += h->bucket[b];
+    if (seen > want) {
+      break;
+    }
+  }
+  if (b == 256) {
+    return h->max;
+  }
+
+  return (b + 1) * h->width < h->max ? (b + 1) * h->width : h->max;
+}
+
+/// INT0 was raised, by a D+ edge from the host.
+static void sim_int0_raised(avr_irq_t *irq, uint32_t value, void *param)
+{
+  if (value) {
+    sim_int0_pending = sim_avr->cycle;
+  }
+}
+
+/// V-USB's INT0 handler was entered.
+static void sim_int0_entered(avr_irq_t *irq, uint32_t value, void *param)
+{
+  if (value) {
+    sim_hist_add(&sim_res.int0, sim_avr->cycle - sim_int0_pending);
+  }
+}
+
+/// Seed the firmware's SOAK_JITTER sequence, once main() has begun.
+static avr_cycle_count_t sim_seed_soak(avr_t *avr, avr_cycle_count_t when,
+                                       void *param)
+{
+  elfsym_write("sched_soak_lfsr", &sim_cfg.soak_lfsr,
+               sizeof(sim_cfg.soak_lfsr));
+
+  return 0;
+}
+
+/// Copy the firmware's measurements into sim_res.
+static void sim_read_firmware(void)
+{
+  elfsym_read("stats_count", &sim_res.fw_count, sizeof(sim_res.fw_count));
+  elfsym_read("stats_isr", &sim_res.fw_isr, sizeof(sim_res.fw_isr));
+  elfsym_read("stats_duty", sim_res.fw_duty, sizeof(sim_res.fw_duty));
+  elfsym_read("sched_stats", &sim_res.fw_sched, sizeof(sim_res.fw_sched));
+}
+
+/**
+   Run main.elf for sim_cfg.seconds with the models attached.
+
+   @param[in] elf Path to main.elf.
+   @return 0 on success, -1 if it could not be loaded.
+*/
+static int sim_run(const char *elf)
+{
+  elf_firmware_t fw;
+  uint64_t end;
+  uint64_t start;
+  uint8_t sleeping;
+  uint8_t ports[4] = { 0, 0, 0, 0 };
+  uint16_t sp;
+  int state;
+
+  memset(&sim_res, 0, sizeof(sim_res));
+  sim_hist_init(&sim_res.int0, 1.0);
+  sim_hist_init(&sim_res.key, 0.5);
+  sim_res.sp_min = 0xffff;
+  sim_rand_state = (sim_cfg.seed * 0x9e3779b97f4a7c15ULL) | 1;
+
+  memset(&fw, 0, sizeof(fw));
+  if (elf_read_firmware(elf, &fw) || elfsym_load(elf)) {
+    fprintf(stderr, "adbsim: cannot read %s\n", elf);
+    return -1;
+  }
+  sim_avr = avr_make_mcu_by_name("atmega32");
+  if (!sim_avr) {
+    fprintf(stderr, "adbsim: simavr has no atmega32\n");
+    return -1;
+  }
+  avr_init(sim_avr);
+  fw.frequency = SIM_F_CPU;
+  avr_load_firmware(sim_avr, &fw);
+
+  avr_irq_register_notify(avr_get_interrupt_irq(sim_avr, SIM_VECT_INT0) +
+                          AVR_INT_IRQ_PENDING, sim_int0_raised, NULL);
+  avr_irq_register_notify(avr_get_interrupt_irq(sim_avr, SIM_VECT_INT0) +
+                          AVR_INT_IRQ_RUNNING, sim_int0_entered, NULL);
+  kbd_init();
+  usbhost_init();
+  if (sim_cfg.soak_lfsr) {
+    avr_cycle_timer_register(sim_avr, sim_us(100.0), sim_seed_soak, NULL);
+  }
+
+  end = sim_us(sim_cfg.seconds * 1e6);
+  do {
+    start = sim_avr->cycle;
+    sleeping = sim_avr->state == cpu_Sleeping;
+    state = avr_run(sim_avr);
+    if (sleeping) {
+      sim_res.sleep_cycles += sim_avr->cycle - start;
+    }
+
+    // Only the ports the models listen to.
+    if ((sim_avr->data[SIM_DDRB] != ports[0]) ||
+        (sim_avr->data[SIM_PORTB] != ports[1])) {
+      ports[0] = sim_avr->data[SIM_DDRB];
+      ports[1] = sim_avr->data[SIM_PORTB];
+      kbd_watch();
+    }
+    if ((sim_avr->data[SIM_DDRD] != ports[2]) ||
+        (sim_avr->data[SIM_PORTD] != ports[3])) {
+      ports[2] = sim_avr->data[SIM_DDRD];
+      ports[3] = sim_avr->data[SIM_PORTD];
+      usbhost_watch();
+    }
+
+    // SP is 0 until the startup code sets it.
+    sp = sim_avr->data[SIM_SPL] | (sim_avr->data[SIM_SPH] << 8);
+    if ((sp >= 0x60) && (sp < sim_res.sp_min)) {
+      sim_res.sp_min = sp;
+    }
+  } while ((state != cpu_Done) && (state != cpu_Crashed) &&
+           (sim_avr->cycle < end));
+
+  sim_res.crashed = state == cpu_Crashed;
+  sim_res.cycles = sim_avr->cycle;
+  kbd_finish();
+  sim_read_firmware();
+  avr_terminate(sim_avr);
+
+  return 0;
+}
+
+/// Print the settings of a run, as options.
+static void sim_print_config(const struct sim_config *cfg)
+{
+  printf("-t %g -seed %llu -ppm %.0f -skew %.1f -tlt %.0f -jitter %.1f "
+         "-type %.0f -phase %.0f -lfsr %u", cfg->seconds,
+         (unsigned long long)cfg->seed, cfg->clock_ppm, 100.0 * cfg->adb_skew,
+         cfg->adb_tlt_us, cfg->adb_jitter_us, cfg->type_ms,
+         cfg->usb_phase_us, cfg->soak_lfsr);
+}
+
+/**
+   Stack use for a lowest stack pointer.
+
+   @param[in] sp Stack pointer, 0xffff or 0 if it was never recorded.
+   @return Bytes below RAMEND, 0 if never recorded.
+*/
+static int sim_stack(uint16_t sp)
+{
+  return (sp == 0xffff) || !sp ? 0 : SIM_RAMEND - sp;
+}
+
+/// Print what the models measured.
+static void sim_report(const struct sim_result *r)
+{
+  uint8_t i;
+
+  printf("duty:  awake %.2f%% of cycles\n",
+         r->cycles ? 100.0 * (r->cycles - r->sleep_cycles) / r->cycles : 0.0);
+  printf("key:   %llu events, latency min %.1f mean %.1f p50 %.1f "
+         "p99 %.1f max %.1f ms, %llu lost\n",
+         (unsigned long long)r->key.count, r->key.count ? r->key.min : 0.0,
+         r->key.count ? r->key.sum / r->key.count : 0.0,
+         sim_hist_pct(&r->key, 50), sim_hist_pct(&r->key, 99), r->key.max,
+         (unsigned long long)r->key_lost);
+  printf("int0:  %llu entries, latency mean %.1f p99 %.0f max %.0f cycles\n",
+         (unsigned long long)r->int0.count,
+         r->int0.count ? r->int0.sum / r->int0.count : 0.0,
+         sim_hist_pct(&r->int0, 99), r->int0.max);
+  printf("adb:   %llu commands, %llu responses, command cell error "
+         "max %.1fus, firmware cell error max %.1fus\n",
+         (unsigned long long)r->adb_commands,
+         (unsigned long long)r->adb_responses, r->adb_cell_err,
+         r->fw_isr.cell_err_max / 2.0);
+  for (i = 0; i < 2; i++) {
+    printf("usb:   EP%d %llu IN, %llu DATA, %llu NAK\n", i ? 3 : 1,
+           (unsigned long long)r->usb_in[i],
+           (unsigned long long)r->usb_data[i],
+           (unsigned long long)r->usb_nak[i]);
+  }
+  printf("usb:   %llu timeouts, %llu bad packets, %llu repeated DATA\n",
+         (unsigned long long)r->usb_timeout, (unsigned long long)r->usb_bad,
+         (unsigned long long)r->usb_dup);
+  printf("stack: %d bytes at most, ISR depth %d, on entry at each level",
+         sim_stack(r->sp_min), r->fw_isr.depth_max);
+  for (i = 0; i < STATS_ISR_LEVELS; i++) {
+    printf(" %d", sim_stack(r->fw_isr.sp_min[i]));
+  }
+  printf(" bytes\n");
+}
+
+/// Print what the firmware measured of itself.
+static void sim_report_firmware(const struct sim_result *r)
+{
+  uint32_t total = r->fw_duty[0] + r->fw_duty[1];
+
+  printf("firmware: awake %.2f%%, %u recovered, %u malformed, %u lost, "
+         "%u kb reports, %u unplugs, main loop max %uus, soak %u passes "
+         "%.1fms\n", total ? 100.0 * r->fw_duty[0] / total : 0.0,
+         r->fw_count.adb_recover, r->fw_count.frame_malformed,
+         r->fw_count.frame_lost, r->fw_count.kb_reports,
+         r->fw_count.kb_unplug, r->fw_sched.loop_max_us,
+         r->fw_sched.soak_passes, r->fw_sched.soak_us / 1000.0);
+}
+
+/// Non-zero if a run crashed or lost something.
+static int sim_failed(const struct sim_result *r)
+{
+  return r->crashed || r->key_lost || r->usb_timeout || r->usb_bad ||
+    r->usb_dup;
+}
+
+/// Add one histogram to another with the same bucket width.
+static void sim_hist_merge(struct sim_hist *to, const struct sim_hist *h)
+{
+  int b;
+
+  to->count += h->count;
+  to->sum += h->sum;
+  if (h->max > to->max) {
+    to->max = h->max;
+  }
+  if (h->min < to->min) {
+    to->min = h->min;
+  }
+  for (b = 0; b < 256; b++) {
+    to->bucket[b] += h->bucket[b];
+  }
+}
+
+/// Add a soak instance's result to the totals.
+static void sim_merge(struct sim_result *to, const struct sim_result *r)
+{
+  uint8_t i;
+
+  to->cycles += r->cycles;
+  to->sleep_cycles += r->sleep_cycles;
+  sim_hist_merge(&to->int0, &r->int0);
+  sim_hist_merge(&to->key, &r->key);
+  to->key_lost += r->key_lost;
+  to->adb_commands += r->adb_commands;
+  to->adb_responses += r->adb_responses;
+  if (r->adb_cell_err > to->adb_cell_err) {
+    to->adb_cell_err = r->adb_cell_err;
+  }
+  to->usb_in[0] += r->usb_in[0];
+  to->usb_in[1] += r->usb_in[1];
+  to->usb_data[0] += r->usb_data[0];
+  to->usb_data[1] += r->usb_data[1];
+  to->usb_nak[0] += r->usb_nak[0];
+  to->usb_nak[1] += r->usb_nak[1];
+  to->usb_timeout += r->usb_timeout;
+  to->usb_bad += r->usb_bad;
+  to->usb_dup += r->usb_dup;
+  if (r->sp_min < to->sp_min) {
+    to->sp_min = r->sp_min;
+  }
+  if (r->fw_isr.depth_max > to->fw_isr.depth_max) {
+    to->fw_isr.depth_max = r->fw_isr.depth_max;
+  }
+  if (r->fw_isr.cell_err_max > to->fw_isr.cell_err_max) {
+    to->fw_isr.cell_err_max = r->fw_isr.cell_err_max;
+  }
+  for (i = 0; i < STATS_ISR_LEVELS; i++) {
+    if (r->fw_isr.sp_min[i] < to->fw_isr.sp_min[i]) {
+      to->fw_isr.sp_min[i] = r->fw_isr.sp_min[i];
+    }
+  }
+}
+
+/**
+   Make up the settings of a soak instance from its seed: a crystal
+   within SIM_SOAK_PPM, a keyboard with its own bit cell, response time
+   and edge jitter, a typist, a USB phase and a SOAK_JITTER sequence.
+
+   @param[in] seed Instance seed.
+*/
+static void sim_soak_config(uint64_t seed)
+{
+  sim_rand_state = (seed * 0xbf58476d1ce4e5b9ULL) | 1;
+  sim_cfg.seed = seed;
+  sim_cfg.clock_ppm = SIM_SOAK_PPM * (2.0 * sim_unit() - 1.0);
+  sim_cfg.adb_skew = SIM_SOAK_SKEW * (2.0 * sim_unit() - 1.0);
+  sim_cfg.adb_tlt_us = 160.0 + 80.0 * sim_unit();
+  sim_cfg.adb_jitter_us = SIM_SOAK_JITTER_US * sim_unit();
+  sim_cfg.type_ms = 40.0 + 260.0 * sim_unit();
+  sim_cfg.usb_phase_us = (double)(sim_rand() % SIM_SWEEP_US);
+  sim_cfg.soak_lfsr = 1 + sim_rand() % 0xffff;
+}
+
+/**
+   Settings of one point of a sweep. Point n has the n'th of steps USB
+   phases, for each keyboard response time in turn.
+
+   @param[in] n     Point.
+   @param[in] steps Phases per response time.
+*/
+static void sim_sweep_config(unsigned long n, unsigned long steps)
+{
+  sim_cfg.usb_phase_us = (double)((n % steps) * SIM_SWEEP_US / steps);
+  sim_cfg.adb_tlt_us = 160.0 + (n / steps) * 80.0 / (SIM_SWEEP_TLT - 1);
+}
+
+/// Keep the worst of a measurement.
+static void sim_worst(struct sim_worst *w, double value,
+                      const struct sim_config *cfg)
+{
+  if (!w->seen || (value > w->value)) {
+    w->value = value;
+    w->cfg = *cfg;
+    w->seen = 1;
+  }
+}
+
+/// Print a worst case and how to repeat it.
+static void sim_print_worst(const char *what, const struct sim_worst *w,
+                            const char *unit, const char *elf)
+{
+  printf("worst: %s %.1f%s: adbsim ", what, w->value, unit);
+  sim_print_config(&w->cfg);
+  printf(" %s\n", elf);
+}
+
+/**
+   Run a batch of instances in child processes, and print the totals
+   and the worst cases.
+
+   @param[in] elf       Path to main.elf.
+   @param[in] batch     SIM_SOAK or SIM_SWEEP.
+   @param[in] instances Instances to run.
+   @param[in] jobs      Instances to run at once.
+   @return Number of instances that failed.
+*/
+static unsigned long sim_batch(const char *elf, enum sim_batches batch,
+                               unsigned long instances, unsigned jobs)
+{
+  struct sim_batch_msg msg;
+  struct sim_result total;
+  struct sim_batch_firmware fw;
+  struct sim_batch_worst worst;
+  struct sim_config base = sim_cfg;
+  pid_t *pids = calloc(jobs, sizeof(*pids));
+  int *fds = calloc(jobs, sizeof(*fds));
+  struct sim_config *cfgs = calloc(jobs, sizeof(*cfgs));
+  unsigned long steps = instances;
+  unsigned long started = 0;
+  unsigned long done = 0;
+  unsigned long failed = 0;
+  unsigned slot;
+  uint8_t level;
+  char what[32];
+  ssize_t got;
+  ssize_t n;
+  pid_t pid;
+  int fd[2];
+
+  if (batch == SIM_SWEEP) {
+    instances *= SIM_SWEEP_TLT;
+  }
+  memset(&total, 0, sizeof(total));
+  memset(&fw, 0, sizeof(fw));
+  memset(&worst, 0, sizeof(worst));
+  sim_hist_init(&total.int0, 1.0);
+  sim_hist_init(&total.key, 0.5);
+  total.sp_min = 0xffff;
+  memset(total.fw_isr.sp_min, 0xff, sizeof(total.fw_isr.sp_min));
+
+  while (done < instances) {
+    for (slot = 0; (slot < jobs) && (started < instances); slot++) {
+      if (pids[slot]) {
+        continue;
+      }
+      sim_cfg = base;
+      if (batch == SIM_SOAK) {
+        sim_soak_config(base.seed + started);
+      } else {
+        sim_sweep_config(started, steps);
+      }
+      if (pipe(fd)) {
+        perror("adbsim: pipe");
+        exit(1);
+      }
+      // Or the child flushes what the parent has not printed yet.
+      fflush(stdout);
+      pid = fork();
+      if (pid < 0) {
+        perror("adbsim: fork");
+        exit(1);
+      }
+      if (pid == 0) {
+        // The firmware's UART output would only get in the way.
+        close(fd[0]);
+        if (!freopen("/dev/null", "w", stdout)) {
+          _exit(1);
+        }
+        msg.cfg = sim_cfg;
+        if (sim_run(elf)) {
+          _exit(1);
+        }
+        msg.res = sim_res;
+        if (write(fd[1], &msg, sizeof(msg)) != sizeof(msg)) {
+          _exit(1);
+        }
+        _exit(0);
+      }
+      close(fd[1]);
+      pids[slot] = pid;
+      fds[slot] = fd[0];
+      cfgs[slot] = sim_cfg;
+      started++;
+    }
+
+    pid = wait(NULL);
+    slot = 0;
+    while ((slot < jobs) && (pids[slot] != pid)) {
+      slot++;
+    }
+    if (slot == jobs) {
+      continue;
+    }
+
+    got = 0;
+    while ((got < (ssize_t)sizeof(msg)) &&
+           ((n = read(fds[slot], (char *)&msg + got, sizeof(msg) - got)) > 0)) {
+      got += n;
+    }
+    close(fds[slot]);
+    pids[slot] = 0;
+    done++;
+    if (got != sizeof(msg)) {
+      // The instance died without a word, count it as a crash.
+      memset(&msg.res, 0, sizeof(msg.res));
+      msg.cfg = cfgs[slot];
+      msg.res.crashed = 1;
+      msg.res.sp_min = 0xffff;
+      memset(msg.res.fw_isr.sp_min, 0xff, sizeof(msg.res.fw_isr.sp_min));
+    }
+
+    sim_merge(&total, &msg.res);
+    fw.adb_recover += msg.res.fw_count.adb_recover;
+    fw.frame_malformed += msg.res.fw_count.frame_malformed;
+    fw.frame_recovered += msg.res.fw_count.frame_recovered;
+    fw.frame_lost += msg.res.fw_count.frame_lost;
+    fw.kb_reports += msg.res.fw_count.kb_reports;
+    fw.kb_unplug += msg.res.fw_count.kb_unplug;
+    fw.soak_passes += msg.res.fw_sched.soak_passes;
+    fw.soak_us += msg.res.fw_sched.soak_us;
+    fw.duty[0] += msg.res.fw_duty[0];
+    fw.duty[1] += msg.res.fw_duty[1];
+    if (msg.res.fw_sched.loop_max_us > fw.loop_max_us) {
+      fw.loop_max_us = msg.res.fw_sched.loop_max_us;
+    }
+
+    sim_worst(&worst.int0, msg.res.int0.max, &msg.cfg);
+    sim_worst(&worst.adb_cell, msg.res.adb_cell_err, &msg.cfg);
+    sim_worst(&worst.fw_cell, msg.res.fw_isr.cell_err_max / 2.0, &msg.cfg);
+    for (level = 0; level < STATS_ISR_LEVELS; level++) {
+      sim_worst(&worst.stack[level], sim_stack(msg.res.fw_isr.sp_min[level]),
+                &msg.cfg);
+    }
+    sim_worst(&worst.stack_any, sim_stack(msg.res.sp_min), &msg.cfg);
+    sim_worst(&worst.usb_lost, msg.res.usb_timeout + msg.res.usb_bad +
+              msg.res.usb_dup, &msg.cfg);
+    sim_worst(&worst.key, msg.res.key.max, &msg.cfg);
+
+    if (sim_failed(&msg.res) && (failed++ < SIM_BATCH_SHOW)) {
+      printf("failed:%s%s%s%s%s: ", msg.res.crashed ? " crashed" : "",
+             msg.res.key_lost ? " lost keys" : "",
+             msg.res.usb_timeout ? " USB timeouts" : "",
+             msg.res.usb_bad ? " bad packets" : "",
+             msg.res.usb_dup ? " repeated DATA" : "");
+      if (batch == SIM_SOAK) {
+        printf("adbsim -t %g -soak 1 -seed %llu %s (", base.seconds,
+               (unsigned long long)msg.cfg.seed, elf);
+        sim_print_config(&msg.cfg);
+        printf(")\n");
+      } else {
+        printf("adbsim ");
+        sim_print_config(&msg.cfg);
+        printf(" %s\n", elf);
+      }
+    }
+  }
+
+  printf("adbsim: %lu instances of %.1fs, %lu failed\n", instances,
+         base.seconds, failed);
+  sim_report(&total);
+  printf("firmware: awake %.2f%%, %llu recovered, %llu malformed of which "
+         "%llu recovered and %llu lost, %llu kb reports, %llu unplugs, "
+         "main loop max %uus, soak %llu passes %.1fms\n",
+         fw.duty[0] + fw.duty[1] ?
+         100.0 * fw.duty[0] / (fw.duty[0] + fw.duty[1]) : 0.0,
+         (unsigned long long)fw.adb_recover,
+         (unsigned long long)fw.frame_malformed,
+         (unsigned long long)fw.frame_recovered,
+         (unsigned long long)fw.frame_lost,
+         (unsigned long long)fw.kb_reports, (unsigned long long)fw.kb_unplug,
+         fw.loop_max_us, (unsigned long long)fw.soak_passes,
+         fw.soak_us / 1000.0);
+
+  sim_print_worst("INT0 latency", &worst.int0, " cycles", elf);
+  sim_print_worst("command cell error", &worst.adb_cell, "us", elf);
+  sim_print_worst("response cell error", &worst.fw_cell, "us", elf);
+  for (level = 0; level < STATS_ISR_LEVELS; level++) {
+    if (worst.stack[level].value > 0) {
+      snprintf(what, sizeof(what), "stack at ISR level %d%s", level + 1,
+               level + 1 == STATS_ISR_LEVELS ? " or deeper" : "");
+      sim_print_worst(what, &worst.stack[level], " bytes", elf);
+    }
+  }
+  sim_print_worst("stack", &worst.stack_any, " bytes", elf);
+  sim_print_worst("USB packets lost", &worst.usb_lost, "", elf);
+  sim_print_worst("key latency", &worst.key, "ms", elf);
+
+  free(pids);
+  free(fds);
+  free(cfgs);
+
+  return failed;
+}
+
+int main(int argc, char **argv)
+{
+  enum sim_batches batch = SIM_SOAK;
+  unsigned long instances = 0;
+  unsigned jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int arg;
+
+  for (arg = 1; arg + 1 < argc; arg += 2) {
+    if (strcmp(argv[arg], "-t") == 0) {
+      sim_cfg.seconds = atof(argv[arg + 1]);
+    } else if (strcmp(argv[arg], "-seed") == 0) {
+      sim_cfg.seed = strtoull(argv[arg + 1], NULL, 0);
+    } else if (strcmp(argv[arg], "-ppm") == 0) {
+      sim_cfg.clock_ppm = atof(argv[arg + 1]);
+    } else if (strcmp(argv[arg], "-skew") == 0) {
+      sim_cfg.adb_skew = atof(argv[arg + 1]) / 100.0;
+    } else if (strcmp(argv[arg], "-tlt") == 0) {
+      sim_cfg.adb_tlt_us = atof(argv[arg + 1]);
+    } else if (strcmp(argv[arg], "-jitter") == 0) {
+      sim_cfg.adb_jitter_us = atof(argv[arg + 1]);
+    } else if (strcmp(argv[arg], "-type") == 0) {
+      sim_cfg.type_ms = atof(argv[arg + 1]);
+    } else if (strcmp(argv[arg], "-phase") == 0) {
+      sim_cfg.usb_phase_us = atof(argv[arg + 1]);
+    } else if (strcmp(argv[arg], "-lfsr") == 0) {
+      sim_cfg.soak_lfsr = strtoul(argv[arg + 1], NULL, 0);
+    } else if (strcmp(argv[arg], "-soak") == 0) {
+      batch = SIM_SOAK;
+      instances = strtoul(argv[arg + 1], NULL, 0);
+    } else if (strcmp(argv[arg], "-sweep") == 0) {
+      batch = SIM_SWEEP;
+      instances = strtoul(argv[arg + 1], NULL, 0);
+    } else if (strcmp(argv[arg], "-j") == 0) {
+      jobs = strtoul(argv[arg + 1], NULL, 0);
+    } else {
+      break;
+    }
+  }
+  if ((arg + 1 != argc) || !jobs) {
+    fprintf(stderr, "usage: %s [-t seconds] [-seed N] [-ppm N] "
+            "[-skew percent] [-tlt us] [-jitter us] [-type ms] [-phase us] "
+            "[-lfsr N] [-soak instances | -sweep steps] [-j jobs] "
+            "main.elf\n", argv[0]);
+    return 1;
+  }
+
+  if (instances) {
+    return sim_batch(argv[arg], batch, instances, jobs) ? 1 : 0;
+  }
+
+  if (sim_run(argv[arg])) {
+    return 1;
+  }
+  printf("adbsim: %.1fs%s, ", sim_cycles_us(sim_res.cycles) / 1e6,
+         sim_res.crashed ? ", CRASHED" : "");
+  sim_print_config(&sim_cfg);
+  printf("\n");
+  sim_report(&sim_res);
+  sim_report_firmware(&sim_res);
+
+  return sim_failed(&sim_res) ? 1 : 0;
+}
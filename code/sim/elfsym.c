@@ -0,0 +1,159 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+/** \file sim/elfsym.c
+    \brief Reads firmware variables by name.
+
+    simavr loads main.elf but keeps no symbols, so the symbol table is
+    read again here with libelf. A variable's value is read straight
+    out of the simulated RAM.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <gelf.h>
+
+#include "sim.h"
+
+/// avr-gcc puts RAM at this offset in the ELF address space.
+#define ELFSYM_RAM 0x800000
+
+/// A data symbol.
+struct elfsym {
+  char *name;
+  uint16_t addr;
+  uint16_t size;
+};
+
+/// Data symbols of the loaded firmware.
+static struct elfsym *elfsym_table;
+/// Number of entries in elfsym_table.
+static size_t elfsym_count;
+
+/**
+   Read the data symbols of an ELF file.
+
+   @param[in] path Path to main.elf.
+   @return 0 on success, -1 on failure.
+*/
+int elfsym_load(const char *path)
+{
+  Elf *elf;
+  Elf_Scn *scn = NULL;
+  Elf_Data *data;
+  GElf_Shdr shdr;
+  GElf_Sym sym;
+  size_t i;
+  int fd;
+
+  if (elf_version(EV_CURRENT) == EV_NONE) {
+    return -1;
+  }
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  elf = elf_begin(fd, ELF_C_READ, NULL);
+  if (!elf) {
+    close(fd);
+    return -1;
+  }
+
+  while ((scn = elf_nextscn(elf, scn)) != NULL) {
+    if (!gelf_getshdr(scn, &shdr) || (shdr.sh_type != SHT_SYMTAB)) {
+      continue;
+    }
+    data = elf_getdata(scn, NULL);
+    for (i = 0; data && (i < shdr.sh_size / shdr.sh_entsize); i++) {
+      gelf_getsym(data, i, &sym);
+      if ((GELF_ST_TYPE(sym.st_info) != STT_OBJECT) ||
+          (sym.st_value < ELFSYM_RAM)) {
+        continue;
+      }
+      elfsym_table = realloc(elfsym_table,
+                             (elfsym_count + 1) * sizeof(*elfsym_table));
+      elfsym_table[elfsym_count].name =
+        strdup(elf_strptr(elf, shdr.sh_link, sym.st_name));
+      elfsym_table[elfsym_count].addr = sym.st_value - ELFSYM_RAM;
+      elfsym_table[elfsym_count].size = sym.st_size;
+      elfsym_count++;
+    }
+  }
+
+  elf_end(elf);
+  close(fd);
+
+  return 0;
+}
+
+/// Look a variable up, NULL if there is none.
+static const struct elfsym *elfsym_find(const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < elfsym_count; i++) {
+    if (strcmp(elfsym_table[i].name, name) == 0) {
+      return &elfsym_table[i];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+   Read a firmware variable.
+
+   @param[in]  name Symbol name.
+   @param[out] buf  Value, zeroed if the symbol is missing.
+   @param[in]  size Bytes to read, at most the symbol's size.
+   @return 0 on success, -1 if there is no such variable.
+*/
+int elfsym_read(const char *name, void *buf, uint16_t size)
+{
+  const struct elfsym *sym = elfsym_find(name);
+
+  memset(buf, 0, size);
+  if (!sym) {
+    return -1;
+  }
+  memcpy(buf, sim_avr->data + sym->addr, size < sym->size ? size : sym->size);
+
+  return 0;
+}
+
+/**
+   Write a firmware variable. Initialized variables are copied from
+   flash by the startup code, so this only sticks after main() began.
+
+   @param[in] name Symbol name.
+   @param[in] buf  Value.
+   @param[in] size Bytes to write, at most the symbol's size.
+   @return 0 on success, -1 if there is no such variable.
+*/
+int elfsym_write(const char *name, const void *buf, uint16_t size)
+{
+  const struct elfsym *sym = elfsym_find(name);
+
+  if (!sym) {
+    return -1;
+  }
+  memcpy(sim_avr->data + sym->addr, buf, size < sym->size ? size : sym->size);
+
+  return 0;
+}
@@ -0,0 +1,376 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+/** \file sim/kbd.c
+    \brief ADB keyboard model.
+
+    Types printable keys from keymap.def at random, each held for 40 to
+    140ms, one every 0.5 to 1.5 times sim_cfg.type_ms. Key changes
+    queue up as ADB keycodes, like in a real keyboard's buffer, until
+    the firmware asks for them with Talk register 0.
+
+    Commands are read off the line the way a device does: an attention
+    signal of 560us or more, then eight bits, a 1 if its low phase is
+    shorter than 50us, then the stop bit. A low of 2.8ms or more is a
+    reset. Responses start sim_cfg.adb_tlt_us after the end of the stop
+    bit, with bit cells of 100us times one plus sim_cfg.adb_skew and
+    low phases of 35% and 65% of the cell, as in the spec. Each bit
+    cell then starts up to sim_cfg.adb_jitter_us late.
+
+    The time each key change is queued is kept until a report on
+    endpoint 1 shows it to the host, see kbd_host_report().
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "sim_avr.h"
+#include "sim_io.h"
+#include "sim_irq.h"
+#include "sim_cycle_timers.h"
+#include "avr_ioport.h"
+
+#include "sim.h"
+
+/// ADB address of the keyboard.
+#define KBD_ADDR 2
+/// Longest a key is shown to the host after the end of the run and
+/// still counts as in flight rather than lost, in ms.
+#define KBD_INFLIGHT_MS 100
+/// Keycodes the keyboard buffers.
+#define KBD_QUEUE 16
+/// Key changes waiting for the host.
+#define KBD_PENDING 64
+/// Most edges in a response: start bit, two bytes, stop bit.
+#define KBD_EDGES (2 * (1 + 16 + 1))
+
+/// A key from keymap.def.
+struct kbd_key {
+  uint8_t adb;
+  uint8_t usb;
+  char ascii;
+};
+
+/// Every key. Only printable ones are typed, the rest could be Fn or
+/// macro keys.
+static const struct kbd_key kbd_keys[] = {
+#define KEY(adb, usb, ascii) { adb, usb, ascii },
+#define MOD(adb, bit)
+#include "keymap.def"
+#undef KEY
+#undef MOD
+};
+
+/// Number of entries in kbd_keys.
+#define KBD_KEYS (sizeof(kbd_keys) / sizeof(kbd_keys[0]))
+
+/// A key change on its way to the host.
+struct kbd_change {
+  uint8_t usb;
+  uint8_t press;
+  uint64_t cycle;
+};
+
+/// Command decoder states.
+enum kbd_states {
+  KBD_IDLE = 0,
+  KBD_SYNC,
+  KBD_BITS,
+  KBD_TALKING,
+};
+
+static enum kbd_states kbd_state;
+/// Line level the firmware drives.
+static uint8_t kbd_host_level = 1;
+/// Cycle of the last falling edge.
+static uint64_t kbd_fall;
+/// Command bits read so far, and the command.
+static uint8_t kbd_bits;
+static uint8_t kbd_cmd;
+/// The keyboard's buffer.
+static uint8_t kbd_queue[KBD_QUEUE];
+static uint8_t kbd_queued;
+/// Keys held, by index into kbd_keys.
+static uint8_t kbd_held[KBD_KEYS];
+/// Key changes not yet seen by the host, oldest first.
+static struct kbd_change kbd_pending[KBD_PENDING];
+static uint8_t kbd_pending_count;
+/// Response being sent: edges and the cycles between them.
+static uint8_t kbd_edge_level[KBD_EDGES];
+static uint64_t kbd_edge_delay[KBD_EDGES];
+static uint8_t kbd_edges;
+static uint8_t kbd_edge;
+/// The PB2 pin.
+static avr_irq_t *kbd_pin;
+
+/// Drive the line from the keyboard's side.
+static void kbd_drive(uint8_t level)
+{
+  avr_raise_irq(kbd_pin, level);
+}
+
+/// Queue a key change.
+static void kbd_change(uint8_t key, uint8_t press)
+{
+  if (kbd_queued < KBD_QUEUE) {
+    kbd_queue[kbd_queued++] = kbd_keys[key].adb | (press ? 0 : 0x80);
+  }
+  if (kbd_pending_count < KBD_PENDING) {
+    kbd_pending[kbd_pending_count].usb = kbd_keys[key].usb;
+    kbd_pending[kbd_pending_count].press = press;
+    kbd_pending[kbd_pending_count].cycle = sim_avr->cycle;
+    kbd_pending_count++;
+  } else {
+    sim_res.key_lost++;
+  }
+  kbd_held[key] = press;
+}
+
+/// Release a key, param is its index plus one.
+static avr_cycle_count_t kbd_release(avr_t *avr, avr_cycle_count_t when,
+                                     void *param)
+{
+  kbd_change((uintptr_t)param - 1, 0);
+
+  return 0;
+}
+
+/// Press a key that is not held, and come back for the next one.
+static avr_cycle_count_t kbd_type(avr_t *avr, avr_cycle_count_t when,
+                                  void *param)
+{
+  uint8_t key = sim_rand() % KBD_KEYS;
+
+  if ((kbd_keys[key].ascii != ' ') && !kbd_held[key]) {
+    kbd_change(key, 1);
+    avr_cycle_timer_register(avr, sim_us(1000.0 * (40 + 100 * sim_unit())),
+                             kbd_release, (void *)(uintptr_t)(key + 1));
+  }
+
+  return when + sim_us(1000.0 * sim_cfg.type_ms * (0.5 + sim_unit()));
+}
+
+/// Step through the response, one edge per call.
+static avr_cycle_count_t kbd_talk(avr_t *avr, avr_cycle_count_t when,
+                                  void *param)
+{
+  kbd_drive(kbd_edge_level[kbd_edge]);
+  kbd_edge++;
+  if (kbd_edge == kbd_edges) {
+    kbd_state = KBD_IDLE;
+    return 0;
+  }
+
+  return when + kbd_edge_delay[kbd_edge];
+}
+
+/**
+   Send a response.
+
+   @param[in] data Two bytes.
+*/
+static void kbd_respond(const uint8_t *data)
+{
+  double cell = 100.0 * (1.0 + sim_cfg.adb_skew);
+  double low;
+  double jitter;
+  double last = 0.0;
+  uint8_t i;
+  uint8_t one;
+
+  kbd_edges = 0;
+  for (i = 0; i < 18; i++) {
+    // Start bit, data, stop bit.
+    one = (i == 0) ||
+      ((i < 17) && ((data[(i - 1) / 8] << ((i - 1) % 8)) & 0x80));
+    low = cell * (one ? 0.35 : 0.65);
+    jitter = sim_cfg.adb_jitter_us * sim_unit();
+    kbd_edge_level[kbd_edges] = 0;
+    kbd_edge_delay[kbd_edges++] =
+      sim_us((i ? cell - low : sim_cfg.adb_tlt_us) + jitter - last);
+    kbd_edge_level[kbd_edges] = 1;
+    kbd_edge_delay[kbd_edges++] = sim_us(low);
+    last = jitter;
+  }
+
+  kbd_state = KBD_TALKING;
+  kbd_edge = 0;
+  sim_res.adb_responses++;
+  avr_cycle_timer_register(sim_avr, kbd_edge_delay[0], kbd_talk, NULL);
+}
+
+/// Act on a command addressed to the keyboard.
+static void kbd_command(uint8_t cmd)
+{
+  uint8_t data[2];
+  uint8_t i;
+
+  sim_res.adb_commands++;
+  if ((cmd >> 4) != KBD_ADDR) {
+    return;
+  }
+  if (((cmd >> 2) & 3) == 3) {
+    switch (cmd & 3) {
+    case 0:
+      if (!kbd_queued) {
+        return;
+      }
+      data[0] = kbd_queue[0];
+      data[1] = kbd_queued > 1 ? kbd_queue[1] : 0xff;
+      i = kbd_queued > 1 ? 2 : 1;
+      memmove(kbd_queue, kbd_queue + i, kbd_queued - i);
+      kbd_queued -= i;
+      break;
+    case 2:
+      // No modifiers down, LEDs off.
+      data[0] = 0xff;
+      data[1] = 0xff;
+      break;
+    case 3:
+      // Address and handler ID of an extended keyboard.
+      data[0] = 0x60 | KBD_ADDR;
+      data[1] = 0x02;
+      break;
+    default:
+      return;
+    }
+    kbd_respond(data);
+  } else if ((cmd & 0x0f) == 1) {
+    kbd_queued = 0;
+  }
+}
+
+/// Follow the line as the firmware drives it.
+void kbd_watch(void)
+{
+  uint8_t ddr = sim_avr->data[SIM_DDRB] & (1 << SIM_ADB_BIT);
+  uint8_t level = !ddr || (sim_avr->data[SIM_PORTB] & (1 << SIM_ADB_BIT));
+  double low;
+  double cell;
+
+  if (level == kbd_host_level) {
+    return;
+  }
+  kbd_host_level = level;
+  if (kbd_state == KBD_TALKING) {
+    return;
+  }
+
+  if (!level) {
+    if (kbd_state == KBD_BITS && kbd_bits) {
+      cell = sim_cycles_us(sim_avr->cycle - kbd_fall);
+      if (cell - 100.0 > sim_res.adb_cell_err) {
+        sim_res.adb_cell_err = cell - 100.0;
+      } else if (100.0 - cell > sim_res.adb_cell_err) {
+        sim_res.adb_cell_err = 100.0 - cell;
+      }
+    } else if (kbd_state == KBD_SYNC) {
+      kbd_state = KBD_BITS;
+      kbd_bits = 0;
+    }
+    kbd_fall = sim_avr->cycle;
+    return;
+  }
+
+  low = sim_cycles_us(sim_avr->cycle - kbd_fall);
+  if (low >= 2800) {
+    kbd_state = KBD_IDLE;
+    kbd_queued = 0;
+  } else if (low >= 560) {
+    kbd_state = KBD_SYNC;
+  } else if (kbd_state == KBD_BITS) {
+    if (kbd_bits < 8) {
+      kbd_cmd = (kbd_cmd << 1) | (low < 50);
+      kbd_bits++;
+    } else {
+      // Stop bit. Listen data that follows is not decoded.
+      kbd_state = KBD_IDLE;
+      kbd_command(kbd_cmd);
+    }
+  }
+}
+
+/**
+   The host got a keyboard report. Every key change it shows, that is
+   the oldest waiting change of each key whose state matches the
+   report, has arrived.
+
+   @param[in] report Report as read from endpoint 1.
+   @param[in] len    Its length.
+*/
+void kbd_host_report(const uint8_t *report, uint8_t len)
+{
+  uint8_t seen[256];
+  uint8_t down;
+  uint8_t i = 0;
+  uint8_t j;
+
+  memset(seen, 0, sizeof(seen));
+  while (i < kbd_pending_count) {
+    struct kbd_change *c = &kbd_pending[i];
+
+    if (seen[c->usb]) {
+      i++;
+      continue;
+    }
+    seen[c->usb] = 1;
+    if (report[0] == 3) {
+      down = (len > 2 + c->usb / 8) &&
+        (report[2 + c->usb / 8] & (1 << (c->usb % 8)));
+    } else {
+      down = 0;
+      for (j = 2; j < len; j++) {
+        down |= report[j] == c->usb;
+      }
+    }
+    if (down == c->press) {
+      sim_hist_add(&sim_res.key, sim_cycles_us(sim_avr->cycle - c->cycle)
+                   / 1000.0);
+      memmove(c, c + 1, (kbd_pending_count - i - 1) * sizeof(*c));
+      kbd_pending_count--;
+    } else {
+      i++;
+    }
+  }
+}
+
+void kbd_init(void)
+{
+  kbd_pin = avr_io_getirq(sim_avr, AVR_IOCTL_IOPORT_GETIRQ('B'),
+                          SIM_ADB_BIT);
+  kbd_state = KBD_IDLE;
+  kbd_host_level = 1;
+  kbd_queued = 0;
+  kbd_pending_count = 0;
+  memset(kbd_held, 0, sizeof(kbd_held));
+  kbd_drive(1);
+
+  // Start typing once the firmware has found the keyboard.
+  avr_cycle_timer_register(sim_avr, sim_us(1e6), kbd_type, NULL);
+}
+
+/// Count key changes the host should have seen by now as lost.
+void kbd_finish(void)
+{
+  uint8_t i;
+
+  for (i = 0; i < kbd_pending_count; i++) {
+    if (sim_cycles_us(sim_avr->cycle - kbd_pending[i].cycle) >
+        KBD_INFLIGHT_MS * 1000.0) {
+      sim_res.key_lost++;
+    }
+  }
+}
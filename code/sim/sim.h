@@ -0,0 +1,161 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+/** \file sim/sim.h
+    \brief Global routines for the simulator harness.
+
+    adbsim runs main.elf in simavr between an ADB keyboard model
+    (kbd.c) and a low speed USB host model (usbhost.c), and reports
+    what a user would notice: how long a key takes to reach the host,
+    how often packets are lost, and how busy the processor is.
+*/
+
+#ifndef __inc_sim__
+#define __inc_sim__
+
+#include <stdint.h>
+
+#include "sim_avr.h"
+
+// The firmware's own measurements, laid out as on the AVR.
+#pragma pack(push, 1)
+#include "stats.h"
+#include "sched.h"
+#pragma pack(pop)
+
+/// ATmega32 data space address of an I/O register.
+#define SIM_IO(addr) ((addr) + 0x20)
+#define SIM_PINB SIM_IO(0x16)
+#define SIM_DDRB SIM_IO(0x17)
+#define SIM_PORTB SIM_IO(0x18)
+#define SIM_PIND SIM_IO(0x10)
+#define SIM_DDRD SIM_IO(0x11)
+#define SIM_PORTD SIM_IO(0x12)
+#define SIM_SPL SIM_IO(0x3d)
+#define SIM_SPH SIM_IO(0x3e)
+
+/// ATmega32 interrupt vector numbers.
+#define SIM_VECT_INT0 1
+#define SIM_VECT_INT2 3
+#define SIM_VECT_TIMER1_COMPA 7
+#define SIM_VECT_TIMER1_COMPB 8
+
+/// ADB line, PB2.
+#define SIM_ADB_BIT 2
+/// USB D+, PD2, and D-, PD4 (see usbconfig.h).
+#define SIM_DPLUS_BIT 2
+#define SIM_DMINUS_BIT 4
+/// D- pull-up switch, PD0.
+#define SIM_PULLUP_BIT 0
+
+/// What to simulate. Every run is a function of this alone.
+struct sim_config {
+  /// Seconds of simulated time.
+  double seconds;
+  /// Seed for everything random in the models.
+  uint64_t seed;
+  /// Processor clock error, in parts per million.
+  double clock_ppm;
+  /// Keyboard bit cell error, as a fraction: 0.1 is 110us cells.
+  double adb_skew;
+  /// Keyboard stop-to-start time, in us.
+  double adb_tlt_us;
+  /// Mean time between keystrokes, in ms.
+  double type_ms;
+  /// Largest random delay of each keyboard edge, in us.
+  double adb_jitter_us;
+  /// Delay of the host's first USB frame after connect, in us. Moves
+  /// the USB polls against the firmware's ADB polls.
+  double usb_phase_us;
+  /// Seed for the firmware's SOAK_JITTER sequence, 0 to leave it.
+  uint16_t soak_lfsr;
+};
+
+/// Latency histogram with fixed-width buckets.
+struct sim_hist {
+  uint64_t count;
+  double sum;
+  double max;
+  double min;
+  /// Bucket width, in the unit of the samples.
+  double width;
+  uint64_t bucket[256];
+};
+
+/// Everything measured in a run.
+struct sim_result {
+  /// Cycles simulated, and of those spent in sleep.
+  uint64_t cycles;
+  uint64_t sleep_cycles;
+  /// INT0 entry latency, in cycles from the D+ edge.
+  struct sim_hist int0;
+  /// Key event at the keyboard to the report at the host, in ms.
+  struct sim_hist key;
+  /// Key events the host never saw.
+  uint64_t key_lost;
+  /// ADB traffic as the keyboard saw it.
+  uint64_t adb_commands;
+  uint64_t adb_responses;
+  /// Largest bit cell error of a command from the firmware, in us.
+  double adb_cell_err;
+  /// USB traffic as the host saw it.
+  uint64_t usb_in[2];
+  uint64_t usb_data[2];
+  uint64_t usb_nak[2];
+  uint64_t usb_timeout;
+  uint64_t usb_bad;
+  uint64_t usb_dup;
+  /// Lowest stack pointer seen.
+  uint16_t sp_min;
+  /// The firmware's counters at the end of the run.
+  struct stats_counters fw_count;
+  struct stats_isr fw_isr;
+  uint32_t fw_duty[2];
+  struct sched_stats fw_sched;
+  /// Non-zero if the simulated processor crashed.
+  uint8_t crashed;
+};
+
+extern avr_t *sim_avr;
+extern struct sim_config sim_cfg;
+extern struct sim_result sim_res;
+
+/// Random number from the run's generator.
+uint64_t sim_rand(void);
+/// Uniform random number from 0 to 1.
+double sim_unit(void);
+/// Convert us to cycles of the simulated clock.
+uint64_t sim_us(double us);
+/// Convert cycles to us.
+double sim_cycles_us(uint64_t cycles);
+
+void sim_hist_init(struct sim_hist *h, double width);
+void sim_hist_add(struct sim_hist *h, double v);
+double sim_hist_pct(const struct sim_hist *h, double pct);
+
+void kbd_init(void);
+void kbd_watch(void);
+void kbd_finish(void);
+void kbd_host_report(const uint8_t *report, uint8_t len);
+
+void usbhost_init(void);
+void usbhost_watch(void);
+
+int elfsym_load(const char *path);
+int elfsym_read(const char *name, void *buf, uint16_t size);
+int elfsym_write(const char *name, const void *buf, uint16_t size);
+
+#endif
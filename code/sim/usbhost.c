@@ -0,0 +1,534 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+/** \file sim/usbhost.c
+    \brief Low speed USB host model.
+
+    Waits for the firmware to switch on its D- pull-up, resets the bus
+    100ms later and selects configuration 1 at address 0, which is all
+    V-USB needs. From then on it sends a keep-alive EOP every 1ms frame
+    and an IN token every 10 frames to endpoint 1 and, 5 frames later,
+    to endpoint 3, like a host honouring USB_CFG_INTR_POLL_INTERVAL.
+    Every DATA packet is acknowledged.
+
+    Packets are sent and read at the wire level: NRZI with bit
+    stuffing at 1.5Mbit/s, sync, PID, CRC5 on tokens and CRC16 on data.
+    A packet from the firmware is read from the edges it drives on D+
+    and D- between turning the pins to outputs and back, each bit
+    length rounded to the host's bit time. Packets that do not decode,
+    or arrive outside a transaction, count as bad; a DATA packet with
+    the same PID as the last one on its endpoint counts as repeated.
+    Keyboard reports are handed to kbd_host_report().
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "sim_avr.h"
+#include "sim_io.h"
+#include "sim_irq.h"
+#include "sim_cycle_timers.h"
+#include "avr_ioport.h"
+
+#include "sim.h"
+
+/// Bus states.
+#define USBHOST_SE0 0
+#define USBHOST_J 1
+#define USBHOST_K 2
+#define USBHOST_SE1 3
+
+/// PIDs.
+#define USBHOST_PID_SETUP 0x2d
+#define USBHOST_PID_IN 0x69
+#define USBHOST_PID_DATA0 0xc3
+#define USBHOST_PID_DATA1 0x4b
+#define USBHOST_PID_ACK 0xd2
+#define USBHOST_PID_NAK 0x5a
+
+/// Bit times a device has to start its answer.
+#define USBHOST_TIMEOUT_BITS 40
+/// Most bits in one burst from the host.
+#define USBHOST_BITS 512
+/// Most edges in one packet from the device.
+#define USBHOST_EDGES 256
+/// Largest packet payload on a low speed interrupt endpoint.
+#define USBHOST_PACKET 8
+/// Largest transfer read from an endpoint.
+#define USBHOST_TRANSFER 64
+
+/// Host states.
+enum usbhost_states {
+  USBHOST_DETACHED = 0,
+  USBHOST_CONNECTED,
+  USBHOST_RESETTING,
+  USBHOST_RUNNING,
+};
+
+/// What the host waits for after a burst.
+enum usbhost_waits {
+  USBHOST_WAIT_NONE = 0,
+  USBHOST_WAIT_DATA,
+  USBHOST_WAIT_HANDSHAKE,
+};
+
+static enum usbhost_states usbhost_state;
+static enum usbhost_waits usbhost_wait;
+/// Endpoint of the IN token in flight.
+static uint8_t usbhost_ep;
+/// 0 before SET_CONFIGURATION, 1 waiting for its status stage, 2 done.
+static uint8_t usbhost_config;
+/// Frames since the reset.
+static uint32_t usbhost_frames;
+/// Burst being sent, one bus state per bit, and where it is.
+static uint8_t usbhost_script[USBHOST_BITS];
+static uint16_t usbhost_script_len;
+static uint16_t usbhost_script_pos;
+static uint64_t usbhost_script_start;
+/// NRZI level and run of ones while building a packet.
+static uint8_t usbhost_nrzi;
+static uint8_t usbhost_ones;
+/// Packet from the device: bus state changes and their cycles.
+static uint8_t usbhost_rx_state[USBHOST_EDGES];
+static uint64_t usbhost_rx_cycle[USBHOST_EDGES];
+static uint16_t usbhost_rx_edges;
+/// Pull-up as last seen.
+static uint8_t usbhost_pullup;
+/// PID of the last DATA packet taken from endpoints 1 and 3.
+static uint8_t usbhost_toggle[2];
+/// Transfer being read from endpoints 1 and 3.
+static uint8_t usbhost_transfer[2][USBHOST_TRANSFER];
+static uint8_t usbhost_transfer_len[2];
+/// D+ and D- pins.
+static avr_irq_t *usbhost_dplus;
+static avr_irq_t *usbhost_dminus;
+
+/// Drive the bus from the host's side.
+static void usbhost_drive(uint8_t state)
+{
+  avr_raise_irq(usbhost_dplus, state == USBHOST_K || state == USBHOST_SE1);
+  avr_raise_irq(usbhost_dminus, state == USBHOST_J || state == USBHOST_SE1);
+}
+
+/// CRC5 of a token's 11 bits of address and endpoint.
+static uint8_t usbhost_crc5(uint16_t data)
+{
+  uint8_t crc = 0x1f;
+  uint8_t i;
+
+  for (i = 0; i < 11; i++) {
+    crc = ((data ^ crc) & 1) ? (crc >> 1) ^ 0x14 : crc >> 1;
+    data >>= 1;
+  }
+
+  return ~crc & 0x1f;
+}
+
+/// CRC16 of a data payload.
+static uint16_t usbhost_crc16(const uint8_t *data, uint8_t len)
+{
+  uint16_t crc = 0xffff;
+  uint8_t i;
+
+  while (len--) {
+    crc ^= *data++;
+    for (i = 0; i < 8; i++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+    }
+  }
+
+  return ~crc;
+}
+
+/// Add bits of one bus state to the burst.
+static void usbhost_script_state(uint8_t state, uint8_t bits)
+{
+  while (bits-- && (usbhost_script_len < USBHOST_BITS)) {
+    usbhost_script[usbhost_script_len++] = state;
+  }
+}
+
+/// Add a bit to the packet being built, NRZI coded and stuffed.
+static void usbhost_script_bit(uint8_t bit)
+{
+  if (!bit) {
+    usbhost_nrzi = usbhost_nrzi == USBHOST_J ? USBHOST_K : USBHOST_J;
+  }
+  usbhost_script_state(usbhost_nrzi, 1);
+  usbhost_ones = bit ? usbhost_ones + 1 : 0;
+  if (usbhost_ones == 6) {
+    usbhost_script_bit(0);
+  }
+}
+
+/// End of packet, which is also the low speed keep-alive.
+static void usbhost_script_eop(void)
+{
+  usbhost_script_state(USBHOST_SE0, 2);
+  usbhost_script_state(USBHOST_J, 1);
+}
+
+/// Add a packet to the burst: sync, the bytes and end of packet.
+static void usbhost_script_packet(const uint8_t *data, uint8_t len)
+{
+  uint8_t i;
+
+  usbhost_nrzi = USBHOST_J;
+  usbhost_ones = 0;
+  for (i = 0; i < 8; i++) {
+    usbhost_script_bit(i == 7);
+  }
+  while (len--) {
+    for (i = 0; i < 8; i++) {
+      usbhost_script_bit((*data >> i) & 1);
+    }
+    data++;
+  }
+  usbhost_script_eop();
+}
+
+/// Add a token to the burst.
+static void usbhost_script_token(uint8_t pid, uint8_t ep)
+{
+  uint16_t frame = ep << 7;
+  uint8_t token[3];
+
+  token[0] = pid;
+  token[1] = frame;
+  token[2] = (frame >> 8) | (usbhost_crc5(frame) << 3);
+  usbhost_script_packet(token, 3);
+}
+
+/// Add a handshake to the burst.
+static void usbhost_script_handshake(uint8_t pid)
+{
+  usbhost_script_packet(&pid, 1);
+}
+
+/// Nobody answered the last burst.
+static avr_cycle_count_t usbhost_timeout(avr_t *avr, avr_cycle_count_t when,
+                                         void *param)
+{
+  if ((usbhost_wait != USBHOST_WAIT_NONE) && !usbhost_rx_edges) {
+    sim_res.usb_timeout++;
+    usbhost_wait = USBHOST_WAIT_NONE;
+  }
+
+  return 0;
+}
+
+/// Step through the burst, one change of bus state per call.
+static avr_cycle_count_t usbhost_script_step(avr_t *avr,
+                                             avr_cycle_count_t when,
+                                             void *param)
+{
+  uint8_t state = usbhost_script[usbhost_script_pos];
+
+  usbhost_drive(state);
+  while ((usbhost_script_pos < usbhost_script_len) &&
+         (usbhost_script[usbhost_script_pos] == state)) {
+    usbhost_script_pos++;
+  }
+  if (usbhost_script_pos < usbhost_script_len) {
+    return usbhost_script_start + sim_us(usbhost_script_pos / 1.5);
+  }
+
+  usbhost_script_len = 0;
+  if (usbhost_wait != USBHOST_WAIT_NONE) {
+    avr_cycle_timer_register(avr, sim_us(USBHOST_TIMEOUT_BITS / 1.5),
+                             usbhost_timeout, NULL);
+  }
+
+  return 0;
+}
+
+/**
+   Send the burst built so far.
+
+   @param[in] wait What to wait for after it.
+*/
+static void usbhost_script_run(enum usbhost_waits wait)
+{
+  usbhost_wait = wait;
+  usbhost_script_pos = 0;
+  usbhost_script_start = sim_avr->cycle;
+  avr_cycle_timer_register(sim_avr, 1, usbhost_script_step, NULL);
+}
+
+/// Acknowledge a DATA packet, a turnaround after it.
+static void usbhost_ack(void)
+{
+  usbhost_script_len = 0;
+  usbhost_script_state(USBHOST_J, 2);
+  usbhost_script_handshake(USBHOST_PID_ACK);
+  usbhost_script_run(USBHOST_WAIT_NONE);
+}
+
+/**
+   Take a DATA packet from an interrupt endpoint. A transfer ends with
+   a packet shorter than USBHOST_PACKET.
+
+   @param[in] i    0 for endpoint 1, 1 for endpoint 3.
+   @param[in] pid  DATA0 or DATA1.
+   @param[in] data Payload.
+   @param[in] len  Its length.
+*/
+static void usbhost_data(uint8_t i, uint8_t pid, const uint8_t *data,
+                         uint8_t len)
+{
+  sim_res.usb_data[i]++;
+  if (pid == usbhost_toggle[i]) {
+    sim_res.usb_dup++;
+    return;
+  }
+  usbhost_toggle[i] = pid;
+
+  if (usbhost_transfer_len[i] + len <= USBHOST_TRANSFER) {
+    memcpy(usbhost_transfer[i] + usbhost_transfer_len[i], data, len);
+    usbhost_transfer_len[i] += len;
+  }
+  if (len < USBHOST_PACKET) {
+    if ((i == 0) && usbhost_transfer_len[i]) {
+      kbd_host_report(usbhost_transfer[i], usbhost_transfer_len[i]);
+    }
+    usbhost_transfer_len[i] = 0;
+  }
+}
+
+/**
+   Read the packet the firmware just sent, and act on it.
+*/
+static void usbhost_rx(void)
+{
+  double bit = sim_us(1000.0) / 1500.0;
+  uint8_t packet[3 + USBHOST_PACKET + 2];
+  uint8_t len = 0;
+  uint8_t count = 0;
+  uint8_t ones = 0;
+  uint8_t prev = USBHOST_J;
+  uint16_t bits = 0;
+  uint16_t e;
+  uint16_t n;
+  uint8_t ep = usbhost_ep == 3;
+
+  memset(packet, 0, sizeof(packet));
+  // The firmware drives J for a moment before the sync pattern.
+  e = 0;
+  while ((e < usbhost_rx_edges) && (usbhost_rx_state[e] == USBHOST_J)) {
+    e++;
+  }
+  for (; e + 1 < usbhost_rx_edges; e++) {
+    if (usbhost_rx_state[e] == USBHOST_SE0) {
+      break;
+    }
+    n = (usbhost_rx_cycle[e + 1] - usbhost_rx_cycle[e]) / bit + 0.5;
+    while (n--) {
+      uint8_t b = usbhost_rx_state[e] == prev;
+
+      prev = usbhost_rx_state[e];
+      if (ones == 6) {
+        // Stuffed bit.
+        ones = 0;
+        continue;
+      }
+      ones = b ? ones + 1 : 0;
+      if (bits++ < 8) {
+        // Sync.
+        continue;
+      }
+      if (len < sizeof(packet)) {
+        packet[len] |= b << count;
+      }
+      if (++count == 8) {
+        count = 0;
+        len++;
+      }
+    }
+  }
+  usbhost_rx_edges = 0;
+
+  if ((bits != 8 + 8 * len) || !len || (len > sizeof(packet)) ||
+      ((packet[0] & 0x0f) != ((~packet[0] >> 4) & 0x0f))) {
+    sim_res.usb_bad++;
+    return;
+  }
+
+  switch (usbhost_wait) {
+  case USBHOST_WAIT_DATA:
+    if ((packet[0] == USBHOST_PID_DATA0) || (packet[0] == USBHOST_PID_DATA1)) {
+      if ((len < 3) || (usbhost_crc16(packet + 1, len - 3) !=
+                        (packet[len - 2] | (packet[len - 1] << 8)))) {
+        sim_res.usb_bad++;
+        break;
+      }
+      usbhost_ack();
+      if (usbhost_ep == 0) {
+        usbhost_config = 2;
+      } else {
+        usbhost_data(ep, packet[0], packet + 1, len - 3);
+      }
+      return;
+    } else if ((packet[0] == USBHOST_PID_NAK) && usbhost_ep) {
+      sim_res.usb_nak[ep]++;
+    } else if (packet[0] != USBHOST_PID_NAK) {
+      sim_res.usb_bad++;
+    }
+    break;
+  case USBHOST_WAIT_HANDSHAKE:
+    if (packet[0] == USBHOST_PID_ACK) {
+      usbhost_config = 1;
+    }
+    break;
+  default:
+    sim_res.usb_bad++;
+  }
+  usbhost_wait = USBHOST_WAIT_NONE;
+}
+
+/// One frame: keep-alive, then the transaction that is due.
+static avr_cycle_count_t usbhost_frame(avr_t *avr, avr_cycle_count_t when,
+                                       void *param)
+{
+  static const uint8_t set_config[] = {
+    USBHOST_PID_DATA0, 0x00, 0x09, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0, 0
+  };
+  uint8_t setup[sizeof(set_config)];
+  uint16_t crc;
+
+  if (usbhost_state != USBHOST_RUNNING) {
+    return 0;
+  }
+  usbhost_frames++;
+  if (usbhost_script_len || usbhost_rx_edges ||
+      (usbhost_wait != USBHOST_WAIT_NONE)) {
+    // Still busy with the last frame's transaction.
+    return when + sim_us(1000.0);
+  }
+
+  usbhost_script_len = 0;
+  usbhost_script_eop();
+  usbhost_script_state(USBHOST_J, 4);
+  if (usbhost_config == 0) {
+    memcpy(setup, set_config, sizeof(setup));
+    crc = usbhost_crc16(setup + 1, 8);
+    setup[9] = crc;
+    setup[10] = crc >> 8;
+    usbhost_ep = 0;
+    usbhost_script_token(USBHOST_PID_SETUP, 0);
+    usbhost_script_state(USBHOST_J, 4);
+    usbhost_script_packet(setup, sizeof(setup));
+    usbhost_script_run(USBHOST_WAIT_HANDSHAKE);
+  } else if (usbhost_config == 1) {
+    usbhost_ep = 0;
+    usbhost_script_token(USBHOST_PID_IN, 0);
+    usbhost_script_run(USBHOST_WAIT_DATA);
+  } else if (usbhost_frames % 10 == 0 || usbhost_frames % 10 == 5) {
+    usbhost_ep = usbhost_frames % 10 ? 3 : 1;
+    sim_res.usb_in[usbhost_ep == 3]++;
+    usbhost_script_token(USBHOST_PID_IN, usbhost_ep);
+    usbhost_script_run(USBHOST_WAIT_DATA);
+  } else {
+    usbhost_script_run(USBHOST_WAIT_NONE);
+  }
+
+  return when + sim_us(1000.0);
+}
+
+/// End the bus reset and start sending frames.
+static avr_cycle_count_t usbhost_reset_end(avr_t *avr, avr_cycle_count_t when,
+                                           void *param)
+{
+  if (usbhost_state != USBHOST_RESETTING) {
+    return 0;
+  }
+  usbhost_drive(USBHOST_J);
+  usbhost_state = USBHOST_RUNNING;
+  usbhost_config = 0;
+  usbhost_frames = 0;
+  memset(usbhost_toggle, 0, sizeof(usbhost_toggle));
+  memset(usbhost_transfer_len, 0, sizeof(usbhost_transfer_len));
+  avr_cycle_timer_register(avr, sim_us(1000.0 + sim_cfg.usb_phase_us),
+                           usbhost_frame, NULL);
+
+  return 0;
+}
+
+/// Reset the bus, 100ms after the device connected.
+static avr_cycle_count_t usbhost_reset(avr_t *avr, avr_cycle_count_t when,
+                                       void *param)
+{
+  if (usbhost_state != USBHOST_CONNECTED) {
+    return 0;
+  }
+  usbhost_drive(USBHOST_SE0);
+  usbhost_state = USBHOST_RESETTING;
+  avr_cycle_timer_register(avr, sim_us(10000.0), usbhost_reset_end, NULL);
+
+  return 0;
+}
+
+/// Follow the pull-up and the packets the firmware sends.
+void usbhost_watch(void)
+{
+  uint8_t ddr = sim_avr->data[SIM_DDRD];
+  uint8_t port = sim_avr->data[SIM_PORTD];
+  uint8_t pullup = (ddr & port) & (1 << SIM_PULLUP_BIT);
+  uint8_t state;
+
+  if (pullup != usbhost_pullup) {
+    usbhost_pullup = pullup;
+    if (pullup) {
+      usbhost_state = USBHOST_CONNECTED;
+      usbhost_drive(USBHOST_J);
+      avr_cycle_timer_register(sim_avr, sim_us(100000.0), usbhost_reset,
+                               NULL);
+    } else {
+      usbhost_state = USBHOST_DETACHED;
+      usbhost_drive(USBHOST_SE0);
+    }
+  }
+
+  if (ddr & ((1 << SIM_DPLUS_BIT) | (1 << SIM_DMINUS_BIT))) {
+    state = (port & (1 << SIM_DPLUS_BIT) ? USBHOST_K : 0) |
+      (port & (1 << SIM_DMINUS_BIT) ? USBHOST_J : 0);
+    if ((usbhost_rx_edges < USBHOST_EDGES) &&
+        (!usbhost_rx_edges ||
+         (usbhost_rx_state[usbhost_rx_edges - 1] != state))) {
+      usbhost_rx_state[usbhost_rx_edges] = state;
+      usbhost_rx_cycle[usbhost_rx_edges] = sim_avr->cycle;
+      usbhost_rx_edges++;
+    }
+  } else if (usbhost_rx_edges) {
+    // The bus idles to J once the firmware lets go.
+    usbhost_drive(usbhost_state == USBHOST_DETACHED ?
+                  USBHOST_SE0 : USBHOST_J);
+    usbhost_rx();
+  }
+}
+
+void usbhost_init(void)
+{
+  usbhost_dplus = avr_io_getirq(sim_avr, AVR_IOCTL_IOPORT_GETIRQ('D'),
+                                SIM_DPLUS_BIT);
+  usbhost_dminus = avr_io_getirq(sim_avr, AVR_IOCTL_IOPORT_GETIRQ('D'),
+                                 SIM_DMINUS_BIT);
+  usbhost_state = USBHOST_DETACHED;
+  usbhost_wait = USBHOST_WAIT_NONE;
+  usbhost_pullup = 0;
+  usbhost_rx_edges = 0;
+  usbhost_script_len = 0;
+  usbhost_drive(USBHOST_SE0);
+}
@@ -0,0 +1,295 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+/** \file stats.c
+    \brief On-device instrumentation.
+
+    Keeps per-stage keystroke latency histograms so that lag can be
+    attributed to the ADB poll, the main loop or the USB interval. Every
+    key event carries a timestamp for each of the stats_stamps; once the
+    report carrying it has been picked up by the host the difference between
+    consecutive stamps is binned into a log2 histogram per stage.
+
+    The bringup milestones record how long after power up USB was
+    connected, the ADB bus was reset and the first report went to a
+    configured host.
+
+    The event counters track recoveries from faults: ADB transactions
+    abandoned by the supervisor and resets by the watchdog. The
+    watchdog count lives in a section that is not cleared at reset, so
+    it survives everything but a power cycle.
+
+    The report build costs compare the array and NKRO keyboard reports.
+    Most builds take only a few ticks, so the average over many reports
+    (ticks_total / count) is the useful figure.
+
+    The duty-cycle meter counts how long the processor spends awake and
+    asleep, see event_wait().
+
+    Only one key event is tracked at a time. If another key arrives
+    before the first has been reported it is not timed.
+
+    The RAM between the end of static data and the stack is painted
+    with STATS_PAINT before anything else runs, so how much of it the
+    stack has ever reached can be read back at runtime.
+
+    Timestamps come from the microsecond clock in clock.c. The
+    histograms can be read and cleared at runtime over USB
+    with vendor requests, see usbFunctionSetup().
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/wdt.h>
+
+#include "event.h"
+#include "stats.h"
+
+uint16_t stats_latency[STATS_STAGES][STATS_BUCKETS];
+
+struct stats_counters stats_count;
+
+struct stats_rx stats_rx;
+
+struct stats_isr stats_isr;
+
+struct stats_ram stats_ram;
+
+volatile uint8_t stats_isr_depth;
+
+/// End of static data, from the linker.
+extern uint8_t _end;
+/// Top of the stack, from the linker.
+extern uint8_t __stack;
+
+/**
+   Paint the free RAM with STATS_PAINT. Runs in .init1, before the
+   stack pointer is set up and r1 is cleared, so it cannot be C.
+*/
+void stats_paint(void) __attribute__((naked, used, section(".init1")));
+void stats_paint(void)
+{
+  __asm volatile (
+    "    ldi r30, lo8(_end)\n"
+    "    ldi r31, hi8(_end)\n"
+    "    ldi r24, %0\n"
+    "    ldi r25, hi8(__stack)\n"
+    "    rjmp 2f\n"
+    "1:  st Z+, r24\n"
+    "2:  cpi r30, lo8(__stack)\n"
+    "    cpc r31, r25\n"
+    "    brlo 1b\n"
+    "    breq 1b\n"
+    :: "M" (STATS_PAINT));
+}
+
+/// Watchdog resets, kept across resets.
+static uint16_t stats_wdt_reset __attribute__((section(".noinit")));
+
+struct stats_build stats_build[2];
+
+uint16_t stats_boot[STATS_BOOT_COUNT];
+
+uint32_t stats_duty[2];
+
+volatile uint16_t stats_stamp[STATS_STAMP_COUNT];
+
+/// Stamps of the key event currently being timed.
+static uint16_t stats_event[STATS_STAMP_COUNT];
+
+/// Progress of the key event being timed: 0 none, 1 registered,
+/// 2 in a report that has been handed to V-USB.
+static uint8_t stats_pending;
+
+/**
+   Find the log2 bucket for a latency.
+
+   @param[in] delta Latency in ticks.
+   @return          Bucket index.
+*/
+static uint8_t stats_bucket(uint16_t delta)
+{
+  uint8_t bucket = 0;
+
+  while ((delta >>= 1) != 0) {
+    bucket++;
+  }
+
+  return bucket;
+}
+
+/// Initialize the instrumentation and count watchdog resets.
+/**
+   Must be called before anything else touches MCUCSR, since the reset
+   flags are cleared here.
+*/
+void stats_init(void)
+{
+  if (MCUCSR & _BV(PORF)) {
+    stats_wdt_reset = 0;
+  } else if (MCUCSR & _BV(WDRF)) {
+    stats_wdt_reset++;
+  }
+  MCUCSR &= ~(_BV(PORF) | _BV(EXTRF) | _BV(BORF) | _BV(WDRF));
+
+  stats_reset();
+}
+
+/**
+   Start timing a key event. Call this once kb_register() has applied a
+   keycode. The ADB and translation stamps recorded so far are taken as
+   the start of the event.
+*/
+void stats_event_open(void)
+{
+  uint8_t i;
+
+  if (stats_pending) {
+    return;
+  }
+
+  for (i = STATS_STAMP_ADB_START; i <= STATS_STAMP_KB_REGISTER; i++) {
+    stats_event[i] = stats_stamp[i];
+  }
+  stats_pending = 1;
+}
+
+/**
+   Note that the key event is in a report. Call this once a report built
+   after stats_event_open() has been handed to V-USB.
+*/
+void stats_event_queued(void)
+{
+  if (stats_pending != 1) {
+    return;
+  }
+
+  stats_event[STATS_STAMP_REPORT_QUEUED] = stats_stamp[STATS_STAMP_REPORT_QUEUED];
+  stats_event[STATS_STAMP_USB_HANDOFF] = stats_stamp[STATS_STAMP_USB_HANDOFF];
+  stats_pending = 2;
+}
+
+/**
+   Finish timing a key event. Call this once the host has picked up a
+   report. Each stage of the pending event is added to its histogram.
+   Reports picked up before the one carrying the event are ignored.
+*/
+void stats_event_close(void)
+{
+  uint8_t i;
+  uint8_t bucket;
+
+  if (stats_pending != 2) {
+    return;
+  }
+
+  stats_event[STATS_STAMP_USB_PICKUP] = stats_stamp[STATS_STAMP_USB_PICKUP];
+
+  for (i = 0; i < STATS_STAGES; i++) {
+    // Unsigned subtraction handles the counter wrapping.
+    bucket = stats_bucket(stats_event[i + 1] - stats_event[i]);
+    if (stats_latency[i][bucket] != 0xffff) {
+      stats_latency[i][bucket]++;
+    }
+  }
+  stats_pending = 0;
+}
+
+/**
+   Add to the duty-cycle meter.
+
+   @param[in] awake  Ticks spent awake since the last call.
+   @param[in] asleep Ticks spent asleep since the last call.
+*/
+void stats_duty_account(uint16_t awake, uint16_t asleep)
+{
+  stats_duty[0] += awake;
+  stats_duty[1] += asleep;
+}
+
+/**
+   Record a bringup milestone. Only the first call for each milestone
+   counts. Milestones are not cleared by stats_reset().
+
+   @param[in] milestone One of stats_boot.
+*/
+void stats_boot_mark(uint8_t milestone)
+{
+  if (stats_boot[milestone] == 0) {
+    stats_boot[milestone] = event_now_ms();
+  }
+}
+
+/**
+   Count a recovery of the ADB state machine.
+
+   @param[in] ms How long the abandoned transaction had been running.
+*/
+void stats_adb_recovered(uint8_t ms)
+{
+  stats_count.adb_recover++;
+  if (ms > stats_count.adb_stall_max) {
+    stats_count.adb_stall_max = ms;
+  }
+}
+
+/**
+   Account for building a keyboard report.
+
+   @param[in] mode  USB_REPORT_* format that was built.
+   @param[in] start stats_now() from before the build.
+*/
+void stats_report_built(uint8_t mode, uint16_t start)
+{
+  uint16_t ticks = stats_now() - start;
+
+  stats_build[mode].count++;
+  stats_build[mode].ticks_total += ticks;
+  if (ticks > stats_build[mode].ticks_max) {
+    stats_build[mode].ticks_max = ticks;
+  }
+}
+
+/**
+   Measure RAM use. The stack has never reached the bytes above the
+   end of static data that still hold STATS_PAINT. This scans them all,
+   so it is only meant to be called when a host asks.
+*/
+void stats_ram_measure(void)
+{
+  const uint8_t *p = &_end;
+
+  while ((p <= &__stack) && (*p == STATS_PAINT)) {
+    p++;
+  }
+  stats_ram.static_bytes = &_end - (uint8_t *)RAMSTART;
+  stats_ram.stack_free = p - &_end;
+}
+
+/// Clear all histograms and counters and drop any pending event.
+void stats_reset(void)
+{
+  memset((void *)stats_latency, 0, sizeof(stats_latency));
+  memset((void *)stats_duty, 0, sizeof(stats_duty));
+  memset((void *)&stats_count, 0, sizeof(stats_count));
+  memset((void *)stats_build, 0, sizeof(stats_build));
+  memset((void *)&stats_rx, 0, sizeof(stats_rx));
+  memset((void *)&stats_isr, 0, sizeof(stats_isr));
+  memset((void *)stats_isr.sp_min, 0xff, sizeof(stats_isr.sp_min));
+  stats_count.wdt_reset = stats_wdt_reset;
+  stats_pending = 0;
+}
@@ -0,0 +1,258 @@
+// Copyright 2009 Devrin Talen
+// This file is part of ADBUSB.
+// 
+// ADBUSB is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// ADBUSB is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with ADBUSB.  If not, see <http://www.gnu.org/licenses/>.
+
+/** \file stats.h
+    \brief Global routines for on-device instrumentation.
+*/
+
+#ifndef __inc_stats__
+#define __inc_stats__
+
+#include <stdint.h>
+#include <avr/io.h>
+
+#include "clock.h"
+
+/// Length of one timestamp tick in microseconds (see clock_us16()).
+#define STATS_TICK_US 1
+
+/**
+   Points in the life of a key event. Each stage of latency is measured
+   from one stamp to the next:
+
+   - ADB_START to ADB_FRAME: the ADB poll itself.
+   - ADB_FRAME to ADB_READ: waiting for the main loop to pick the frame up.
+   - ADB_READ to KB_REGISTER: keycode translation.
+   - KB_REGISTER to REPORT_QUEUED: waiting for the USB interrupt endpoint.
+   - REPORT_QUEUED to USB_HANDOFF: handing the report to V-USB.
+   - USB_HANDOFF to USB_PICKUP: waiting for the host to poll the endpoint.
+*/
+enum stats_stamps {
+  STATS_STAMP_ADB_START = 0,
+  STATS_STAMP_ADB_FRAME,
+  STATS_STAMP_ADB_READ,
+  STATS_STAMP_KB_REGISTER,
+  STATS_STAMP_REPORT_QUEUED,
+  STATS_STAMP_USB_HANDOFF,
+  STATS_STAMP_USB_PICKUP,
+  STATS_STAMP_COUNT
+};
+
+/// Number of latency stages (one less than the number of stamps).
+#define STATS_STAGES (STATS_STAMP_COUNT - 1)
+/// Number of log2 buckets per histogram. Bucket n counts deltas of
+/// 2^n to 2^(n+1)-1 ticks, bucket 0 also counts zero.
+#define STATS_BUCKETS 16
+
+/**
+   Bringup milestones, in milliseconds since power up. Together they give
+   the time to the first usable report.
+*/
+enum stats_boot {
+  STATS_BOOT_USB_CONNECT = 0,
+  STATS_BOOT_ADB_READY,
+  STATS_BOOT_FIRST_REPORT,
+  STATS_BOOT_COUNT
+};
+
+/// Per-stage latency histograms.
+extern uint16_t stats_latency[STATS_STAGES][STATS_BUCKETS];
+
+/// Event counters, read as one block over USB.
+struct stats_counters {
+  /// ADB transactions abandoned by the supervisor (see adb_tick()).
+  uint16_t adb_recover;
+  /// Longest abandoned transaction, from its start to recovery, in ms.
+  uint16_t adb_stall_max;
+  /// Watchdog resets since power up. Not cleared by stats_reset().
+  uint16_t wdt_reset;
+  /// ADB responses of the wrong length.
+  uint16_t frame_malformed;
+  /// Malformed responses followed by a good one within ADB_RETRY_MAX.
+  uint16_t frame_recovered;
+  /// Malformed responses that were never recovered.
+  uint16_t frame_lost;
+  /// Keyboard reports handed to V-USB on endpoint 1.
+  uint16_t kb_reports;
+  /// Mouse reports handed to V-USB on endpoint 3.
+  uint16_t mouse_reports;
+  /// Times the keyboard stopped answering and its keys were released.
+  uint16_t kb_unplug;
+  /// Times a keyboard answered a probe again after that.
+  uint16_t kb_replug;
+  /// Longest time from the last keyboard response to releasing its
+  /// keys, in ms.
+  uint16_t kb_unplug_ms_max;
+};
+
+/// Event counters.
+extern struct stats_counters stats_count;
+
+/**
+   Cost of the ADB receive engine (see ADB_RX_SAMPLED), read as one
+   block over USB. The bit error rate is frame_malformed over frames.
+*/
+struct stats_rx {
+  /// Responses received.
+  uint32_t frames;
+  /// Receive interrupts taken.
+  uint32_t irqs;
+  /// Time spent in receive interrupt handlers, in timer1 counts (0.5us).
+  /// Estimated once per frame for the sampling engine, see
+  /// adb_rx_decode().
+  uint32_t isr_ticks;
+  /// Time spent decoding responses in adb_read_data(), in timer1 counts.
+  uint32_t decode_ticks;
+};
+
+/// Receive engine costs.
+extern struct stats_rx stats_rx;
+
+/// Interrupt nesting levels tracked in stats_isr.
+#define STATS_ISR_LEVELS 4
+
+/**
+   Interrupt timing, read as one block over USB. The ADB and tick
+   handlers re-enable interrupts on entry, so they nest with each other
+   and with V-USB's INT0 handler, which is assembly and not counted
+   here; 'make sweep' measures its entry latency in the simulator.
+   Neither is the sampling receive engine's timer2 handler, which is
+   kept as short as it can be. Stack use at a level is RAMEND minus its
+   sp_min.
+*/
+struct stats_isr {
+  /// Deepest nesting seen, 1 for a handler that was not interrupted.
+  uint8_t depth_max;
+  /// Handlers that interrupted another one.
+  uint16_t nested;
+  /// Lowest stack pointer on entry at each nesting level, 0xffff until
+  /// that level is reached. The last level also counts deeper ones.
+  uint16_t sp_min[STATS_ISR_LEVELS];
+  /// Largest error in an ADB bit cell time as timed by the edge engine,
+  /// in timer1 counts. Any latency in taking INT2 shows up here.
+  uint16_t cell_err_max;
+};
+
+/// Interrupt timing.
+extern struct stats_isr stats_isr;
+
+/// Handlers running right now, see stats_isr_enter().
+extern volatile uint8_t stats_isr_depth;
+
+/// Value free RAM is painted with at boot, see stats_ram_measure().
+#define STATS_PAINT 0xc5
+
+/**
+   RAM use, read as one block over USB. The stack high-water mark is
+   RAMEND + 1 - RAMSTART - static_bytes - stack_free.
+*/
+struct stats_ram {
+  /// Static data: .data, .bss and .noinit.
+  uint16_t static_bytes;
+  /// Bytes above static data the stack has never reached.
+  uint16_t stack_free;
+};
+
+/// RAM use, updated by stats_ram_measure().
+extern struct stats_ram stats_ram;
+
+/// Cost of building one format of keyboard report.
+struct stats_build {
+  /// Reports built.
+  uint16_t count;
+  /// Longest build, in ticks.
+  uint16_t ticks_max;
+  /// Total time spent building, in ticks.
+  uint32_t ticks_total;
+};
+
+/// Report build costs, indexed by USB_REPORT_* mode.
+extern struct stats_build stats_build[2];
+
+/// Time of each bringup milestone, 0 until it is reached.
+extern uint16_t stats_boot[STATS_BOOT_COUNT];
+
+/// Duty-cycle meter: ticks spent awake [0] and asleep [1].
+extern uint32_t stats_duty[2];
+
+/// Most recent value of each stamp.
+extern volatile uint16_t stats_stamp[STATS_STAMP_COUNT];
+
+/**
+   Read the timestamp counter. Stamps are the low 16 bits of the
+   microsecond clock, so latencies of up to 65ms can be measured.
+
+   @return Current time in ticks of STATS_TICK_US.
+*/
+static inline uint16_t stats_now(void)
+{
+  return clock_us16();
+}
+
+/**
+   Record a stamp. This is cheap enough to be called from the ADB
+   interrupt handlers.
+
+   @param[in] stamp One of stats_stamps.
+*/
+static inline void stats_mark(uint8_t stamp)
+{
+  stats_stamp[stamp] = stats_now();
+}
+
+/**
+   Count a handler in stats_isr. Call on entry to every ISR_NOBLOCK
+   handler, and stats_isr_leave() on every way out. A nested handler
+   always leaves before the one it interrupted, so the depth stays
+   balanced without an atomic increment.
+*/
+static inline void stats_isr_enter(void)
+{
+  uint8_t depth = ++stats_isr_depth;
+  uint16_t sp = SP;
+
+  if (depth > stats_isr.depth_max) {
+    stats_isr.depth_max = depth;
+  }
+  if (depth > 1) {
+    stats_isr.nested++;
+  }
+  if (depth > STATS_ISR_LEVELS) {
+    depth = STATS_ISR_LEVELS;
+  }
+  if (sp < stats_isr.sp_min[depth - 1]) {
+    stats_isr.sp_min[depth - 1] = sp;
+  }
+}
+
+/// Leave a handler counted by stats_isr_enter().
+static inline void stats_isr_leave(void)
+{
+  stats_isr_depth--;
+}
+
+void stats_init(void);
+void stats_event_open(void);
+void stats_event_queued(void);
+void stats_event_close(void);
+void stats_duty_account(uint16_t awake, uint16_t asleep);
+void stats_boot_mark(uint8_t milestone);
+void stats_adb_recovered(uint8_t ms);
+void stats_report_built(uint8_t mode, uint16_t start);
+void stats_ram_measure(void);
+void stats_reset(void);
+
+#endif
@@ -16,6 +16,12 @@
 
 /** \file uart.c
     \brief UART driver.
+
+    Output is buffered so that printf() never waits on the line: at 9600
+    baud a single line of text would otherwise hold up the main loop for
+    tens of milliseconds. The buffer is emptied one character at a time
+    by uart_drain(), which the main loop calls on every pass. When the
+    buffer is full further characters are dropped.
 */
 
 #include <stdio.h>
@@ -23,6 +29,15 @@
 #include <avr/io.h>
 #include <util/delay.h>
 
+#include "uart.h"
+
+/// Transmit buffer
+static char uart_buf[UART_BUF_SIZE];
+/// Index of the next character to send
+static uint8_t uart_head;
+/// Index of the next free slot
+static uint8_t uart_tail;
+
 /// Initialize driver resources
 void uart_init(void)
 {
@@ -30,14 +45,29 @@ void uart_init(void)
   UCSRB = _BV(TXEN); // enable tx
 }
 
-/// Send a single character on the UART.
+/// Queue a single character for the UART.
 int uart_putchar(char c, FILE *stream)
 {
+  uint8_t next;
+
   if (c == '\n')
     uart_putchar('\r', stream);
 
-  loop_until_bit_is_set(UCSRA, UDRE);
-  UDR = c;
+  next = (uart_tail + 1) % UART_BUF_SIZE;
+  if (next == uart_head) {
+    return 1;
+  }
+  uart_buf[uart_tail] = c;
+  uart_tail = next;
 
   return 0;
 }
+
+/// Send the next queued character if the UART is free.
+void uart_drain(void)
+{
+  if ((uart_head != uart_tail) && bit_is_set(UCSRA, UDRE)) {
+    UDR = uart_buf[uart_head];
+    uart_head = (uart_head + 1) % UART_BUF_SIZE;
+  }
+}
@@ -21,7 +21,11 @@
 #ifndef __inc_uart__
 #define __inc_uart__
 
+/// Size of the transmit buffer, in characters.
+#define UART_BUF_SIZE 64
+
 void uart_init(void);
 int uart_putchar(char c, FILE *stream);
+void uart_drain(void);
 
 #endif
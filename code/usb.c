@@ -22,12 +22,14 @@
 
 #include <stdint.h>
 #include <avr/io.h>
-#include <avr/interrupt.h>  /* for sei() */
-#include <util/delay.h>     /* for _delay_ms() */
 #include <avr/pgmspace.h>
 
 #include "usbdrv.h"
 #include "oddebug.h"
+#include "event.h"
+#include "keyboard.h"
+#include "sched.h"
+#include "stats.h"
 
 /// Keyboard HID Report Descriptor
 /**
@@ -53,13 +55,44 @@ extern const char usbHidReportDescriptor[] PROGMEM = {
   0x95, 0x04,		/* Report Count (4), */
   0x75, 0x08,		/* Report Size (8), */
   0x15, 0x00,		/* Logical Minimum (0), */
-  0x25, 0x75,		/* Logical Maximum(117), */
+  0x25, 0x7f,		/* Logical Maximum(127), */
   0x19, 0x00,		/* Usage Minimum (0), */
-  0x29, 0x75,		/* Usage Maximum (117), */
+  0x29, 0x7f,		/* Usage Maximum (127), */
   0x81, 0x00,		/* Input (Data, Array),               ;Key arrays (4 bytes) */
+
+  0x95, 0x05,            //   REPORT_COUNT (5)
+  0x75, 0x01,            //   REPORT_SIZE (1)
+  0x05, 0x08,            //   USAGE_PAGE (LEDs)
+  0x19, 0x01,            //   USAGE_MINIMUM (Num Lock)
+  0x29, 0x05,            //   USAGE_MAXIMUM (Kana)
+  0x91, 0x02,            //   OUTPUT (Data,Var,Abs)
+  0x95, 0x01,            //   REPORT_COUNT (1)
+  0x75, 0x03,            //   REPORT_SIZE (3)
+  0x91, 0x03,            //   OUTPUT (Cnst,Var,Abs)
+
+  /* NKRO bitmap, see keybNkroReport_t */
+  0x85, 0x03,            //   REPORT_ID (3)
+  0x05, 0x07,            //   USAGE_PAGE (Keyboard)
+  0x19, 0xe0,            //   USAGE_MINIMUM (Keyboard LeftControl)
+  0x29, 0xe7,            //   USAGE_MAXIMUM (Keyboard Right GUI)
+  0x15, 0x00,            //   LOGICAL_MINIMUM (0)
+  0x25, 0x01,            //   LOGICAL_MAXIMUM (1)
+  0x75, 0x01,            //   REPORT_SIZE (1)
+  0x95, 0x08,            //   REPORT_COUNT (8)
+  0x81, 0x02,            //   INPUT (Data,Var,Abs)
+  0x19, 0x00,            //   USAGE_MINIMUM (0)
+  0x29, 0x7f,            //   USAGE_MAXIMUM (127)
+  0x95, 0x80,            //   REPORT_COUNT (128)
+  0x81, 0x02,            //   INPUT (Data,Var,Abs)
   0xC0,		/* End Collection */
+};
 
-  /* mouse */
+/// Mouse HID Report Descriptor
+/**
+   The boot mouse report, see mouseReport_t. It has no report ID since
+   it is the only report on its interface.
+*/
+const char usbHidMouseReportDescriptor[] PROGMEM = {
   0x05, 0x01,	/* Usage Page (Generic Desktop), */
   0x09, 0x02,	/* Usage (Mouse), */
   0xA1, 0x01,	/* Collection (Application), */
@@ -70,7 +103,6 @@ extern const char usbHidReportDescriptor[] PROGMEM = {
   0x29, 0x03,		/* Usage Maximun (03), */
   0x15, 0x00,		/* Logical Minimum (0), */
   0x25, 0x01,		/* Logical Maximum (1), */
-  0x85, 0x02,		/* Report Id (2) */
   0x95, 0x03,		/* Report Count (3), */
   0x75, 0x01,		/* Report Size (1), */
   0x81, 0x02,		/* Input (Data, Variable, Absolute), ;3 button bits */
@@ -89,33 +121,312 @@ extern const char usbHidReportDescriptor[] PROGMEM = {
   0xC0,		/* End Collection */
 };
 
+/// Configuration descriptor
+/**
+   Replaces the one built into V-USB, which only has one interface. The
+   keyboard is interface 0 on endpoint 1 and the mouse is interface 1 on
+   endpoint 3, so mouse motion never waits behind a keyboard report.
+*/
+const char usbDescriptorConfiguration[] PROGMEM = {
+  9,                    // bLength
+  USBDESCR_CONFIG,      // bDescriptorType
+  USB_PROP_LENGTH(USB_CFG_DESCR_PROPS_CONFIGURATION), 0, // wTotalLength
+  2,                    // bNumInterfaces
+  1,                    // bConfigurationValue
+  0,                    // iConfiguration
+  (1 << 7),             // bmAttributes: bus powered
+  USB_CFG_MAX_BUS_POWER/2, // bMaxPower, in 2mA units
+
+  /* keyboard */
+  9,                    // bLength
+  USBDESCR_INTERFACE,   // bDescriptorType
+  USB_INTERFACE_KEYBOARD, // bInterfaceNumber
+  0,                    // bAlternateSetting
+  1,                    // bNumEndpoints
+  USB_CFG_INTERFACE_CLASS,
+  USB_CFG_INTERFACE_SUBCLASS,
+  USB_CFG_INTERFACE_PROTOCOL,
+  0,                    // iInterface
+  9,                    // bLength
+  USBDESCR_HID,         // bDescriptorType
+  0x01, 0x01,           // bcdHID
+  0x00,                 // bCountryCode
+  1,                    // bNumDescriptors
+  USBDESCR_HID_REPORT,  // bDescriptorType
+  USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH, 0, // wDescriptorLength
+  7,                    // bLength
+  USBDESCR_ENDPOINT,    // bDescriptorType
+  (char)0x81,           // bEndpointAddress: IN 1
+  0x03,                 // bmAttributes: interrupt
+  8, 0,                 // wMaxPacketSize
+  USB_CFG_INTR_POLL_INTERVAL, // bInterval, in ms
+
+  /* mouse */
+  9,                    // bLength
+  USBDESCR_INTERFACE,   // bDescriptorType
+  USB_INTERFACE_MOUSE,  // bInterfaceNumber
+  0,                    // bAlternateSetting
+  1,                    // bNumEndpoints
+  3,                    // bInterfaceClass: HID
+  1,                    // bInterfaceSubClass: boot
+  2,                    // bInterfaceProtocol: mouse
+  0,                    // iInterface
+  9,                    // bLength
+  USBDESCR_HID,         // bDescriptorType
+  0x01, 0x01,           // bcdHID
+  0x00,                 // bCountryCode
+  1,                    // bNumDescriptors
+  USBDESCR_HID_REPORT,  // bDescriptorType
+  sizeof(usbHidMouseReportDescriptor), 0, // wDescriptorLength
+  7,                    // bLength
+  USBDESCR_ENDPOINT,    // bDescriptorType
+  (char)(0x80 | USB_CFG_EP3_NUMBER), // bEndpointAddress: IN 3
+  0x03,                 // bmAttributes: interrupt
+  8, 0,                 // wMaxPacketSize
+  USB_CFG_INTR_POLL_INTERVAL, // bInterval, in ms
+};
+
+_Static_assert(sizeof(usbDescriptorConfiguration) ==
+               USB_PROP_LENGTH(USB_CFG_DESCR_PROPS_CONFIGURATION),
+               "configuration descriptor length out of sync with usbconfig.h");
+
+/// Offset of the keyboard HID descriptor in the configuration descriptor.
+#define USB_HID_KEYBOARD_OFFSET 18
+/// Offset of the mouse HID descriptor in the configuration descriptor.
+#define USB_HID_MOUSE_OFFSET 43
+
 /// Keyboard idle rate
 /**
    For some reason the HID spec wants us to track this.
 */
 static uint8_t idle_rate;
 
+uint8_t usb_led_state;
+
+uint8_t usb_report_mode = USB_REPORT_ARRAY;
+
+keybReport_t keybReportBuffer = {1, 0, {0, 0, 0, 0}};
+
+keybNkroReport_t keybNkroReportBuffer = {3, 0, {0}};
+
+mouseReport_t mouseReportBuffer = {0, 0, 0};
+
+/// GET_REPORT reply for the keyboard interface.
+static union {
+  keybReport_t keyb;
+  keybNkroReport_t nkro;
+} usb_get_report;
+
+/// Next byte of the report being sent by usb_report().
+static uchar *usb_report_ptr;
+/// Bytes of the report not yet handed to the driver.
+static uchar usb_report_left;
+/// Non-zero while a packet is waiting in the driver for the host.
+static uchar usb_report_loaded;
+/// Length of the report left in usbTxBuf1 by usb_report_commit(), 0 if
+/// the buffer holds anything else.
+static uchar usb_report_block;
+/// Non-zero if the report ended on a full packet and needs a zero-length one.
+static uchar usb_report_zlp;
+
+/// Reply to vendor requests that only return a status.
+static uchar usb_status;
+
+/// Milliseconds left in the fake disconnect, 0 once connected.
+static uint8_t usb_disconnect_ms;
+
 /// Initialize USB hardware
 /**
-   Initialize any resources needed by the USB code and hardware.
+   Initialize any resources needed by the USB code and hardware. This
+   starts a fake disconnect to enforce re-enumeration, which is ended by
+   usb_tick() after USB_DISCONNECT_MS. The USB interrupt stays disabled
+   until then, since its handler would hang on a disconnected bus.
+   Interrupts are not enabled here, that is left to the caller.
 */
 void usb_init()
 {
-  uint8_t i;
-
   //odDebugInit();
 
-  usbDeviceDisconnect();  /* enforce re-enumeration, do this while interrupts are disabled! */
-  i = 0;
-  while(--i){             /* fake USB disconnect for > 250 ms */
-    _delay_ms(1.0);
+  usbDeviceDisconnect();
+  usb_disconnect_ms = USB_DISCONNECT_MS;
+
+  return;
+}
+
+/// Step the fake disconnect.
+/**
+   Must be called once per millisecond. Connects to the bus and starts
+   the driver once the disconnect is over.
+*/
+void usb_tick()
+{
+  if (usb_disconnect_ms == 0) {
+    return;
+  }
+
+  usb_disconnect_ms--;
+  if (usb_disconnect_ms == 0) {
+    usbDeviceConnect();
+    usbInit();
+    stats_boot_mark(STATS_BOOT_USB_CONNECT);
+  }
+}
+
+/// Service the USB driver.
+/**
+   Calls usbPoll() once the driver has been started by usb_tick().
+*/
+void usb_poll()
+{
+  if (usb_disconnect_ms == 0) {
+    usbPoll();
   }
-  usbDeviceConnect();
+}
 
-  usbInit();
-  sei();
+/// Send a report on the interrupt endpoint.
+/**
+   Low speed interrupt packets carry at most 8 bytes, so longer reports
+   are split and handed to the driver one packet per poll of the
+   interrupt endpoint by usb_report_continue(). A report that ends on a
+   full packet is followed by a zero-length one so the host knows it is
+   complete. The data must stay put until usb_report_busy() is false.
 
-  return;
+   @param[in]  data    Report to send, starting with the report ID.
+   @param[in]  len     Length of the report.
+*/
+void usb_report(void *data, uchar len)
+{
+  usb_report_block = 0;
+  usb_report_ptr = data;
+  usb_report_left = len;
+  usb_report_zlp = (len != 0) && ((len % 8) == 0);
+  usb_report_continue();
+}
+
+/// Hand the next packet of a report to the driver, if it has room.
+/**
+   Should be called on every pass of the main loop. The driver only has
+   room again once the host has polled the endpoint and picked up the
+   last packet, so this also tells the caller when the host polled.
+
+   @return     Non-zero if the host picked up a packet since the last
+               call.
+*/
+uchar usb_report_continue()
+{
+  uchar len;
+  uchar picked;
+
+  if (!usbInterruptIsReady()) {
+    return 0;
+  }
+  picked = usb_report_loaded;
+  usb_report_loaded = 0;
+  if (usb_report_left == 0) {
+    if (usb_report_zlp) {
+      usb_report_zlp = 0;
+      usbSetInterrupt(usb_report_ptr, 0);
+      usb_report_loaded = 1;
+    }
+    return picked;
+  }
+
+  len = (usb_report_left > 8) ? 8 : usb_report_left;
+  usbSetInterrupt(usb_report_ptr, len);
+  usb_report_ptr += len;
+  usb_report_left -= len;
+  usb_report_loaded = 1;
+  return picked;
+}
+
+/// Check whether a report is still being sent.
+/**
+   @return     Non-zero until the last packet of the report has been
+               picked up by the host.
+*/
+uchar usb_report_busy()
+{
+  return usb_report_left || usb_report_zlp || !usbInterruptIsReady();
+}
+
+/// Start a report in place.
+/**
+   Returns where to write a report of up to 8 bytes straight into the
+   driver's transmit buffer, saving the copy in usbSetInterrupt(). The
+   report must be finished with usb_report_commit() before the next call
+   into the driver. Only valid while usb_report_busy() is false, the
+   buffer is not being sent then.
+
+   @return     Where the report goes, starting with the report ID.
+*/
+uchar *usb_report_begin()
+{
+  return &usbTxBuf1[1];
+}
+
+/// Finish a report started with usb_report_begin() and send it.
+/**
+   Does what usbSetInterrupt() does after its copy: toggles the data PID
+   and appends the CRC.
+
+   @param[in]  len     Length of the report, at most 8.
+*/
+void usb_report_commit(uchar len)
+{
+  usbTxBuf1[0] ^= USBPID_DATA0 ^ USBPID_DATA1;
+  usbCrc16Append(&usbTxBuf1[1], len);
+  usb_report_block = len;
+  usb_report_loaded = 1;
+  usbTxLen1 = len + 4; // including the sync byte
+}
+
+/// Send the last committed report again.
+/**
+   The report and its CRC are still in the transmit buffer after the host
+   has picked it up, only the data PID has to be toggled. Fails if the
+   buffer has been used for anything else since, or is still busy.
+
+   @return     0 if the report was sent again.
+*/
+uchar usb_report_repeat()
+{
+  if ((usb_report_block == 0) || usb_report_busy()) {
+    return 1;
+  }
+
+  usbTxBuf1[0] ^= USBPID_DATA0 ^ USBPID_DATA1;
+  usb_report_loaded = 1;
+  usbTxLen1 = usb_report_block + 4;
+
+  return 0;
+}
+
+/// Handle GET_DESCRIPTOR for the HID descriptors.
+/**
+   V-USB only knows about one interface, so the HID and report
+   descriptors are looked up here by the interface in wIndex.
+
+   @param[in]  rq      SETUP transaction data.
+   @return     Length of the descriptor, or 0 if there is none.
+*/
+usbMsgLen_t usbFunctionDescriptor(struct usbRequest *rq)
+{
+  uchar mouse = (rq->wIndex.bytes[0] == USB_INTERFACE_MOUSE);
+
+  if (rq->wValue.bytes[1] == USBDESCR_HID) {
+    usbMsgPtr = (void *)(usbDescriptorConfiguration +
+                         (mouse ? USB_HID_MOUSE_OFFSET
+                                : USB_HID_KEYBOARD_OFFSET));
+    return 9;
+  } else if (rq->wValue.bytes[1] == USBDESCR_HID_REPORT) {
+    if (mouse) {
+      usbMsgPtr = (void *)usbHidMouseReportDescriptor;
+      return sizeof(usbHidMouseReportDescriptor);
+    }
+    usbMsgPtr = (void *)usbHidReportDescriptor;
+    return USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH;
+  }
+  return 0;
 }
 
 /// Handle SETUP transactions.
@@ -135,15 +446,125 @@ usbMsgLen_t usbFunctionSetup(uchar data[8])
   if ((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_CLASS) {
     // wValue: ReportType (highbyte), ReportID (lowbyte)
     if (rq->bRequest == USBRQ_HID_GET_REPORT) {
-      // we only have one report type, so don't look at wValue
-      usbMsgPtr = (void *)&mouseReportBuffer;
-      return sizeof(mouseReportBuffer);
+      if (rq->wIndex.bytes[0] == USB_INTERFACE_MOUSE) {
+        usbMsgPtr = (void *)&mouseReportBuffer;
+        return sizeof(mouseReportBuffer);
+      }
+      // The keyboard has two input reports. Whichever is asked for is
+      // built from the keyboard state, since the array report is only
+      // kept in the driver's transmit buffer and the other format may
+      // not have been sent at all.
+      usbMsgPtr = (void *)&usb_get_report;
+      if (rq->wValue.bytes[0] == keybNkroReportBuffer.id) {
+        usb_get_report.nkro.id = keybNkroReportBuffer.id;
+        usb_get_report.nkro.meta = kb_usbhid_modifiers();
+        kb_usbhid_bitmap(usb_get_report.nkro.bits);
+        return sizeof(keybNkroReport_t);
+      } else if ((rq->wValue.bytes[0] == 0) ||
+                 (rq->wValue.bytes[0] == keybReportBuffer.id)) {
+        usb_get_report.keyb.id = keybReportBuffer.id;
+        usb_get_report.keyb.meta = kb_usbhid_modifiers();
+        kb_usbhid_keys(usb_get_report.keyb.b);
+        return sizeof(keybReport_t);
+      }
     } else if (rq->bRequest == USBRQ_HID_GET_IDLE) {
       usbMsgPtr = &idle_rate;
       return sizeof(idle_rate);
     } else if (rq->bRequest == USBRQ_HID_SET_IDLE) {
       idle_rate = rq->wValue.bytes[1];
+    } else if (rq->bRequest == USBRQ_HID_SET_REPORT) {
+      // LED output report, the data stage goes to usbFunctionWrite()
+      return USB_NO_MSG;
+    }
+  } else if ((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_VENDOR) {
+    if (rq->bRequest == USBRQ_VENDOR_STATS_LATENCY) {
+      usbMsgPtr = (void *)stats_latency;
+      return sizeof(stats_latency);
+    } else if (rq->bRequest == USBRQ_VENDOR_STATS_DUTY) {
+      usbMsgPtr = (void *)stats_duty;
+      return sizeof(stats_duty);
+    } else if (rq->bRequest == USBRQ_VENDOR_STATS_BOOT) {
+      usbMsgPtr = (void *)stats_boot;
+      return sizeof(stats_boot);
+    } else if (rq->bRequest == USBRQ_VENDOR_STATS_COUNTERS) {
+      usbMsgPtr = (void *)&stats_count;
+      return sizeof(stats_count);
+    } else if (rq->bRequest == USBRQ_VENDOR_STATS_BUILD) {
+      usbMsgPtr = (void *)stats_build;
+      return sizeof(stats_build);
+    } else if (rq->bRequest == USBRQ_VENDOR_STATS_SCHED) {
+      usbMsgPtr = (void *)&sched_stats;
+      return sizeof(sched_stats);
+    } else if (rq->bRequest == USBRQ_VENDOR_STATS_RX) {
+      usbMsgPtr = (void *)&stats_rx;
+      return sizeof(stats_rx);
+    } else if (rq->bRequest == USBRQ_VENDOR_STATS_ISR) {
+      usbMsgPtr = (void *)&stats_isr;
+      return sizeof(stats_isr);
+    } else if (rq->bRequest == USBRQ_VENDOR_STATS_RAM) {
+      stats_ram_measure();
+      usbMsgPtr = (void *)&stats_ram;
+      return sizeof(stats_ram);
+    } else if (rq->bRequest == USBRQ_VENDOR_REMAP_SET) {
+      kb_remap_set(rq->wValue.bytes[0], rq->wValue.bytes[1]);
+      event_post(EVENT_KEYS);
+    } else if (rq->bRequest == USBRQ_VENDOR_REMAP_READ) {
+      usbMsgPtr = (void *)kb_remap;
+      return sizeof(kb_remap);
+    } else if (rq->bRequest == USBRQ_VENDOR_REMAP_CLEAR) {
+      kb_remap_clear();
+      event_post(EVENT_KEYS);
+    } else if (rq->bRequest == USBRQ_VENDOR_MACRO_BEGIN) {
+      usb_status = kb_macro_begin(rq->wValue.bytes[0]);
+      event_post(EVENT_KEYS);
+      usbMsgPtr = &usb_status;
+      return sizeof(usb_status);
+    } else if (rq->bRequest == USBRQ_VENDOR_MACRO_STEP) {
+      usb_status = kb_macro_step(rq->wValue.bytes[0], rq->wValue.bytes[1]);
+      usbMsgPtr = &usb_status;
+      return sizeof(usb_status);
+    } else if (rq->bRequest == USBRQ_VENDOR_LAYER_SET) {
+      usb_status = kb_layer_set(rq->wValue.bytes[0], rq->wValue.bytes[1]);
+      event_post(EVENT_KEYS);
+      usbMsgPtr = &usb_status;
+      return sizeof(usb_status);
+    } else if (rq->bRequest == USBRQ_VENDOR_LAYER_FN) {
+      kb_layer_fn(rq->wValue.bytes[0]);
+      event_post(EVENT_KEYS);
+    } else if (rq->bRequest == USBRQ_VENDOR_ARENA_CLEAR) {
+      kb_arena_clear();
+      event_post(EVENT_KEYS);
+    } else if (rq->bRequest == USBRQ_VENDOR_USAGE_TO_ADB) {
+      usb_status = kb_usbhid_to_adb(rq->wValue.bytes[0]);
+      usbMsgPtr = &usb_status;
+      return sizeof(usb_status);
+    } else if (rq->bRequest == USBRQ_VENDOR_REPORT_MODE) {
+      if (rq->wValue.bytes[0] <= USB_REPORT_NKRO) {
+        usb_report_mode = rq->wValue.bytes[0];
+      }
+    } else if (rq->bRequest == USBRQ_VENDOR_STATS_RESET) {
+      stats_reset();
+      sched_reset();
     }
   }
   return 0;
 }
+
+/// Handle the data stage of a SET_REPORT request.
+/**
+   The only output report is the keyboard LED state, which arrives as the
+   report ID followed by one byte of LED bits. The main loop is told about
+   the change with EVENT_LED.
+
+   @param[in]  data    Data received from the host.
+   @param[in]  len     Length of data.
+   @return     1 when the transfer is complete.
+*/
+uchar usbFunctionWrite(uchar *data, uchar len)
+{
+  if ((len >= 2) && (data[0] == 1)) {
+    usb_led_state = data[1];
+    event_post(EVENT_LED);
+  }
+  return 1;
+}
@@ -25,9 +25,90 @@
 #include "usbdrv.h"
 #include "oddebug.h"
 
+/// Interface number of the keyboard, on endpoint 1.
+#define USB_INTERFACE_KEYBOARD 0
+/// Interface number of the mouse, on endpoint 3.
+#define USB_INTERFACE_MOUSE 1
+
+/// Length of the fake disconnect at power up, in ms (must be > 250).
+#define USB_DISCONNECT_MS 255
+
 void usb_init();
+void usb_tick();
+void usb_poll();
+void usb_report(void *data, uchar len);
+uchar usb_report_continue();
+uchar usb_report_busy();
+uchar *usb_report_begin();
+void usb_report_commit(uchar len);
+uchar usb_report_repeat();
+
+/// Vendor request: read the latency histograms (see stats.h).
+#define USBRQ_VENDOR_STATS_LATENCY 0x01
+/// Vendor request: clear the latency histograms, counters and scheduler measurements.
+#define USBRQ_VENDOR_STATS_RESET 0x02
+/// Vendor request: read the duty-cycle meter (see stats.h).
+#define USBRQ_VENDOR_STATS_DUTY 0x03
+/// Vendor request: read the bringup milestones (see stats.h).
+#define USBRQ_VENDOR_STATS_BOOT 0x04
+/// Vendor request: read the event counters (see stats.h).
+#define USBRQ_VENDOR_STATS_COUNTERS 0x05
+/// Vendor request: select the keyboard report, wValue is a USB_REPORT_* mode.
+#define USBRQ_VENDOR_REPORT_MODE 0x06
+/// Vendor request: read the report build costs (see stats.h).
+#define USBRQ_VENDOR_STATS_BUILD 0x07
+/// Vendor request: read the main loop scheduler measurements (see sched.h).
+#define USBRQ_VENDOR_STATS_SCHED 0x08
+/// Vendor request: read the ADB receive engine costs (see stats.h).
+#define USBRQ_VENDOR_STATS_RX 0x09
+/// Vendor request: read the interrupt nesting and timing (see stats.h).
+#define USBRQ_VENDOR_STATS_ISR 0x0a
+/// Vendor request: measure and read RAM use (see stats.h).
+#define USBRQ_VENDOR_STATS_RAM 0x0b
+/// Vendor request: remap a key, wValue is the ADB keycode pressed (low
+/// byte) and the keycode to register it as (high byte).
+#define USBRQ_VENDOR_REMAP_SET 0x0c
+/// Vendor request: read the remap table, one keycode per ADB keycode.
+#define USBRQ_VENDOR_REMAP_READ 0x0d
+/// Vendor request: map every key back to itself.
+#define USBRQ_VENDOR_REMAP_CLEAR 0x0e
+/// Vendor request: start a macro on the ADB keycode in wValue. Replies
+/// with one status byte, 0 for success.
+#define USBRQ_VENDOR_MACRO_BEGIN 0x0f
+/// Vendor request: add a step to the macro, wValue is the modifier byte
+/// (low byte) and usage (high byte). Replies with one status byte.
+#define USBRQ_VENDOR_MACRO_STEP 0x10
+/// Vendor request: put a key on the Fn layer, wValue is the ADB keycode
+/// pressed (low byte) and the keycode to register it as (high byte).
+/// Replies with one status byte.
+#define USBRQ_VENDOR_LAYER_SET 0x11
+/// Vendor request: choose the Fn key, wValue is its ADB keycode or 0xff.
+#define USBRQ_VENDOR_LAYER_FN 0x12
+/// Vendor request: drop the Fn layer and all macros.
+#define USBRQ_VENDOR_ARENA_CLEAR 0x13
+/// Vendor request: look up the ADB keycode of the HID usage in wValue,
+/// for a host that names keys by usage when remapping. Replies with
+/// one byte, the keycode or 0xff if no key has that usage.
+#define USBRQ_VENDOR_USAGE_TO_ADB 0x14
+
+/// Boot-style report with an array of KB_REPORT_KEYS keys (report ID 1).
+#define USB_REPORT_ARRAY 0
+/// Bitmap report with every key usage up to 0x7f (report ID 3).
+#define USB_REPORT_NKRO 1
+
+/**
+   Keyboard report format in use. The array report is the default since
+   every host understands it. The NKRO report has no rollover limit but
+   takes three packets, so three polls of the interrupt endpoint, to
+   send.
+*/
+extern uint8_t usb_report_mode;
+
+/// Keyboard LED state from the host, in HID LED usage order.
+extern uint8_t usb_led_state;
 
 usbMsgLen_t usbFunctionSetup(uchar data[8]);
+uchar usbFunctionWrite(uchar *data, uchar len);
 
 /// Keyboard HID descriptor
 typedef struct {
@@ -36,18 +117,35 @@ typedef struct {
   char b[4];
 } keybReport_t;
 
+/// Keyboard NKRO HID descriptor
+/**
+   One bit per key usage from 0x00 to 0x7f. Usages above that are
+   international and language keys that ADB keyboards do not have, and
+   leaving them out keeps the report at three packets.
+*/
+typedef struct {
+  char id;
+  char meta;
+  uchar bits[16];
+} keybNkroReport_t;
+
 /// Mouse HID descriptor
+/**
+   Boot mouse report, sent on its own endpoint so it has no report ID.
+*/
 typedef struct{
-  char id;
   uchar buttonMask;
   char dx;
   char dy;
 } mouseReport_t;
 
 /// Keyboard HID report buffer
-static keybReport_t keybReportBuffer = {1, 0, {0, 0, 0, 0}};
+extern keybReport_t keybReportBuffer;
+
+/// Keyboard NKRO HID report buffer
+extern keybNkroReport_t keybNkroReportBuffer;
 
 /// Mouse HID report buffer
-static mouseReport_t mouseReportBuffer = {2, 0, 0, 0};
+extern mouseReport_t mouseReportBuffer;
 
 #endif